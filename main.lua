@@ -115,6 +115,25 @@ function update_status(objkey, hist)
     hist[objkey] = nil
 end
 
+-- objects and load index keys collected by batch command of each request
+-- coroutine, requests are interleaved when budget of coroutine runs out
+batches = setmetatable({}, {__mode = "k"})
+
+function batch_get()
+    return batches[coroutine.running()]
+end
+
+-- status of object is recalculated once at the end of batch command
+function update_status_later(objkey)
+    local batch = batch_get()
+    if batch ~= nil then
+        batch.status[objkey] = 1
+        return
+    end
+    local hist = {}
+    update_status(objkey, hist)
+end
+
 ------------------------------------------------------------------------------------
 ---------------------------------EVENT----------------------------------------------
 ------------------------------------------------------------------------------------
@@ -136,27 +155,11 @@ function evt_del(evtkey)
     load_index_del("evt.", evtkey)
 end
 
+-- returns changed fields or nil
 function evt_add(evtkey, event)
-    za_db.hset("evt.", evtkey, event)
+    local changed = za_db.hset("evt.", evtkey, event)
     load_index_add("evt.", evtkey)
-end
-
-function get_all_events(objkey, out, hist)
-    hist[objkey] = 1
-    local events = rel_get_child("obj.", objkey, "evt.")
-    for event_key, from in pairs(events) do
-        out[event_key] = 0
-    end
-    local child = rel_get_child("obj.", objkey, "obj.")
-    for child_key, from in pairs(child) do
-        if hist[child_key] == nil then
-            get_all_events(child_key, out, hist)
-        else
-            print("circle found " .. objkey .. " to " .. dump(child_key))
-            print(dump(hist))
-        end
-    end
-    hist[objkey] = nil
+    return changed
 end
 
 ------------------------------------------------------------------------------------
@@ -167,11 +170,13 @@ function filter_get(fltkey)
     return za_db.hgetall("filter.", fltkey)
 end
 
-function filter_get_obj(event)
+-- only filters on fields are checked, all event fields by default
+function filter_get_obj(event, fields)
     local db = za_db
     local out = {}
     local match_filters = {}
-    for field, field_val in pairs(event) do
+    for field, v in pairs(fields or event) do
+        local field_val = event[field]
         local filters = db.hgetall("filter.index." .. field, field_val)
         for filter_key, v in pairs(filters) do
             match_filters[filter_key] = 0 --TODO use the counter?
@@ -253,11 +258,11 @@ function rel_add(parent_class, parent_key, child_class, child_key)
     local subclass = parent_class .. child_class
     local t = {}
     t[child_key] = parent_key
-    db.hset("rel.index.child." .. subclass, parent_key, t)
+    local changed = db.hset("rel.index.child." .. subclass, parent_key, t)
 
     local t = {}
     t[parent_key] = child_key
-    db.hset("rel.index.parent." .. subclass, child_key, t)
+    changed = db.hset("rel.index.parent." .. subclass, child_key, t) or changed
 
     local t = {}
     t["parent_class"] = parent_class
@@ -266,10 +271,11 @@ function rel_add(parent_class, parent_key, child_class, child_key)
     t["child_key"] = child_key
     local keylen = string.len(parent_key)
     local relkey = parent_key .. "." .. child_key .. "." .. keylen
-    db.hset("rel." .. subclass, relkey, t)
+    changed = db.hset("rel." .. subclass, relkey, t) or changed
 
-    local hist = {}
-    update_status(parent_key, hist)
+    if changed then
+        update_status_later(parent_key)
+    end
     load_index_add("rel." .. subclass, relkey)
 end
 
@@ -331,7 +337,7 @@ end
 ---------------------------------LOAD INDEX-----------------------------------------
 ------------------------------------------------------------------------------------
 
-function load_index_add(class, key)
+function load_index_cfg(class)
     local db = za_db
     local now_counter = db.hget("load.index." .. class, "cfg", "now")
     local old_counter = db.hget("load.index." .. class, "cfg", "old")
@@ -343,10 +349,36 @@ function load_index_add(class, key)
         t["old"] = old_counter
         db.hset("load.index." .. class, "cfg", t)
     end
+    return now_counter, old_counter
+end
+
+function load_index_add(class, key)
+    local batch = batch_get()
+    if batch ~= nil then
+        local keys = batch.load[class]
+        if keys == nil then
+            keys = {}
+            batch.load[class] = keys
+        end
+        keys[key] = 0
+        return
+    end
     local t = {}
     t[key] = 0
-    db.hset("load.index." .. class, now_counter, t)
-    db.hdel("load.index." .. class, old_counter, key)
+    load_index_add_keys(class, t)
+end
+
+-- keys is table key -> 0
+function load_index_add_keys(class, keys)
+    local db = za_db
+    local now_counter, old_counter = load_index_cfg(class)
+    -- key already in now generation was removed from old one before
+    local changed = db.hset("load.index." .. class, now_counter, keys)
+    if changed then
+        for key, v in pairs(changed) do
+            db.hdel("load.index." .. class, old_counter, key)
+        end
+    end
 end
 
 function load_index_del(class, key)
@@ -361,39 +393,171 @@ function load_index_del(class, key)
     db.hdel("load.index." .. class, old_counter, key)
 end
 
-function load_index_delold(class)
-    local db = za_db
-    local now_counter = db.hget("load.index." .. class, "cfg", "now")
-    local old_counter = db.hget("load.index." .. class, "cfg", "old")
-    if now_counter == nil or old_counter == nil then
-        return
-    end
-    local oldobjs = db.hgetall("load.index." .. class, old_counter)
+function load_index_delold_keys(class, keys)
     local count = 0
-
     if class == "obj." then
-        for key, v in pairs(oldobjs) do
+        for key, v in pairs(keys) do
             obj_del(key)
             count = count + 1
         end
     elseif  class == "rel.obj.filter." then
-        count = count + rel_del_by_dict(oldobjs, "obj.", "filter.")
+        count = count + rel_del_by_dict(keys, "obj.", "filter.")
     elseif  class == "rel.obj.obj." then
-        count = count + rel_del_by_dict(oldobjs, "obj.", "obj.")
+        count = count + rel_del_by_dict(keys, "obj.", "obj.")
     elseif  class == "filter." then
-        for key, v in pairs(oldobjs) do
+        for key, v in pairs(keys) do
             filter_del(key)
             count = count + 1
         end
     end
+    return count
+end
+
+function load_index_delold_start(class)
+    local db = za_db
+    local now_counter = db.hget("load.index." .. class, "cfg", "now")
+    local old_counter = db.hget("load.index." .. class, "cfg", "old")
+    if now_counter == nil or old_counter == nil then
+        return nil
+    end
+    return {class = class, now = now_counter, old = old_counter, cursor = nil, count = 0}
+end
 
-    db.hdelall("load.index." .. class, old_counter)
-    print("Deleted old objects for " .. class .. ": ", count)
+-- delete next batch of old objects, returns true when class is done
+function load_index_delold_step(sweep, batch)
+    local db = za_db
+    local class = sweep.class
+    local keys = db.hkeys("load.index." .. class, sweep.old, batch, sweep.cursor)
+    local dict = {}
+    for i, key in ipairs(keys) do
+        dict[key] = 0
+        sweep.cursor = key
+    end
+    sweep.count = sweep.count + load_index_delold_keys(class, dict)
+    if #keys == batch then
+        return false
+    end
+    db.hdelall("load.index." .. class, sweep.old)
+    print("Deleted old objects for " .. class .. ": ", sweep.count)
     local t = {}
-    t["old"] = now_counter
-    t["now"] = now_counter + 1
+    t["old"] = sweep.now
+    t["now"] = sweep.now + 1
     db.hset("load.index." .. class, "cfg", t)
-    return
+    return true
+end
+
+------------------------------------------------------------------------------------
+---------------------------------JOBS-----------------------------------------------
+------------------------------------------------------------------------------------
+
+DELOLD_CLASSES = {"filter.", "obj.", "rel.filter.", "rel.obj.filter.", "rel.obj.obj."}
+DELOLD_BATCH = 128
+JOBS_HISTORY = 16
+
+jobs = {}
+jobs_last_id = 0
+jobs_active = nil
+
+function job_delold_new()
+    if jobs_active ~= nil then
+        return jobs_active
+    end
+    jobs_last_id = jobs_last_id + 1
+    local job = {id = jobs_last_id, state = "running", class_idx = 1, sweep = nil,
+        deleted = 0, batches = 0, started = za_db.clock(), duration = 0}
+    jobs[job.id] = job
+    jobs[job.id - JOBS_HISTORY] = nil
+    jobs_active = job
+    za_db.background(true)
+    return job
+end
+
+-- one batch of job, returns false when job is finished
+function job_delold_step(job)
+    if job.sweep == nil then
+        local class = DELOLD_CLASSES[job.class_idx]
+        if class == nil then
+            job.state = "done"
+            job.duration = za_db.clock() - job.started
+            return false
+        end
+        job.sweep = load_index_delold_start(class)
+        if job.sweep == nil then
+            job.class_idx = job.class_idx + 1
+            return true
+        end
+    end
+    local sweep = job.sweep
+    local count = sweep.count
+    local done = load_index_delold_step(sweep, DELOLD_BATCH)
+    job.deleted = job.deleted + sweep.count - count
+    job.batches = job.batches + 1
+    if done then
+        job.sweep = nil
+        job.class_idx = job.class_idx + 1
+    end
+    return true
+end
+
+function jobs_tick(budget)
+    local job = jobs_active
+    if job == nil then
+        za_db.background(false)
+        return
+    end
+    local deadline = za_db.clock() + budget * 1000
+    while job_delold_step(job) do
+        if za_db.clock() >= deadline then
+            return
+        end
+    end
+    jobs_active = nil
+    za_db.background(false)
+end
+
+function job_status(job)
+    local out = {}
+    out["id"] = job.id
+    out["state"] = job.state
+    out["deleted"] = job.deleted
+    out["batches"] = job.batches
+    if job.state == "running" then
+        out["class"] = DELOLD_CLASSES[job.class_idx]
+        out["elapsed_us"] = za_db.clock() - job.started
+    else
+        out["elapsed_us"] = job.duration
+    end
+    return out
+end
+
+------------------------------------------------------------------------------------
+---------------------------------BATCH----------------------------------------------
+------------------------------------------------------------------------------------
+
+-- records are array part of object, every record is added by add function.
+-- Load index and object status are updated once for whole batch.
+-- Reply is array: count of accepted records and positions of failed ones.
+function resp_batch_add(object, add)
+    local batch = {status = {}, load = {}}
+    batches[coroutine.running()] = batch
+    local failed = {}
+    local accepted = 0
+    for i, record in ipairs(object) do
+        if add(record) == "+OK\r\n" then
+            accepted = accepted + 1
+        else
+            failed[#failed + 1] = ":" .. i .. "\r\n"
+        end
+    end
+    batches[coroutine.running()] = nil
+    for class, keys in pairs(batch.load) do
+        load_index_add_keys(class, keys)
+    end
+    for objkey, v in pairs(batch.status) do
+        local hist = {}
+        update_status(objkey, hist)
+    end
+    return "*" .. (#failed + 1) .. "\r\n:" .. accepted .. "\r\n" .. table.concat(failed, "")
 end
 
 ------------------------------------------------------------------------------------
@@ -432,20 +596,52 @@ function resp_object_add(object)
 end
 
 function resp_object_delold()
-    load_index_delold("filter.")
-    load_index_delold("obj.")
-    load_index_delold("rel.filter.")
-    load_index_delold("rel.obj.filter.")
-    load_index_delold("rel.obj.obj.")
-    return "+OK\r\n"
+    local job = job_delold_new()
+    return ":" .. job.id .. "\r\n"
+end
+
+function resp_object_delold_status(id)
+    local job = jobs_active
+    if id ~= nil then
+        job = jobs[tonumber(id)]
+    elseif job == nil then
+        job = jobs[jobs_last_id]
+    end
+    if job == nil then
+        return "+ERR\r\n"
+    end
+    return toResp(job_status(job))
 end
 
-function resp_object_get(key)
+-- reply for conditional get, nil if client has to get whole hash
+function resp_not_modified(table, key, version)
+    if version == nil then
+        return nil
+    end
+    local now = za_db.hversion(table, key)
+    if tonumber(version) == now then
+        return "+NOTMODIFIED\r\n"
+    end
+    return nil
+end
+
+function resp_with_version(table, key, data, version)
+    if version ~= nil then
+        data["_version"] = za_db.hversion(table, key)
+    end
+    return toResp(data)
+end
+
+function resp_object_get(key, version)
     if key == nil then
         return "+ERR\r\n"
     end
+    local msg = resp_not_modified("obj.", key, version)
+    if msg ~= nil then
+        return msg
+    end
     local ret = obj_get(key)
-    return toResp(ret)
+    return resp_with_version("obj.", key, ret, version)
 end
 
 function resp_object_child_get(key)
@@ -463,23 +659,22 @@ function resp_object_child_get(key)
     return toResp(out)
 end
 
-function resp_event_get(evtkey)
+function resp_event_get(evtkey, version)
     if evtkey == nil then
         return "+ERR\r\n"
     end
-    return toResp(evt_get(evtkey))
+    local msg = resp_not_modified("evt.", evtkey, version)
+    if msg ~= nil then
+        return msg
+    end
+    return resp_with_version("evt.", evtkey, evt_get(evtkey), version)
 end
 
 function resp_event_getall(key)
     if key == nil then
         return "+ERR\r\n"
     end
-    local tableNumeration = 0
-    local arraySize = 0
-    local out = {}
-    local hist = {}
-    get_all_events(key, out, hist)
-    return toResp(out)
+    return za_db.geteventsall(key)
 end
 
 function resp_event_add(event)
@@ -488,11 +683,21 @@ function resp_event_add(event)
         return "+ERR\r\n"
     end
     event["status"] = tonumber(event["severity"])
-    evt_add(evtkey, event)
-    local objects = filter_get_obj(event)
+    local changed = evt_add(evtkey, event)
+    if changed == nil then
+        return "+OK\r\n"
+    end
+    -- filters without changed fields matched before, relations are made already
+    local objects = filter_get_obj(event, changed)
     for objkey, v in pairs(objects) do
         rel_add("obj.", objkey, "evt.", evtkey)
     end
+    if changed["status"] then
+        local parents = rel_get_parents("evt.", evtkey, "obj.")
+        for objkey, to in pairs(parents) do
+            update_status_later(objkey)
+        end
+    end
     return "+OK\r\n"
 end
 
@@ -516,44 +721,102 @@ function resp_filter_add(objkey, filter)
     return "+OK\r\n"
 end
 
+------------------------------------------------------------------------------------
+---------------------------------INDEX----------------------------------------------
+------------------------------------------------------------------------------------
+
+-- fields with secondary index, they are queried with IQUERY
+INDEXES = {
+    {"obj.", "status"},
+    {"evt.", "status"},
+    {"evt.", "host"},
+}
+
+function index_init()
+    for i, index in ipairs(INDEXES) do
+        za_db.index(index[1], index[2])
+    end
+end
+
+function resp_index_add(table, field)
+    if table == nil or field == nil then
+        return "+ERR\r\n"
+    end
+    local count = za_db.index(table, field)
+    if count == nil then
+        return "+ERR\r\n"
+    end
+    return ":" .. count .. "\r\n"
+end
+
+index_init()
+
+------------------------------------------------------------------------------------
+---------------------------------REPLICA--------------------------------------------
+------------------------------------------------------------------------------------
+
+-- commands that change data, replica gets data only from master
+WRITE_COMMANDS = {
+    ADDOBJECT = true, DELOLDOBJECT = true, ADDREL = true,
+    ADDOBJECTS = true, ADDEVENTS = true, ADDRELS = true,
+    ADDEVENT = true, DELEVENT = true, ADDFILTER = true,
+}
+
+READONLY = za_db.readonly()
+
 print("Start coroutine")
 
+-- every request runs in own coroutine, it can be suspended by za_db
+-- when its instruction budget runs out
 return function(cmdtype, object)
-    while true do
-        local msg = "+OK\r\n"
-        local key = object["key"]
-        if cmdtype == "ADDOBJECT" then
-            msg = resp_object_add(object)
-        elseif cmdtype == "DELOLDOBJECT" then
-            msg = resp_object_delold()
-        elseif cmdtype == "ADDREL" then
-            msg = resp_relation_add(object)
-        elseif cmdtype == "GETOBJECT" then
-            msg = resp_object_get(key)
-        elseif cmdtype == "GETCHILD" then
-            msg = resp_object_child_get(key)
-        elseif cmdtype == "ADDEVENT" then
-            msg = resp_event_add(object)
-        elseif cmdtype == "DELEVENT" then
-            msg = resp_event_del(key)
-        elseif cmdtype == "GETEVENT" then
-            msg = resp_event_get(key)
-        elseif cmdtype == "GETEVENTSALL" then
-            msg = resp_event_getall(key)
-        elseif cmdtype == "ADDFILTER" then
-            object["key"] = nil
-            msg = resp_filter_add(key, object)
-        elseif cmdtype == "PRINTALL" then
-            za_db.printall();
-        elseif cmdtype == "EXIT" then
-            return
-        elseif cmdtype == "CONNECT" then
-            print("New connection , ip is :".. object['name'] .. " , port : ".. object['port'])
-            msg = ""
-        elseif cmdtype == "DISCONNECT" then
-            print("Host disconnected , ip is :".. object['name'] .. " , port : ".. object['port'])
-            msg = ""
-        end
-        cmdtype, object = coroutine.yield(msg)
-    end
+    local msg = "+OK\r\n"
+    local key = object["key"]
+    if READONLY and WRITE_COMMANDS[cmdtype] then
+        msg = "-READONLY replica\r\n"
+    elseif cmdtype == "ADDOBJECT" then
+        msg = resp_object_add(object)
+    elseif cmdtype == "DELOLDOBJECT" then
+        msg = resp_object_delold()
+    elseif cmdtype == "DELOLDSTATUS" then
+        msg = resp_object_delold_status(key)
+    elseif cmdtype == "ADDREL" then
+        msg = resp_relation_add(object)
+    elseif cmdtype == "ADDOBJECTS" then
+        msg = resp_batch_add(object, resp_object_add)
+    elseif cmdtype == "ADDEVENTS" then
+        msg = resp_batch_add(object, resp_event_add)
+    elseif cmdtype == "ADDRELS" then
+        msg = resp_batch_add(object, resp_relation_add)
+    elseif cmdtype == "GETOBJECT" then
+        msg = resp_object_get(key, object["version"])
+    elseif cmdtype == "GETCHILD" then
+        msg = resp_object_child_get(key)
+    elseif cmdtype == "ADDEVENT" then
+        msg = resp_event_add(object)
+    elseif cmdtype == "DELEVENT" then
+        msg = resp_event_del(key)
+    elseif cmdtype == "GETEVENT" then
+        msg = resp_event_get(key, object["version"])
+    elseif cmdtype == "GETEVENTSALL" then
+        msg = resp_event_getall(key)
+    elseif cmdtype == "ADDFILTER" then
+        object["key"] = nil
+        msg = resp_filter_add(key, object)
+    elseif cmdtype == "ADDINDEX" then
+        msg = resp_index_add(object["table"], object["field"])
+    elseif cmdtype == "PRINTALL" then
+        za_db.printall();
+    elseif cmdtype == "TICK" then
+        jobs_tick(object["budget"])
+        msg = ""
+    elseif cmdtype == "EXIT" then
+        return
+    elseif cmdtype == "CONNECT" then
+        print("New connection , ip is :".. object['name'] .. " , port : ".. object['port'])
+        msg = ""
+    elseif cmdtype == "DISCONNECT" then
+        print("Host disconnected , ip is :".. object['name'] .. " , port : ".. object['port'])
+        msg = ""
+    end
+    return msg
 end
@@ -40,6 +40,7 @@ SOFTWARE.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
 #include "rbtr.h"
 
 typedef enum {
@@ -51,6 +52,7 @@ typedef struct NodeTag {
     struct NodeTag *right;      // right child
     struct NodeTag *parent;     // parent
     NodeColor color;            // node color (BLACK, RED)
+    unsigned char arena;        // node is part of arena of bulk load
     void *key;                  // key used for searching
     void *val;                // user data
 } NodeType;
@@ -59,6 +61,11 @@ typedef struct RbtTag {
     NodeType *root;   // root of red-black tree
     NodeType sentinel;
     int (*compare)(void *a, void *b);    // compare keys
+    NodeType *arena;  // nodes of bulk load, freed with last of them
+    size_t arena_live;
+    size_t arena_size;
+    size_t count;     // nodes in tree
+    void (*release)(void *p, size_t size);  // frees nodes, free() if NULL
 } RbtType;
 
 // all leafs are sentinels
@@ -79,10 +86,42 @@ RbtHandle rbtNew(int (*rbtCompare)(void *a, void *b)) {
     rbt->sentinel.color = BLACK;
     rbt->sentinel.key = NULL;
     rbt->sentinel.val = NULL;
+    rbt->sentinel.arena = 0;
+    rbt->arena = NULL;
+    rbt->arena_live = 0;
+    rbt->arena_size = 0;
+    rbt->count = 0;
+    rbt->release = NULL;
 
     return rbt;
 }
 
+void rbtSetFree(RbtHandle h, void (*release)(void *p, size_t size)) {
+    RbtType *rbt = h;
+    rbt->release = release;
+}
+
+static void releaseMem(RbtType *rbt, void *p, size_t size) {
+    if (rbt->release != NULL) {
+        rbt->release(p, size);
+    } else {
+        free(p);
+    }
+}
+
+static void freeNode(RbtType *rbt, NodeType *p) {
+    rbt->count--;
+    if (!p->arena) {
+        releaseMem(rbt, p, sizeof(NodeType));
+        return;
+    }
+    if (--rbt->arena_live == 0) {
+        releaseMem(rbt, rbt->arena, 0);
+        rbt->arena = NULL;
+        rbt->arena_size = 0;
+    }
+}
+
 static void deleteTree(RbtHandle h, NodeType *p) {
     RbtType *rbt = h;
 
@@ -91,7 +130,7 @@ static void deleteTree(RbtHandle h, NodeType *p) {
         return;
     deleteTree(h, p->left);
     deleteTree(h, p->right);
-    free(p);
+    freeNode(rbt, p);
 }
 
 void rbtDelete(RbtHandle h) {
@@ -242,8 +281,12 @@ RbtStatus rbtInsert(RbtHandle h, void *key, void *val, void **out) {
         x->left = SENTINEL;
         x->right = SENTINEL;
         x->color = RED;
+        x->arena = 0;
         x->key = key;
         x->val = val;
+        rbt->count++;
+        // node is ready before it is linked, other threads may walk the tree
+        atomic_thread_fence(memory_order_release);
         // insert node in tree
         if (parent) {
                 if (rbt->compare(key, parent->key) < 0)
@@ -355,11 +398,64 @@ RbtStatus rbtErase(RbtHandle h, RbtIterator i) {
     if (y->color == BLACK)
         deleteFixup(rbt, x);
 
-    free(y);
+    freeNode(rbt, y);
 
     return RBT_STATUS_OK;
 }
 
+typedef struct BulkTag {
+    RbtType *rbt;
+    NodeType *nodes;
+    size_t used;
+    int height;
+    int failed;
+    int (*next)(void *ctx, void **key, void **val);
+    void *ctx;
+} BulkType;
+
+static NodeType *bulkBuild(BulkType *b, size_t count, int depth, NodeType *parent) {
+    RbtType *rbt = b->rbt;
+    if (count == 0)
+        return SENTINEL;
+    // nodes are taken in preorder, so upper levels are close in memory
+    NodeType *x = &b->nodes[b->used++];
+    size_t left = (count - 1) / 2;
+    x->parent = parent;
+    x->arena = 1;
+    // all leafs are on two last levels, last level is red
+    x->color = (depth == b->height && depth > 0) ? RED : BLACK;
+    x->left = bulkBuild(b, left, depth + 1, x);
+    if (!b->next(b->ctx, &x->key, &x->val))
+        b->failed = 1;
+    x->right = bulkBuild(b, count - 1 - left, depth + 1, x);
+    return x;
+}
+
+RbtStatus rbtBulkLoad(RbtHandle h, size_t count, int (*next)(void *ctx, void **key, void **val), void *ctx) {
+    RbtType *rbt = h;
+    BulkType b = { rbt, NULL, 0, 0, 0, next, ctx };
+
+    if (rbt->root != SENTINEL)
+        return RBT_STATUS_DUPLICATE_KEY;
+    if (count == 0)
+        return RBT_STATUS_OK;
+    if ((b.nodes = malloc(count * sizeof(NodeType))) == NULL)
+        return RBT_STATUS_MEM_EXHAUSTED;
+    for (size_t n = count; n > 1; n >>= 1)
+        b.height++;
+    NodeType *root = bulkBuild(&b, count, 0, 0);
+    if (b.failed) {
+        free(b.nodes);
+        return RBT_STATUS_KEY_NOT_FOUND;
+    }
+    rbt->root = root;
+    rbt->arena = b.nodes;
+    rbt->arena_live = count;
+    rbt->arena_size = count;
+    rbt->count = count;
+    return RBT_STATUS_OK;
+}
+
 RbtIterator rbtNext(RbtHandle h, RbtIterator it) {
     RbtType *rbt = h;
     NodeType *i = it;
@@ -380,6 +476,35 @@ RbtIterator rbtNext(RbtHandle h, RbtIterator it) {
     return i != SENTINEL ? i : NULL;
 }
 
+RbtIterator rbtPrev(RbtHandle h, RbtIterator it) {
+    RbtType *rbt = h;
+    NodeType *i = it;
+    if (i->left != SENTINEL) {
+        // go left 1, then right to the end
+        for (i = i->left; i->right != SENTINEL; i = i->right) {
+        };
+    } else {
+        // while you're the left child, chain up parent link
+        NodeType *p = i->parent;
+        while (p && i == p->left) {
+            i = p;
+            p = p->parent;
+        }
+        i = p;
+    }
+    return i != SENTINEL ? i : NULL;
+}
+
+RbtIterator rbtLast(RbtHandle h) {
+    RbtType *rbt = h;
+
+    // return pointer to last value
+    NodeType *i;
+    for (i = rbt->root; i->right != SENTINEL; i = i->right) {
+    };
+    return i != SENTINEL ? i : NULL;
+}
+
 RbtIterator rbtBegin(RbtHandle h) {
     RbtType *rbt = h;
 
@@ -443,3 +568,32 @@ void *rbtScan(RbtHandle h, void *key) {
     return pre;
 }
 
+static void statNode(RbtType *rbt, NodeType *p, size_t depth, RbtStat *stat) {
+    while (p != SENTINEL) {
+        stat->count++;
+        stat->depth_sum += depth;
+        if (depth > stat->height) {
+            stat->height = depth;
+        }
+        statNode(rbt, p->left, depth + 1, stat);
+        p = p->right;
+        depth++;
+    }
+}
+
+void rbtMem(RbtHandle h, RbtMem *mem) {
+    RbtType *rbt = h;
+    mem->count = rbt->count;
+    mem->arena_live = rbt->arena_live;
+    mem->arena_size = rbt->arena_size;
+    mem->node_size = sizeof(NodeType);
+}
+
+void rbtStat(RbtHandle h, RbtStat *stat) {
+    RbtType *rbt = h;
+    stat->count = 0;
+    stat->height = 0;
+    stat->depth_sum = 0;
+    stat->node_size = sizeof(NodeType);
+    statNode(rbt, rbt->root, 1, stat);
+}
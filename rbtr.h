@@ -38,6 +38,8 @@ SOFTWARE.
 #ifndef RBT_H
 #define RBT_H
 
+#include <stddef.h>
+
 typedef enum {
     RBT_STATUS_OK, RBT_STATUS_MEM_EXHAUSTED, RBT_STATUS_DUPLICATE_KEY, RBT_STATUS_KEY_NOT_FOUND
 } RbtStatus;
@@ -58,9 +60,22 @@ RbtHandle rbtNew(int (*compare)(void *a, void *b));
 void rbtDelete(RbtHandle h);
 // destroy red-black tree
 
+void rbtSetFree(RbtHandle h, void (*release)(void *p, size_t size));
+// set function that frees nodes instead of free(), e.g. to delay
+// free while other threads can read the tree
+
 RbtStatus rbtInsert(RbtHandle h, void *key, void *val, void **out);
 // insert key/value pair
 
+RbtStatus rbtBulkLoad(RbtHandle h, size_t count, int (*next)(void *ctx, void **key, void **val), void *ctx);
+// build balanced tree from count key/value pairs sorted by compare
+// in one pass, nodes are allocated at once
+// parameters:
+//     next     returns next pair, 0 if there is no more pairs
+// returns:
+//     RBT_STATUS_DUPLICATE_KEY if tree is not empty
+//     RBT_STATUS_KEY_NOT_FOUND if next gave less than count pairs
+
 RbtStatus rbtErase(RbtHandle h, RbtIterator i);
 // delete node in tree associated with iterator
 // this function does not free the key/value pointers
@@ -68,6 +83,12 @@ RbtStatus rbtErase(RbtHandle h, RbtIterator i);
 RbtIterator rbtNext(RbtHandle h, RbtIterator i);
 // return ++i
 
+RbtIterator rbtPrev(RbtHandle h, RbtIterator i);
+// return --i
+
+RbtIterator rbtLast(RbtHandle h);
+// return pointer to last node
+
 RbtIterator rbtBegin(RbtHandle h);
 // return pointer to first node
 
@@ -86,4 +107,25 @@ RbtIterator rbtFind(RbtHandle h, void *key);
 
 RbtIterator rbtScan(RbtHandle h, void *key);
 
+typedef struct {
+    size_t count;      // nodes
+    size_t height;     // nodes on longest path from root
+    size_t depth_sum;  // sum of depths of nodes, root has depth 1
+    size_t node_size;  // bytes of one node
+} RbtStat;
+
+typedef struct {
+    size_t count;       // nodes
+    size_t arena_live;  // nodes in arena of bulk load
+    size_t arena_size;  // nodes allocated in arena, freed with last of them
+    size_t node_size;   // bytes of one node
+} RbtMem;
+
+void rbtMem(RbtHandle h, RbtMem *mem);
+// count nodes and their allocations without walk of tree
+
+void rbtStat(RbtHandle h, RbtStat *stat);
+// count nodes and measure shape of tree, successful lookup
+// makes depth_sum / count compares on average
+
 #endif
@@ -0,0 +1,462 @@
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+ * Load generator for zadb. Every test sends requests of one command over
+ * several connections with pipelining and reports throughput and
+ * latency percentiles, like redis-benchmark.
+ *
+ * Topology is a tree of objects: object i > 0 is child of (i - 1) / fanout.
+ * Objects get host field from hosts values, filters of objects match
+ * events by host, so ADDEVENT relates events to objects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "zadbhist.h"
+
+#define BENCH_MAX_PIPELINE 1024
+#define BENCH_MAX_THREADS 64
+#define BENCH_READ_SIZE 65536
+#define BENCH_REQUEST_MAX 512
+#define BENCH_RESP_MAX_DEPTH 32
+
+enum {
+    BENCH_ADDOBJECT, BENCH_ADDREL, BENCH_ADDFILTER, BENCH_ADDEVENT, BENCH_GETEVENTSALL, BENCH_DELOLDOBJECT, BENCH_TESTS
+};
+
+static const char *benchTestName[BENCH_TESTS] = {
+    "ADDOBJECT", "ADDREL", "ADDFILTER", "ADDEVENT", "GETEVENTSALL", "DELOLDOBJECT"
+};
+
+/*
+ * Options of run
+ */
+static const char *benchHost = "127.0.0.1";
+static int benchPort = 7000;
+static int benchConnections = 50;
+static int benchThreads = 1;
+static int benchPipeline = 1;
+static long long benchRequests = 100000;
+static long long benchObjects = 10000;
+static long long benchFanout = 10;
+static long long benchEvents = 100000;
+static long long benchHosts = 100;
+
+static _Atomic long long benchIssued = 0;
+
+typedef struct benchConn {
+    int fd;
+    char *in;
+    size_t in_size;
+    size_t in_cap;
+    long long sent[BENCH_MAX_PIPELINE];  // send times of requests in flight
+    int head;
+    int inflight;
+} benchConn;
+
+typedef struct benchThread {
+    pthread_t thread;
+    int test;
+    int count;                 // connections of thread
+    benchConn *conns;
+    unsigned int seed;
+    long long errors;
+    zadbHist hist;
+} benchThread;
+
+static long long benchNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Append RESP array of strings
+ */
+static int benchArgs(char *out, int argc, const char **argv) {
+    int size = sprintf(out, "*%d\r\n", argc);
+    for (int i = 0; i < argc; i++) {
+        size += sprintf(out + size, "$%zu\r\n%s\r\n", strlen(argv[i]), argv[i]);
+    }
+    return size;
+}
+
+/*
+ * Build request number n of test
+ *
+ * return size of request
+ */
+static int benchRequest(int test, long long n, unsigned int *seed, char *out) {
+    char a[32], b[32], c[32];
+    switch (test) {
+    case BENCH_ADDOBJECT: {
+        long long obj = n % benchObjects;
+        snprintf(a, sizeof(a), "o%lld", obj);
+        snprintf(b, sizeof(b), "h%lld", obj % benchHosts);
+        const char *argv[] = { "ADDOBJECT", "id", a, "name", a, "host", b };
+        return benchArgs(out, 7, argv);
+    }
+    case BENCH_ADDREL: {
+        long long child = benchObjects > 1 ? 1 + n % (benchObjects - 1) : 0;
+        snprintf(a, sizeof(a), "o%lld", child > 0 ? (child - 1) / benchFanout : 0);
+        snprintf(b, sizeof(b), "o%lld", child);
+        const char *argv[] = { "ADDREL", "src_id", a, "dst_id", b };
+        return benchArgs(out, 5, argv);
+    }
+    case BENCH_ADDFILTER: {
+        long long obj = n % benchObjects;
+        snprintf(a, sizeof(a), "o%lld", obj);
+        snprintf(b, sizeof(b), "h%lld", obj % benchHosts);
+        const char *argv[] = { "ADDFILTER", "key", a, "host", b };
+        return benchArgs(out, 5, argv);
+    }
+    case BENCH_ADDEVENT: {
+        snprintf(a, sizeof(a), "e%lld", n % benchEvents);
+        snprintf(b, sizeof(b), "h%lld", (long long) (rand_r(seed) % benchHosts));
+        snprintf(c, sizeof(c), "%d", rand_r(seed) % 6);
+        const char *argv[] = { "ADDEVENT", "key", a, "host", b, "severity", c };
+        return benchArgs(out, 7, argv);
+    }
+    case BENCH_GETEVENTSALL: {
+        snprintf(a, sizeof(a), "o%lld", (long long) (rand_r(seed) % benchObjects));
+        const char *argv[] = { "GETEVENTSALL", "key", a };
+        return benchArgs(out, 3, argv);
+    }
+    default: {
+        const char *argv[] = { "DELOLDOBJECT" };
+        return benchArgs(out, 1, argv);
+    }
+    }
+}
+
+/*
+ * Size of complete RESP reply
+ *
+ * return size, 0 if reply is not complete, -1 if it is wrong
+ */
+static long long benchReplySize(const char *buf, const char *end, int depth) {
+    if (buf >= end) {
+        return 0;
+    }
+    const char *line = memchr(buf, '\n', end - buf);
+    if (line == NULL) {
+        return 0;
+    }
+    line++;
+    switch (*buf) {
+    case '+':
+    case '-':
+    case ':':
+        return line - buf;
+    case '$': {
+        long long size = atoll(buf + 1);
+        if (size < 0) {
+            return line - buf;
+        }
+        if (end - line < size + 2) {
+            return 0;
+        }
+        return line + size + 2 - buf;
+    }
+    case '*': {
+        long long count = atoll(buf + 1);
+        if (depth >= BENCH_RESP_MAX_DEPTH) {
+            return -1;
+        }
+        const char *p = line;
+        for (long long i = 0; i < count; i++) {
+            long long size = benchReplySize(p, end, depth + 1);
+            if (size <= 0) {
+                return size;
+            }
+            p += size;
+        }
+        return p - buf;
+    }
+    }
+    return -1;
+}
+
+static int benchConnect() {
+    struct addrinfo hints, *res;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", benchPort);
+    if (getaddrinfo(benchHost, port, &hints, &res) != 0) {
+        fprintf(stderr, "can't resolve %s\n", benchHost);
+        exit(1);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("connect failed");
+        exit(1);
+    }
+    freeaddrinfo(res);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * Fill pipeline of connection with new requests while test has them
+ */
+static int benchFill(benchThread *t, benchConn *conn) {
+    char out[BENCH_REQUEST_MAX * 64];
+    int size = 0;
+    while (conn->inflight < benchPipeline) {
+        long long n = atomic_fetch_add(&benchIssued, 1);
+        if (n >= benchRequests) {
+            break;
+        }
+        size += benchRequest(t->test, n, &t->seed, out + size);
+        conn->sent[(conn->head + conn->inflight) % BENCH_MAX_PIPELINE] = benchNow();
+        conn->inflight++;
+        if (size > (int) sizeof(out) - BENCH_REQUEST_MAX) {
+            if (send(conn->fd, out, size, MSG_NOSIGNAL) != size) {
+                perror("send failed");
+                exit(1);
+            }
+            size = 0;
+        }
+    }
+    if (size > 0 && send(conn->fd, out, size, MSG_NOSIGNAL) != size) {
+        perror("send failed");
+        exit(1);
+    }
+    return conn->inflight;
+}
+
+/*
+ * Take replies from connection, every reply ends oldest request in flight
+ */
+static void benchRead(benchThread *t, benchConn *conn) {
+    if (conn->in_cap - conn->in_size < BENCH_READ_SIZE) {
+        conn->in_cap = conn->in_size + BENCH_READ_SIZE;
+        conn->in = realloc(conn->in, conn->in_cap);
+        if (conn->in == NULL) {
+            perror("realloc failed");
+            exit(1);
+        }
+    }
+    ssize_t nread = read(conn->fd, conn->in + conn->in_size, conn->in_cap - conn->in_size);
+    if (nread <= 0) {
+        fprintf(stderr, "connection closed by server\n");
+        exit(1);
+    }
+    conn->in_size += nread;
+    long long now = benchNow();
+    size_t offset = 0;
+    while (conn->inflight > 0) {
+        char *reply = conn->in + offset;
+        long long size = benchReplySize(reply, conn->in + conn->in_size, 0);
+        if (size < 0) {
+            fprintf(stderr, "wrong reply from server\n");
+            exit(1);
+        }
+        if (size == 0) {
+            break;
+        }
+        if (*reply == '-' || (size >= 4 && memcmp(reply, "+ERR", 4) == 0)) {
+            t->errors++;
+        }
+        zadbHistRecord(&t->hist, now - conn->sent[conn->head]);
+        conn->head = (conn->head + 1) % BENCH_MAX_PIPELINE;
+        conn->inflight--;
+        offset += size;
+    }
+    conn->in_size -= offset;
+    memmove(conn->in, conn->in + offset, conn->in_size);
+}
+
+static void *benchThreadRun(void *arg) {
+    benchThread *t = arg;
+    struct pollfd pfds[t->count];
+    int active = 0;
+    for (int i = 0; i < t->count; i++) {
+        pfds[i].fd = t->conns[i].fd;
+        pfds[i].events = POLLIN;
+        if (benchFill(t, &t->conns[i]) > 0) {
+            active++;
+        }
+    }
+    while (active > 0) {
+        if (poll(pfds, t->count, -1) < 0 && errno != EINTR) {
+            perror("poll failed");
+            exit(1);
+        }
+        active = 0;
+        for (int i = 0; i < t->count; i++) {
+            benchConn *conn = &t->conns[i];
+            if (pfds[i].revents) {
+                benchRead(t, conn);
+                benchFill(t, conn);
+            }
+            if (conn->inflight > 0) {
+                active++;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run one test and print its report
+ */
+static void benchRun(int test) {
+    benchThread threads[BENCH_MAX_THREADS];
+    benchConn *conns = calloc(benchConnections, sizeof(benchConn));
+    if (conns == NULL) {
+        perror("calloc failed");
+        exit(1);
+    }
+    for (int i = 0; i < benchConnections; i++) {
+        conns[i].fd = benchConnect();
+    }
+    atomic_store(&benchIssued, 0);
+    int per_thread = benchConnections / benchThreads;
+    long long start = benchNow();
+    for (int i = 0; i < benchThreads; i++) {
+        benchThread *t = &threads[i];
+        memset(t, 0, sizeof(benchThread));
+        t->test = test;
+        t->conns = conns + i * per_thread;
+        t->count = i == benchThreads - 1 ? benchConnections - i * per_thread : per_thread;
+        t->seed = 12345 + i;
+        if (pthread_create(&t->thread, NULL, benchThreadRun, t) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    zadbHist *hist = calloc(1, sizeof(zadbHist));
+    long long errors = 0;
+    for (int i = 0; i < benchThreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        zadbHistMerge(hist, &threads[i].hist);
+        errors += threads[i].errors;
+    }
+    double seconds = (benchNow() - start) / 1e9;
+    printf("====== %s ======\n", benchTestName[test]);
+    printf("  %lld requests completed in %.2f seconds\n", hist->count, seconds);
+    printf("  %d connections, %d threads, pipeline %d\n", benchConnections, benchThreads, benchPipeline);
+    printf("  %.2f requests per second\n", seconds > 0 ? hist->count / seconds : 0.0);
+    printf("  latency us: avg %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+            hist->count ? hist->sum / 1000.0 / hist->count : 0.0,
+            zadbHistPercentile(hist, 0.5) / 1000.0, zadbHistPercentile(hist, 0.99) / 1000.0,
+            zadbHistPercentile(hist, 0.999) / 1000.0, hist->max / 1000.0);
+    printf("  errors %lld\n\n", errors);
+    for (int i = 0; i < benchConnections; i++) {
+        close(conns[i].fd);
+        free(conns[i].in);
+    }
+    free(conns);
+    free(hist);
+}
+
+static void benchUsage() {
+    printf("Usage: zadb-bench [options]\n"
+            " -h <host>        server host (default 127.0.0.1)\n"
+            " -p <port>        server port (default 7000)\n"
+            " -c <clients>     connections (default 50)\n"
+            " -T <threads>     client threads (default 1)\n"
+            " -n <requests>    requests of every test (default 100000)\n"
+            " -P <pipeline>    requests in flight per connection (default 1)\n"
+            " -objects <n>     objects in topology (default 10000)\n"
+            " -fanout <n>      children of object (default 10)\n"
+            " -events <n>      event keys (default 100000)\n"
+            " -hosts <n>       host values shared by objects and events (default 100)\n"
+            " -t <tests>       comma separated tests, default all in order:\n"
+            "                  ADDOBJECT,ADDREL,ADDFILTER,ADDEVENT,GETEVENTSALL,DELOLDOBJECT\n");
+}
+
+int main(int argc, char **argv) {
+    const char *tests = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            benchUsage();
+            return 1;
+        }
+        const char *opt = argv[i];
+        const char *val = argv[++i];
+        if (!strcmp(opt, "-h")) {
+            benchHost = val;
+        } else if (!strcmp(opt, "-p")) {
+            benchPort = atoi(val);
+        } else if (!strcmp(opt, "-c")) {
+            benchConnections = atoi(val);
+        } else if (!strcmp(opt, "-T")) {
+            benchThreads = atoi(val);
+        } else if (!strcmp(opt, "-n")) {
+            benchRequests = atoll(val);
+        } else if (!strcmp(opt, "-P")) {
+            benchPipeline = atoi(val);
+        } else if (!strcmp(opt, "-objects")) {
+            benchObjects = atoll(val);
+        } else if (!strcmp(opt, "-fanout")) {
+            benchFanout = atoll(val);
+        } else if (!strcmp(opt, "-events")) {
+            benchEvents = atoll(val);
+        } else if (!strcmp(opt, "-hosts")) {
+            benchHosts = atoll(val);
+        } else if (!strcmp(opt, "-t")) {
+            tests = val;
+        } else {
+            benchUsage();
+            return 1;
+        }
+    }
+    if (benchConnections < 1 || benchThreads < 1 || benchThreads > BENCH_MAX_THREADS || benchThreads > benchConnections
+            || benchPipeline < 1 || benchPipeline > BENCH_MAX_PIPELINE || benchObjects < 1 || benchFanout < 1
+            || benchEvents < 1 || benchHosts < 1) {
+        benchUsage();
+        return 1;
+    }
+    for (int test = 0; test < BENCH_TESTS; test++) {
+        if (tests != NULL) {
+            const char *p = strstr(tests, benchTestName[test]);
+            size_t size = strlen(benchTestName[test]);
+            if (p == NULL || (p != tests && p[-1] != ',') || (p[size] != ',' && p[size] != '\0')) {
+                continue;
+            }
+        }
+        benchRun(test);
+    }
+    return 0;
+}
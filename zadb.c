@@ -34,24 +34,67 @@ SOFTWARE.
 #include <poll.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include "rbtr.h"
 #include "zadbdata.h"
+#include "zadbcache.h"
+#include "zadbindex.h"
+#include "zadblog.h"
+#include "zadbsnap.h"
+#include "zadbimage.h"
+#include "zadbrepl.h"
+#include "zadbepoch.h"
+#include "zadbshard.h"
+#include "zadbhist.h"
+#include "zadbprof.h"
 #include <time.h>
 
 #define DEFAULT_PORT 7000
 #define SOCKET_CLIENT_BUFFER 256000
+#define DEFAULT_CACHE_BYTES (64 * 1024 * 1024)
+#define DEFAULT_SNAPSHOT_NAME "zadb.snap"
+#define SNAPSHOT_SUFFIX ".snap"
+
+/*
+ * Path of base image given by -image, IMAGEMERGE writes to it
+ */
+const char *imagePath = NULL;
+
+/*
+ * Directory of snapshots made by SNAPSHOT, set by -snapshot-dir
+ */
+const char *snapshotDir = ".";
+
+/*
+ * Number of shard with -shards, -1 otherwise. Files of shard get its
+ * number as suffix.
+ */
+int shardId = -1;
 
 
 RbtHandle *rbtHandle;
 lua_State *luaState;
-lua_State *luaStateThread;
 
 long long db_stat_set = 0;
-long long db_stat_get = 0;
+// per thread, reader threads add their gets to readerStatGet
+_Thread_local long long db_stat_get = 0;
 long long db_stat_upd = 0;
 long long db_stat_del = 0;
 
+//for debug malloc-free counter
+extern long long  malloccounter;
+
+/*
+ * Lua has unfinished background work. While set, mainLoop does not sleep
+ * in poll and gives Lua a TICK after every pass over the sockets.
+ */
+int backgroundJobs = 0;
+
 /*
  * Print all keys and values from red-black tree to stdout.
  */
@@ -60,11 +103,12 @@ void printAll(RbtHandle rbtHandle) {
     zadbDataVal *zdbval = NULL;
     char *table, *key, *field, *val;
     ZADB_DATA_TYPE table_size, key_size, field_size, val_size;
-    RbtIterator iterator = rbtBegin(rbtHandle);
+    zadbIter iterator;
+    int found = zadbIterBegin(rbtHandle, &iterator);
     int isStr = 0;
     ZADB_DATA_NUM num = 123456789;
-    while (iterator != NULL) {
-        rbtKeyValue(rbtHandle, iterator, (void*) &zdbkey, (void*) &zdbval);
+    while (found) {
+        zadbIterKeyValue(rbtHandle, &iterator, (void*) &zdbkey, (void*) &zdbval);
         zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
         zadbValGet(zdbval, &val, &val_size, &num, &isStr);
         if (isStr) {
@@ -72,7 +116,7 @@ void printAll(RbtHandle rbtHandle) {
         } else {
             printf("%.*s ^ %.*s : %.*s > %lld \n", table_size, table, key_size, key, field_size, field, num);
         }
-        iterator = rbtNext(rbtHandle, iterator);
+        found = zadbIterNext(rbtHandle, &iterator);
     }
 }
 
@@ -160,535 +204,3840 @@ int isStringEqual(const char *s1, size_t size1, const char *s2, size_t size2) {
     return 1;
 }
 
-
 /*
- * Used for debug. Print all keys and values from red-black tree.
+ * Reply buffer. Native commands write RESP reply here instead of building
+ * lua tables. Buffer is reused between requests. Space at the start is
+ * reserved for array header, which is known only at the end.
  */
-int databasePrintAll(lua_State *L) {
-    printAll(rbtHandle);
-    return 0;
+#define REPLY_HEADER_ROOM 32
+
+typedef struct replyBuffer {
+    char *buf;
+    size_t size;
+    size_t cap;
+} replyBuffer;
+
+// every reader thread builds replies in its own buffer
+_Thread_local replyBuffer reply = { NULL, 0, 0 };
+
+void replyReserve(size_t need) {
+    if (reply.size + need <= reply.cap) {
+        return;
+    }
+    size_t cap = reply.cap ? reply.cap : 4096;
+    while (cap < reply.size + need) {
+        cap *= 2;
+    }
+    char *buf = realloc(reply.buf, cap);
+    if (buf == NULL) {
+        perror("reply buffer realloc failed");
+        exit(1);
+    }
+    reply.buf = buf;
+    reply.cap = cap;
+}
+
+void replyReset() {
+    reply.size = 0;
+    replyReserve(REPLY_HEADER_ROOM);
+    reply.size = REPLY_HEADER_ROOM;
+}
+
+void replyAppend(const char *data, size_t size) {
+    replyReserve(size);
+    memcpy(reply.buf + reply.size, data, size);
+    reply.size += size;
+}
+
+void replyAppendBulk(const char *data, size_t size) {
+    replyReserve(size + 24);
+    reply.size += sprintf(reply.buf + reply.size, "$%zu\r\n", size);
+    memcpy(reply.buf + reply.size, data, size);
+    reply.size += size;
+    reply.buf[reply.size++] = '\r';
+    reply.buf[reply.size++] = '\n';
 }
 
+void replyAppendInt(long long num) {
+    replyReserve(24);
+    reply.size += sprintf(reply.buf + reply.size, ":%lld\r\n", num);
+}
 
 /*
- * get or get and delete key-value from red-black tree
- *
- * key contain three section:
- *
- * table string
- * key string
- * field string
- *
- * input on lua stack:
- * 1 - table string
- * 2 - key string
- * 3 - field string
+ * Put array header before reply body.
  *
+ * size: out reply size with header
  *
- * L: lua state or lua thread
- * delete: if delete != 0 then  key-value will be deleted
+ * return start of reply
+ */
+char *replyFinishArray(long long count, size_t *size) {
+    char header[REPLY_HEADER_ROOM];
+    int header_size = sprintf(header, "*%lld\r\n", count);
+    char *start = reply.buf + REPLY_HEADER_ROOM - header_size;
+    memcpy(start, header, header_size);
+    *size = reply.size - REPLY_HEADER_ROOM + header_size;
+    return start;
+}
+
+/*
+ * Put bulk string header before reply body, body is the string.
  *
- * put value from red-black tree. String or number
- * return number variables in lua stack
+ * size: out reply size with header
  *
+ * return start of reply
  */
-int databaseHGet_(lua_State *L, int delete) {
-    if (lua_gettop(L) != 3 || !lua_isstring(L, 1) || !lua_isstring(L, 2) || !lua_isstring(L, 3)) {
-        lua_pushnil(L);
-        return 1;
-    }
-    char *table, *key, *field, *val;
-    size_t o_table_size, o_key_size, o_field_size;
-    ZADB_DATA_TYPE table_size, key_size, field_size, val_size;
-    zadbDataKey from, zdbkey;
-    zadbDataVal zdbval;
-    ZADB_DATA_NUM num;
-    int isStr;
+char *replyFinishBulk(size_t *size) {
+    char header[REPLY_HEADER_ROOM];
+    size_t body_size = reply.size - REPLY_HEADER_ROOM;
+    int header_size = sprintf(header, "$%zu\r\n", body_size);
+    replyAppend("\r\n", 2);
+    char *start = reply.buf + REPLY_HEADER_ROOM - header_size;
+    memcpy(start, header, header_size);
+    *size = reply.size - REPLY_HEADER_ROOM + header_size;
+    return start;
+}
 
-    const char * o_table = luaToString(L, 1, &o_table_size);
-    const char * o_key = luaToString(L, 2, &o_key_size);
-    const char * o_field = luaToString(L, 3, &o_field_size);
+/*
+ * Send reply data from position and empty buffer. Used for streamed
+ * replies, which are sent by chunks while they are built.
+ */
+#define REPLY_STREAM_CHUNK (64 * 1024)
 
-    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0 || o_field == NULL || o_field_size == 0) {
-        lua_pushnil(L);
-        return 1;
+void replyFlush(int socket, size_t from) {
+    if (reply.size > from) {
+        send(socket, reply.buf + from, reply.size - from, MSG_NOSIGNAL);
     }
+    reply.size = 0;
+}
 
-    from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, o_field, o_field_size, 1);
-    RbtIterator iterator = rbtFind(rbtHandle, from);
-    if (iterator != NULL) {
-        rbtKeyValue(rbtHandle, iterator, (void *) &zdbkey, (void *) &zdbval);
-        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
-        zadbValGet(zdbval, &val, &val_size, &num, &isStr);
-        if (isStr) {
-            if (val != NULL) {
-                lua_pushlstring(L, val, val_size);
-            } else {
-                lua_pushlstring(L, "", 0);
-            }
-        } else {
-            lua_pushinteger(L, num);
-        }
-        if (delete) {
-            db_stat_del++;
-            zadbKeyFree(zdbkey);
-            zadbValFree(zdbval);
-            rbtErase(rbtHandle, iterator);
-        }else{
-            db_stat_get++;
-        }
-    } else {
-        lua_pushnil(L);
-    }
-    zadbKeyFree(from);
-    return 1;
+
+/*
+ * Used for debug. Print all keys and values from red-black tree.
+ */
+int databasePrintAll(lua_State *L) {
+    printAll(rbtHandle);
+    return 0;
 }
 
+
 /*
- * helper function for get key-value from red-black tree
- *
- * L: lua state or lua thread
+ * Enable or disable TICK events for background jobs.
  *
+ * input on lua stack:
+ * 1 - boolean
  */
-int databaseHGet(lua_State *L) {
-    return databaseHGet_(L, 0);
+int databaseBackground(lua_State *L) {
+    backgroundJobs = lua_toboolean(L, 1);
+    return 0;
 }
 
 /*
- * helper function for delete key-value from red-black tree
- *
- * L: lua state or lua thread
- *
+ * Monotonic clock in microseconds
  */
-int databaseHDel(lua_State *L) {
-    return databaseHGet_(L, 1);
+long long clockMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
+/*
+ * Monotonic clock in nanoseconds
+ */
+long long clockNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
 /*
- * get all key-value from red-black tree
- *
- * key contain three section:
- *
- * table string
- * key string
- * field string
- *
- * input on lua stack:
- * 1 - table string
- * 2 - key string
- *
- * L: lua state or lua thread
- *
- * put lua table with field-value to lua stack
- * in case some error returned table will be empty
- * return number variables in lua stack
+ * Put to lua stack monotonic clock in microseconds.
+ * Used by lua to limit time spent in background jobs.
  */
-int databaseHGetall(lua_State *L) {
-    if (lua_gettop(L) != 2 || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
-        lua_createtable(L, 0, 0);
-        return 1;
-    }
-    char *table, *key, *field, *val;
-    size_t o_table_size, o_key_size;
-    ZADB_DATA_TYPE table_size, key_size, field_size, val_size;
-    zadbDataKey from, zdbkey;
-    zadbDataVal zdbval;
-    ZADB_DATA_NUM num;
-    int isStr;
+int databaseClock(lua_State *L) {
+    lua_pushinteger(L, clockMicros());
+    return 1;
+}
 
-    const char * o_table = luaToString(L, 1, &o_table_size);
-    const char * o_key = luaToString(L, 2, &o_key_size);
+/*
+ * Put to lua stack true if this process is replica,
+ * replica data is changed only by stream from master.
+ */
+int databaseReadonly(lua_State *L) {
+    lua_pushboolean(L, zadbReplIsReplica());
+    return 1;
+}
 
-    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0) {
-        lua_createtable(L, 0, 0);
-        return 1;
+
+// hidden field with hash version, see hashVersion
+#define isVersionField(field_size) ((field_size) == 0)
+
+#define REL_CHILD_OBJ "rel.index.child.obj.obj."
+#define REL_CHILD_EVT "rel.index.child.obj.evt."
+#define REL_PARENT_EVT "rel.index.parent.obj.evt."
+#define REL_PARENT_OBJ "rel.index.parent.obj.obj."
+
+/*
+ * Hashes visited by current traversal, set keeps values of first entries
+ * of visited hashes. Nothing is written to tree, so traversal does not
+ * dirty pages of image and works in reader threads.
+ */
+typedef struct visitSet {
+    const void **vals;
+    size_t count;
+    size_t cap;
+} visitSet;
+
+#define VISIT_SET_MIN_CAP 256
+
+_Thread_local visitSet relVisit = { NULL, 0, 0 };
+
+size_t visitSetSlot(const void **vals, size_t cap, const void *val) {
+    size_t i = (size_t) (((uintptr_t) val >> 3) * 0x9E3779B97F4A7C15ULL) & (cap - 1);
+    while (vals[i] != NULL && vals[i] != val) {
+        i = (i + 1) & (cap - 1);
     }
-    from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, NULL, 0, 1);
-    lua_createtable(L, 0, 10);
-    RbtIterator iterator;
-    iterator = rbtScan(rbtHandle, from);
-    while (iterator != NULL) {
-        rbtKeyValue(rbtHandle, iterator, (void *) &zdbkey, (void *) &zdbval);
-        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
-        if (!isStringEqual(o_table, o_table_size, table, table_size) || !isStringEqual(o_key, o_key_size, key, key_size)) {
-            break;
-        }
-        zadbValGet(zdbval, &val, &val_size, &num, &isStr);
-        lua_pushlstring(L, field, field_size);
-        if (isStr) {
-            if (val != NULL) {
-                lua_pushlstring(L, val, val_size);
-            } else {
-                lua_pushlstring(L, "", 0);
-            }
-        } else {
-            lua_pushinteger(L, num);
-        }
+    return i;
+}
 
-        lua_rawset(L, -3);
-        iterator = rbtNext(rbtHandle, iterator);
-        db_stat_get++;
+/*
+ * Empty set for next traversal. Table left big by large traversal is
+ * freed, so clear of small traversals after it does not cost its size.
+ */
+void visitSetClear(visitSet *set) {
+    if (set->cap > VISIT_SET_MIN_CAP && set->count * 8 < set->cap) {
+        free(set->vals);
+        set->vals = NULL;
+        set->cap = 0;
+    } else if (set->count > 0) {
+        memset(set->vals, 0, set->cap * sizeof(void *));
     }
-    zadbKeyFree(from);
-    return 1;
+    set->count = 0;
 }
 
 /*
- * Delete all key-value from red-black tree
- *
- * key contain three section:
- *
- * table string
- * key string
- * field string
- *
- * input on lua stack:
- * 1 - table string
- * 2 - key string
- *
- * L: lua state or lua thread
- *
- * put on lua stack empty lua table //TODO what for?
- * return number variables in lua stack
+ * return 1 if value was in set before
  */
-int databaseHDelall(lua_State *L) {
-    if (lua_gettop(L) != 2 || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
-        lua_createtable(L, 0, 0);
+int visitSetAdd(visitSet *set, const void *val) {
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : VISIT_SET_MIN_CAP;
+        const void **vals = calloc(cap, sizeof(void *));
+        if (vals == NULL) {
+            perror("visit set alloc failed");
+            exit(1);
+        }
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->vals[i] != NULL) {
+                vals[visitSetSlot(vals, cap, set->vals[i])] = set->vals[i];
+            }
+        }
+        free(set->vals);
+        set->vals = vals;
+        set->cap = cap;
+    }
+    size_t i = visitSetSlot(set->vals, set->cap, val);
+    if (set->vals[i] != NULL) {
         return 1;
     }
+    set->vals[i] = val;
+    set->count++;
+    return 0;
+}
 
-    char * table, *key, *field;
-    size_t o_table_size, o_key_size;
-    ZADB_DATA_TYPE table_size, key_size, field_size;
-    zadbDataKey from, zdbkey;
+/*
+ * Find first field of hash
+ *
+ * return 1 if iterator is at first field, 0 if hash is empty
+ */
+int hashFirst(const char *table, size_t table_size, const char *key, size_t key_size, zadbIter *iterator) {
+    char *k_table, *k_key, *k_field;
+    ZADB_DATA_TYPE k_table_size, k_key_size, k_field_size;
+    zadbDataKey zdbkey;
     zadbDataVal zdbval;
+    zadbKey from;
 
-    const char * o_table = luaToString(L, 1, &o_table_size);
-    const char * o_key = luaToString(L, 2, &o_key_size);
-
-    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0) {
-        lua_createtable(L, 0, 0);
-        return 1;
+    int found = zadbIterScan(rbtHandle, iterator, zadbKeyRefInit(&from, table, table_size, key, key_size, NULL, 0));
+    if (!found) {
+        return 0;
     }
-    from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, NULL, 0, 1);
-    lua_createtable(L, 0, 0);
-    RbtIterator iterator;
-    iterator = rbtScan(rbtHandle, from);
-    while (iterator != NULL) {
-        rbtKeyValue(rbtHandle, iterator, (void *) &zdbkey, (void *) &zdbval);
-        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
-        if (!isStringEqual(o_table, o_table_size, table, table_size) || !isStringEqual(o_key, o_key_size, key, key_size)) {
-            break;
-        }
-        zadbKeyFree(zdbkey);
-        zadbValFree(zdbval);
-        rbtErase(rbtHandle, iterator);
-        db_stat_del++;
-        iterator = rbtScan(rbtHandle, from);
+    zadbIterKeyValue(rbtHandle, iterator, &zdbkey, &zdbval);
+    zadbKeyGet(zdbkey, &k_table, &k_table_size, &k_key, &k_key_size, &k_field, &k_field_size);
+    if (!isStringEqual(table, table_size, k_table, k_table_size) || !isStringEqual(key, key_size, k_key, k_key_size)) {
+        return 0;
     }
-    zadbKeyFree(from);
     return 1;
 }
 
 /*
- * Insert key-value to red-black tree
+ * Add hash to visited hashes of current traversal
  *
- * key contain three section:
- *
- * table string
- * key string
+ * return 1 if hash was visited before in this traversal, 0 otherwise.
+ * Empty hash is never visited.
+ */
+int hashVisit(const char *table, size_t table_size, const char *key, size_t key_size) {
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    zadbIter iterator;
+    if (!hashFirst(table, table_size, key, key_size, &iterator)) {
+        return 0;
+    }
+    zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+    return visitSetAdd(&relVisit, zdbval);
+}
+
+typedef struct relStackItem {
+    const char *key;
+    size_t key_size;
+} relStackItem;
+
+_Thread_local relStackItem *relStack = NULL;
+_Thread_local size_t relStackCap = 0;
+
+void relStackPush(const char *key, size_t key_size, size_t top) {
+    if (relStackCap == 0) {
+        relStackCap = 256;
+        relStack = malloc(relStackCap * sizeof(relStackItem));
+    } else if (top == relStackCap) {
+        relStackCap *= 2;
+        relStack = realloc(relStack, relStackCap * sizeof(relStackItem));
+    }
+    if (relStack == NULL) {
+        perror("relStack alloc failed");
+        exit(1);
+    }
+    relStack[top].key = key;
+    relStack[top].key_size = key_size;
+}
+
+/*
+ * Relation of object to its child objects or events is changed.
+ * Bump cache version of object and all its parents, replies cached
+ * for them are stale now.
+ */
+void relSubtreeChanged(const char *objkey, size_t objkey_size) {
+    char *table, *key, *field;
+    ZADB_DATA_TYPE table_size, key_size, field_size;
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    size_t top = 0;
+
+    if (zadbCacheIsEmpty()) {
+        return;
+    }
+    visitSetClear(&relVisit);
+    hashVisit(REL_PARENT_OBJ, sizeof(REL_PARENT_OBJ) - 1, objkey, objkey_size);
+    relStackPush(objkey, objkey_size, top++);
+    while (top > 0) {
+        top--;
+        const char *obj = relStack[top].key;
+        size_t obj_size = relStack[top].key_size;
+        zadbCacheBump(obj, obj_size);
+        zadbIter iterator;
+        int found = hashFirst(REL_PARENT_OBJ, sizeof(REL_PARENT_OBJ) - 1, obj, obj_size, &iterator);
+        while (found) {
+            zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+            zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+            if (!isStringEqual(REL_PARENT_OBJ, sizeof(REL_PARENT_OBJ) - 1, table, table_size) || !isStringEqual(obj, obj_size, key, key_size)) {
+                break;
+            }
+            if (!isVersionField(field_size) && !hashVisit(REL_PARENT_OBJ, sizeof(REL_PARENT_OBJ) - 1, field, field_size)) {
+                relStackPush(field, field_size, top++);
+            }
+            found = zadbIterNext(rbtHandle, &iterator);
+        }
+    }
+}
+
+/*
+ * Check if changes in table can make cached replies stale.
+ */
+int isRelChildTable(const char *table, size_t table_size) {
+    return isStringEqual(REL_CHILD_OBJ, sizeof(REL_CHILD_OBJ) - 1, table, table_size)
+            || isStringEqual(REL_CHILD_EVT, sizeof(REL_CHILD_EVT) - 1, table, table_size);
+}
+
+
+/*
+ * Hash version.
+ *
+ * Every hash has hidden field with empty name and number value, it is
+ * version of hash. Empty field is less than any other, so it is always
+ * first in hash. Version is taken from global counter on every change,
+ * so it never goes back even if hash is deleted and created again.
+ */
+long long db_version_seq = 0;
+
+/*
+ * return version of hash or 0 if hash does not exist
+ */
+long long hashVersion(const char *table, size_t table_size, const char *key, size_t key_size) {
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+    char *val;
+    ZADB_DATA_TYPE val_size;
+    ZADB_DATA_NUM num = 0;
+    int isStr;
+
+    zadbIter iterator;
+    from = zadbKeyNew(table, table_size, key, key_size, "", 0, 1);
+    int found = zadbIterFind(rbtHandle, &iterator, from);
+    zadbKeyFree(from);
+    if (!found) {
+        return 0;
+    }
+    zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+    zadbValGet(zdbval, &val, &val_size, &num, &isStr);
+    return num;
+}
+
+/*
+ * Set new version of changed hash
+ */
+void hashVersionBump(const char *table, size_t table_size, const char *key, size_t key_size) {
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+
+    db_version_seq++;
+    zadbLogSetInt(table, table_size, key, key_size, "", 0, db_version_seq);
+    zadbIter iterator;
+    from = zadbKeyNew(table, table_size, key, key_size, "", 0, 1);
+    int found = zadbIterFind(rbtHandle, &iterator, from);
+    zadbKeyFree(from);
+    if (found) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        if (zadbValIsStatic(zdbval)) {
+            zadbIterUpdate(rbtHandle, &iterator, zadbValNewInt(db_version_seq));
+        } else {
+            zadbValSetInt(zdbval, db_version_seq);
+        }
+        return;
+    }
+    zdbkey = zadbKeyNew(table, table_size, key, key_size, "", 0, 0);
+    zdbval = zadbValNewInt(db_version_seq);
+    if (zadbInsert(rbtHandle, zdbkey, zdbval) != RBT_STATUS_OK) {
+        perror("error hashVersionBump");
+    }
+}
+
+/*
+ * Hash lost a field. Set new version or delete version field
+ * if there is no more fields in hash.
+ */
+void hashVersionFieldDeleted(const char *table, size_t table_size, const char *key, size_t key_size) {
+    char *k_table, *k_key, *k_field;
+    ZADB_DATA_TYPE k_table_size, k_key_size, k_field_size;
+    zadbDataKey zdbkey, nextkey;
+    zadbDataVal zdbval, nextval;
+
+    zadbIter iterator, next;
+    if (!hashFirst(table, table_size, key, key_size, &iterator)) {
+        return;
+    }
+    next = iterator;
+    if (zadbIterNext(rbtHandle, &next)) {
+        zadbIterKeyValue(rbtHandle, &next, &nextkey, &nextval);
+        zadbKeyGet(nextkey, &k_table, &k_table_size, &k_key, &k_key_size, &k_field, &k_field_size);
+        if (isStringEqual(table, table_size, k_table, k_table_size) && isStringEqual(key, key_size, k_key, k_key_size)) {
+            hashVersionBump(table, table_size, key, key_size);
+            return;
+        }
+    }
+    zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+    zadbKeyGet(zdbkey, &k_table, &k_table_size, &k_key, &k_key_size, &k_field, &k_field_size);
+    if (isVersionField(k_field_size)) {
+        zadbLogDel(table, table_size, key, key_size, "", 0);
+        zadbIterErase(rbtHandle, &iterator);
+    }
+}
+
+/*
+ * Index of changed field or NULL if field is not indexed.
+ * indexed is result of zadbIndexHasTable for table of field.
+ */
+zadbIndex indexOfField(int indexed, const char *table, size_t table_size, const char *field, size_t field_size) {
+    if (!indexed || isVersionField(field_size)) {
+        return NULL;
+    }
+    return zadbIndexFind(table, table_size, field, field_size);
+}
+
+/*
+ * Add value of field to index or remove it from index
+ */
+void indexValue(zadbIndex idx, const char *key, size_t key_size, zadbDataVal zdbval, int add) {
+    char *val;
+    ZADB_DATA_TYPE val_size;
+    ZADB_DATA_NUM num;
+    int isStr;
+    zadbValGet(zdbval, &val, &val_size, &num, &isStr);
+    if (add) {
+        zadbIndexAdd(idx, key, key_size, isStr ? ZADB_INDEX_STR : ZADB_INDEX_NUM, num, val, val_size);
+    } else {
+        zadbIndexDel(idx, key, key_size, isStr ? ZADB_INDEX_STR : ZADB_INDEX_NUM, num, val, val_size);
+    }
+}
+
+/*
+ * Entries loaded into empty tree are collected while they come in tree
+ * order (snapshot, rewritten log) and tree is built from them at once.
+ * First entry out of order or delete builds tree and loading goes on
+ * by inserts.
+ */
+typedef struct bulkLoad {
+    int startup;
+    int active;
+    zadbDataKey *keys;
+    zadbDataVal *vals;
+    size_t count;
+    size_t cap;
+    size_t pos;
+} bulkLoad;
+
+bulkLoad bulk;
+
+void bulkLoadStart() {
+    if (bulk.startup && rbtBegin(rbtHandle) == NULL) {
+        bulk.active = 1;
+    }
+}
+
+int bulkLoadAdd(zadbDataKey zdbkey, zadbDataVal zdbval) {
+    if (bulk.count > 0 && zadbKeyFieldCompare(bulk.keys[bulk.count - 1], zdbkey) >= 0) {
+        return 0;
+    }
+    if (bulk.count == bulk.cap) {
+        size_t cap = bulk.cap ? bulk.cap * 2 : 65536;
+        zadbDataKey *keys = realloc(bulk.keys, cap * sizeof(zadbDataKey));
+        if (keys == NULL) {
+            return 0;
+        }
+        bulk.keys = keys;
+        zadbDataVal *vals = realloc(bulk.vals, cap * sizeof(zadbDataVal));
+        if (vals == NULL) {
+            return 0;
+        }
+        bulk.vals = vals;
+        bulk.cap = cap;
+    }
+    bulk.keys[bulk.count] = zdbkey;
+    bulk.vals[bulk.count] = zdbval;
+    bulk.count++;
+    return 1;
+}
+
+int bulkLoadNext(void *ctx, void **key, void **val) {
+    bulkLoad *b = ctx;
+    if (b->pos == b->count) {
+        return 0;
+    }
+    *key = b->keys[b->pos];
+    *val = b->vals[b->pos];
+    b->pos++;
+    return 1;
+}
+
+void bulkLoadFinish() {
+    zadbDataVal rbdup;
+    if (!bulk.active) {
+        return;
+    }
+    bulk.active = 0;
+    bulk.pos = 0;
+    if (rbtBulkLoad(rbtHandle, bulk.count, bulkLoadNext, &bulk) != RBT_STATUS_OK) {
+        for (size_t i = 0; i < bulk.count; i++) {
+            if (rbtInsert(rbtHandle, bulk.keys[i], bulk.vals[i], &rbdup) != RBT_STATUS_OK) {
+                perror("error bulkLoadFinish");
+            } else {
+                zadbMemEntry(bulk.keys[i], bulk.vals[i], 1);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < bulk.count; i++) {
+            zadbMemEntry(bulk.keys[i], bulk.vals[i], 1);
+        }
+    }
+    free(bulk.keys);
+    free(bulk.vals);
+    bulk.keys = NULL;
+    bulk.vals = NULL;
+    bulk.count = bulk.cap = 0;
+}
+
+/*
+ * Functions to apply records of mutation log on start and of replication
+ * stream. Data is changed directly in tree, hash versions come from
+ * records too. Indexes and cached replies are kept as by lua functions.
+ */
+void logApplySet(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, zadbDataVal newval) {
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+    zadbIter iterator;
+    if (bulk.active) {
+        zdbkey = zadbKeyNew(table, table_size, key, key_size, field, field_size, 0);
+        if (bulkLoadAdd(zdbkey, newval)) {
+            return;
+        }
+        zadbKeyFree(zdbkey);
+        bulkLoadFinish();
+    }
+    zadbIndex idx = indexOfField(zadbIndexHasTable(table, table_size), table, table_size, field, field_size);
+    from = zadbKeyNew(table, table_size, key, key_size, field, field_size, 1);
+    int found = zadbIterFind(rbtHandle, &iterator, from);
+    zadbKeyFree(from);
+    if (found) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        if (idx != NULL) {
+            indexValue(idx, key, key_size, zdbval, 0);
+        }
+        zadbIterUpdate(rbtHandle, &iterator, newval);
+    } else {
+        zdbkey = zadbKeyNew(table, table_size, key, key_size, field, field_size, 0);
+        if (zadbInsert(rbtHandle, zdbkey, newval) != RBT_STATUS_OK) {
+            perror("error logApplySet");
+        }
+    }
+    if (idx != NULL) {
+        indexValue(idx, key, key_size, newval, 1);
+    }
+    if (isRelChildTable(table, table_size)) {
+        relSubtreeChanged(key, key_size);
+    }
+}
+
+void logApplySetStr(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, const char *val, size_t val_size) {
+    logApplySet(table, table_size, key, key_size, field, field_size, zadbValNewStr(val, val_size));
+}
+
+void logApplySetInt(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, ZADB_DATA_NUM num) {
+    if (isVersionField(field_size) && num > db_version_seq) {
+        db_version_seq = num;
+    }
+    logApplySet(table, table_size, key, key_size, field, field_size, zadbValNewInt(num));
+}
+
+/*
+ * Delete entry at iterator with its index value
+ */
+void logApplyErase(zadbIter *iterator, int indexed) {
+    char *table, *key, *field;
+    ZADB_DATA_TYPE table_size, key_size, field_size;
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    zadbIterKeyValue(rbtHandle, iterator, &zdbkey, &zdbval);
+    zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+    zadbIndex idx = indexOfField(indexed, table, table_size, field, field_size);
+    if (idx != NULL) {
+        indexValue(idx, key, key_size, zdbval, 0);
+    }
+    zadbIterErase(rbtHandle, iterator);
+}
+
+void logApplyDel(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size) {
+    zadbDataKey from;
+    zadbIter iterator;
+    bulkLoadFinish();
+    from = zadbKeyNew(table, table_size, key, key_size, field, field_size, 1);
+    int found = zadbIterFind(rbtHandle, &iterator, from);
+    zadbKeyFree(from);
+    if (found) {
+        logApplyErase(&iterator, zadbIndexHasTable(table, table_size));
+        if (isRelChildTable(table, table_size)) {
+            relSubtreeChanged(key, key_size);
+        }
+    }
+}
+
+void logApplyDelAll(const char *table, size_t table_size, const char *key, size_t key_size) {
+    zadbIter iterator;
+    int indexed = zadbIndexHasTable(table, table_size);
+    bulkLoadFinish();
+    while (hashFirst(table, table_size, key, key_size, &iterator)) {
+        logApplyErase(&iterator, indexed);
+    }
+    if (isRelChildTable(table, table_size)) {
+        relSubtreeChanged(key, key_size);
+    }
+}
+
+/*
+ * Erase all changes over image, full replication sync starts with it
+ */
+void logApplyClear(ZADB_DATA_NUM seq) {
+    char *table, *key, *field;
+    ZADB_DATA_TYPE table_size, key_size, field_size;
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    RbtIterator iterator;
+    bulkLoadFinish();
+    while ((iterator = rbtBegin(rbtHandle)) != NULL) {
+        rbtKeyValue(rbtHandle, iterator, (void *) &zdbkey, (void *) &zdbval);
+        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+        zadbIndex idx = indexOfField(zadbIndexHasTable(table, table_size), table, table_size, field, field_size);
+        if (idx != NULL && !zadbValIsTombstone(zdbval)) {
+            indexValue(idx, key, key_size, zdbval, 0);
+        }
+        zadbMemEntry(zdbkey, zdbval, -1);
+        rbtErase(rbtHandle, iterator);
+        zadbKeyFree(zdbkey);
+        zadbValFree(zdbval);
+    }
+    zadbCacheClear();
+    db_version_seq = seq;
+    bulkLoadStart();
+}
+
+const zadbLogApply logApply = {
+    logApplySetStr, logApplySetInt, logApplyDel, logApplyDelAll, logApplyClear
+};
+
+/*
+ * Put values of field from all hashes of table to new index
+ */
+void indexBuild(zadbIndex idx, const char *table, size_t table_size, const char *field, size_t field_size) {
+    char *k_table, *k_key, *k_field;
+    ZADB_DATA_TYPE k_table_size, k_key_size, k_field_size;
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+
+    zadbIter iterator;
+    from = zadbKeyNew(table, table_size, NULL, 0, NULL, 0, 1);
+    int found = zadbIterScan(rbtHandle, &iterator, from);
+    zadbKeyFree(from);
+    while (found) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        zadbKeyGet(zdbkey, &k_table, &k_table_size, &k_key, &k_key_size, &k_field, &k_field_size);
+        if (!isStringEqual(table, table_size, k_table, k_table_size)) {
+            break;
+        }
+        if (isStringEqual(field, field_size, k_field, k_field_size)) {
+            indexValue(idx, k_key, k_key_size, zdbval, 1);
+        }
+        found = zadbIterNext(rbtHandle, &iterator);
+    }
+}
+
+/*
+ * Declare secondary index on field of table. Existing values are
+ * indexed at once, later changes are kept by hset and delete functions.
+ *
+ * input on lua stack:
+ * 1 - table string
+ * 2 - field string
+ *
+ * L: lua state or lua thread
+ *
+ * put number of indexed values to lua stack
+ * return number variables in lua stack
+ */
+int databaseIndex(lua_State *L) {
+    size_t o_table_size, o_field_size;
+    int created;
+    if (lua_gettop(L) != 2 || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    const char * o_table = luaToString(L, 1, &o_table_size);
+    const char * o_field = luaToString(L, 2, &o_field_size);
+    if (o_table == NULL || o_table_size == 0 || o_field == NULL || o_field_size == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    zadbIndex idx = zadbIndexCreate(o_table, o_table_size, o_field, o_field_size, &created);
+    if (idx == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (created) {
+        indexBuild(idx, o_table, o_table_size, o_field, o_field_size);
+    }
+    lua_pushinteger(L, zadbIndexEntries(idx));
+    return 1;
+}
+
+
+/*
+ * get or get and delete key-value from red-black tree
+ *
+ * key contain three section:
+ *
+ * table string
+ * key string
  * field string
  *
  * input on lua stack:
  * 1 - table string
  * 2 - key string
- * 3 - table that contain field-value
+ * 3 - field string
+ *
  *
  * L: lua state or lua thread
+ * delete: if delete != 0 then  key-value will be deleted
+ *
+ * put value from red-black tree. String or number
+ * return number variables in lua stack
  *
- * no returns variables on lua stack
- * return always 0
  */
-int databaseHSet(lua_State *L) {
-    if (lua_gettop(L) != 3 || !lua_istable(L, 3) || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
-        return 0;
+int databaseHGet_(lua_State *L, int delete) {
+    if (lua_gettop(L) != 3 || !lua_isstring(L, 1) || !lua_isstring(L, 2) || !lua_isstring(L, 3)) {
+        lua_pushnil(L);
+        return 1;
     }
-    size_t o_table_size, o_key_size, field_size, val_size;
-    zadbDataKey zdbkey;
-    zadbDataVal zdbval, rbdup;
-    lua_Integer num;
+    char *table, *key, *field, *val;
+    size_t o_table_size, o_key_size, o_field_size;
+    ZADB_DATA_TYPE table_size, key_size, field_size, val_size;
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+    ZADB_DATA_NUM num;
+    int isStr;
 
     const char * o_table = luaToString(L, 1, &o_table_size);
     const char * o_key = luaToString(L, 2, &o_key_size);
+    const char * o_field = luaToString(L, 3, &o_field_size);
 
-    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0) {
-        return 0;
+    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0 || o_field == NULL || o_field_size == 0) {
+        lua_pushnil(L);
+        return 1;
     }
 
-    lua_pushnil(L);
-    while (lua_next(L, 3) != 0) {
-        const char * field = luaToString(L, -2, &field_size);
-        int type = lua_type(L, -1);
-        if (type != LUA_TNUMBER) {
-            const char * val = luaToString(L, -1, &val_size);
-
-            zdbval = zadbValNewStr(val, val_size);
+    zadbIter iterator;
+    from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, o_field, o_field_size, 1);
+    if (zadbIterFind(rbtHandle, &iterator, from)) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+        zadbValGet(zdbval, &val, &val_size, &num, &isStr);
+        if (isStr) {
+            if (val != NULL) {
+                lua_pushlstring(L, val, val_size);
+            } else {
+                lua_pushlstring(L, "", 0);
+            }
+        } else {
+            lua_pushinteger(L, num);
+        }
+        if (delete) {
+            db_stat_del++;
+            zadbIndex idx = indexOfField(zadbIndexHasTable(o_table, o_table_size), o_table, o_table_size, o_field, o_field_size);
+            if (idx != NULL) {
+                indexValue(idx, o_key, o_key_size, zdbval, 0);
+            }
+            zadbLogDel(o_table, o_table_size, o_key, o_key_size, o_field, o_field_size);
+            zadbIterErase(rbtHandle, &iterator);
+            hashVersionFieldDeleted(o_table, o_table_size, o_key, o_key_size);
+            if (isRelChildTable(o_table, o_table_size)) {
+                relSubtreeChanged(o_key, o_key_size);
+            }
+        }else{
+            db_stat_get++;
+        }
+    } else {
+        lua_pushnil(L);
+    }
+    zadbKeyFree(from);
+    return 1;
+}
+
+/*
+ * helper function for get key-value from red-black tree
+ *
+ * L: lua state or lua thread
+ *
+ */
+int databaseHGet(lua_State *L) {
+    return databaseHGet_(L, 0);
+}
+
+/*
+ * helper function for delete key-value from red-black tree
+ *
+ * L: lua state or lua thread
+ *
+ */
+int databaseHDel(lua_State *L) {
+    if (zadbReplIsReplica()) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return databaseHGet_(L, 1);
+}
+
+
+/*
+ * get all key-value from red-black tree
+ *
+ * key contain three section:
+ *
+ * table string
+ * key string
+ * field string
+ *
+ * input on lua stack:
+ * 1 - table string
+ * 2 - key string
+ *
+ * L: lua state or lua thread
+ *
+ * put lua table with field-value to lua stack
+ * in case some error returned table will be empty
+ * return number variables in lua stack
+ */
+int databaseHGetall(lua_State *L) {
+    if (lua_gettop(L) != 2 || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+    char *table, *key, *field, *val;
+    size_t o_table_size, o_key_size;
+    ZADB_DATA_TYPE table_size, key_size, field_size, val_size;
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+    ZADB_DATA_NUM num;
+    int isStr;
+
+    const char * o_table = luaToString(L, 1, &o_table_size);
+    const char * o_key = luaToString(L, 2, &o_key_size);
+
+    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0) {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+    from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, NULL, 0, 1);
+    lua_createtable(L, 0, 10);
+    zadbIter iterator;
+    int found = zadbIterScan(rbtHandle, &iterator, from);
+    while (found) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+        if (!isStringEqual(o_table, o_table_size, table, table_size) || !isStringEqual(o_key, o_key_size, key, key_size)) {
+            break;
+        }
+        if (!isVersionField(field_size)) {
+            zadbValGet(zdbval, &val, &val_size, &num, &isStr);
+            lua_pushlstring(L, field, field_size);
+            if (isStr) {
+                if (val != NULL) {
+                    lua_pushlstring(L, val, val_size);
+                } else {
+                    lua_pushlstring(L, "", 0);
+                }
+            } else {
+                lua_pushinteger(L, num);
+            }
+
+            lua_rawset(L, -3);
+        }
+        found = zadbIterNext(rbtHandle, &iterator);
+        db_stat_get++;
+    }
+    zadbKeyFree(from);
+    return 1;
+}
+
+/*
+ * Delete all key-value from red-black tree
+ *
+ * key contain three section:
+ *
+ * table string
+ * key string
+ * field string
+ *
+ * input on lua stack:
+ * 1 - table string
+ * 2 - key string
+ *
+ * L: lua state or lua thread
+ *
+ * put on lua stack empty lua table //TODO what for?
+ * return number variables in lua stack
+ */
+int databaseHDelall(lua_State *L) {
+    if (zadbReplIsReplica() || lua_gettop(L) != 2 || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+
+    char * table, *key, *field;
+    size_t o_table_size, o_key_size;
+    ZADB_DATA_TYPE table_size, key_size, field_size;
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+
+    const char * o_table = luaToString(L, 1, &o_table_size);
+    const char * o_key = luaToString(L, 2, &o_key_size);
+
+    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0) {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+    int indexed = zadbIndexHasTable(o_table, o_table_size);
+    int deleted = 0;
+    from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, NULL, 0, 1);
+    lua_createtable(L, 0, 0);
+    zadbIter iterator;
+    int found = zadbIterScan(rbtHandle, &iterator, from);
+    while (found) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+        if (!isStringEqual(o_table, o_table_size, table, table_size) || !isStringEqual(o_key, o_key_size, key, key_size)) {
+            break;
+        }
+        zadbIndex idx = indexOfField(indexed, o_table, o_table_size, field, field_size);
+        if (idx != NULL) {
+            indexValue(idx, o_key, o_key_size, zdbval, 0);
+        }
+        zadbIterErase(rbtHandle, &iterator);
+        db_stat_del++;
+        deleted = 1;
+        found = zadbIterScan(rbtHandle, &iterator, from);
+    }
+    zadbKeyFree(from);
+    if (deleted) {
+        zadbLogDelAll(o_table, o_table_size, o_key, o_key_size);
+    }
+    if (isRelChildTable(o_table, o_table_size)) {
+        relSubtreeChanged(o_key, o_key_size);
+    }
+    return 1;
+}
+
+/*
+ * get page of field names from red-black tree
+ *
+ * key contain three section:
+ *
+ * table string
+ * key string
+ * field string
+ *
+ * input on lua stack:
+ * 1 - table string
+ * 2 - key string
+ * 3 - count number, max fields in page
+ * 4 - after string, optional. Page starts after this field
+ *
+ * Used as resumable cursor for walk over big hashes by parts.
+ *
+ * L: lua state or lua thread
+ *
+ * put lua array with field names to lua stack
+ * in case some error returned table will be empty
+ * return number variables in lua stack
+ */
+int databaseHKeys(lua_State *L) {
+    int top = lua_gettop(L);
+    if (top < 3 || top > 4 || !lua_isstring(L, 1) || !lua_isstring(L, 2) || !lua_isnumber(L, 3)) {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+    char *table, *key, *field;
+    size_t o_table_size, o_key_size, o_after_size = 0;
+    ZADB_DATA_TYPE table_size, key_size, field_size;
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+    const char * o_after = NULL;
+
+    const char * o_table = luaToString(L, 1, &o_table_size);
+    const char * o_key = luaToString(L, 2, &o_key_size);
+    lua_Integer count = lua_tointeger(L, 3);
+    if (top == 4 && !lua_isnil(L, 4)) {
+        o_after = luaToString(L, 4, &o_after_size);
+    }
+
+    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0 || count < 1) {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+    from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, o_after, o_after_size, 1);
+    lua_createtable(L, count < 64 ? count : 64, 0);
+    zadbIter iterator;
+    int found = zadbIterScan(rbtHandle, &iterator, from);
+    lua_Integer n = 0;
+    while (found && n < count) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+        if (!isStringEqual(o_table, o_table_size, table, table_size) || !isStringEqual(o_key, o_key_size, key, key_size)) {
+            break;
+        }
+        if (!isVersionField(field_size) && (o_after == NULL || !isStringEqual(o_after, o_after_size, field, field_size))) {
+            lua_pushlstring(L, field, field_size);
+            lua_rawseti(L, -2, ++n);
+        }
+        found = zadbIterNext(rbtHandle, &iterator);
+        db_stat_get++;
+    }
+    zadbKeyFree(from);
+    return 1;
+}
+
+/*
+ * Insert key-value to red-black tree
+ *
+ * key contain three section:
+ *
+ * table string
+ * key string
+ * field string
+ *
+ * input on lua stack:
+ * 1 - table string
+ * 2 - key string
+ * 3 - table that contain field-value
+ *
+ * Value equal to stored one is not touched. Changed value is rewritten
+ * in place if it fits old allocation.
+ *
+ * L: lua state or lua thread
+ *
+ * put to lua stack table with changed fields (field -> true)
+ * or nil if nothing changed
+ * return number variables in lua stack
+ */
+int databaseHSet(lua_State *L) {
+    if (zadbReplIsReplica() || lua_gettop(L) != 3 || !lua_istable(L, 3) || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    char *old_str;
+    size_t o_table_size, o_key_size, field_size, val_size;
+    ZADB_DATA_TYPE old_size;
+    ZADB_DATA_NUM old_num;
+    int old_isStr;
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+    lua_Integer num;
+
+    const char * o_table = luaToString(L, 1, &o_table_size);
+    const char * o_key = luaToString(L, 2, &o_key_size);
+
+    if (o_table == NULL || o_table_size == 0 || o_key == NULL || o_key_size == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    int base = lua_gettop(L);
+    int changed = 0;
+    int indexed = zadbIndexHasTable(o_table, o_table_size);
+    lua_pushnil(L);
+    while (lua_next(L, 3) != 0) {
+        int top = lua_gettop(L);
+        const char * field = luaToString(L, top - 1, &field_size);
+        if (field == NULL || isVersionField(field_size)) {
+            lua_settop(L, top - 1);
+            continue;
+        }
+        int isStr = lua_type(L, top) != LUA_TNUMBER;
+        const char * val = NULL;
+        num = 0;
+        val_size = 0;
+        if (isStr) {
+            val = luaToString(L, top, &val_size);
+        } else {
+            num = lua_tointeger(L, top);
+        }
+
+        zadbIndex idx = indexOfField(indexed, o_table, o_table_size, field, field_size);
+        zadbIter iterator;
+        from = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, field, field_size, 1);
+        int found = zadbIterFind(rbtHandle, &iterator, from);
+        zadbKeyFree(from);
+        if (found) {
+            zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+            zadbValGet(zdbval, &old_str, &old_size, &old_num, &old_isStr);
+            if (isStr && old_isStr && isStringEqual(val, val_size, old_str, old_size)) {
+                lua_settop(L, top - 1);
+                continue;
+            }
+            if (!isStr && !old_isStr && num == old_num) {
+                lua_settop(L, top - 1);
+                continue;
+            }
+            if (idx != NULL) {
+                indexValue(idx, o_key, o_key_size, zdbval, 0);
+            }
+            if (zadbValIsStatic(zdbval)) {
+                zadbIterUpdate(rbtHandle, &iterator, isStr ? zadbValNewStr(val, val_size) : zadbValNewInt(num));
+            } else if (!isStr && !old_isStr) {
+                zadbValSetInt(zdbval, num);
+            } else if (!isStr || !old_isStr || !zadbValSetStr(zdbval, val, val_size)) {
+                zadbIterUpdate(rbtHandle, &iterator, isStr ? zadbValNewStr(val, val_size) : zadbValNewInt(num));
+            }
+            db_stat_upd++;
+        } else {
+            zdbval = isStr ? zadbValNewStr(val, val_size) : zadbValNewInt(num);
+            zdbkey = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, field, field_size, 0);
+            if (zadbInsert(rbtHandle, zdbkey, zdbval) != RBT_STATUS_OK) {
+                perror("error databaseHSet");
+            }
+            db_stat_set++;
+        }
+        if (idx != NULL) {
+            zadbIndexAdd(idx, o_key, o_key_size, isStr ? ZADB_INDEX_STR : ZADB_INDEX_NUM, num, val, val_size);
+        }
+        if (isStr) {
+            zadbLogSetStr(o_table, o_table_size, o_key, o_key_size, field, field_size, val, val_size);
+        } else {
+            zadbLogSetInt(o_table, o_table_size, o_key, o_key_size, field, field_size, num);
+        }
+        if (!changed) {
+            lua_createtable(L, 0, 4);
+            lua_insert(L, base + 1);
+            top++;
+        }
+        changed++;
+        lua_pushlstring(L, field, field_size);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, base + 1);
+        lua_settop(L, top - 1);
+    }
+    if (!changed) {
+        lua_pushnil(L);
+        return 1;
+    }
+    hashVersionBump(o_table, o_table_size, o_key, o_key_size);
+    if (isRelChildTable(o_table, o_table_size)) {
+        relSubtreeChanged(o_key, o_key_size);
+    }
+    return 1;
+}
+
+
+/*
+ * Collect keys of events related to object and all its child objects.
+ *
+ * Iterative depth-first walk over child relations. Visited objects and
+ * events are kept in visit set, so cycles and shared children are
+ * visited only once. Keys are written to reply buffer as RESP map
+ * event key -> 0.
+ *
+ * return number of events
+ */
+long long relCollectEvents(const char *objkey, size_t objkey_size) {
+    char *table, *key, *field;
+    ZADB_DATA_TYPE table_size, key_size, field_size;
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    size_t top = 0;
+    long long count = 0;
+
+    visitSetClear(&relVisit);
+    hashVisit(REL_CHILD_OBJ, sizeof(REL_CHILD_OBJ) - 1, objkey, objkey_size);
+    relStackPush(objkey, objkey_size, top++);
+    while (top > 0) {
+        top--;
+        const char *obj = relStack[top].key;
+        size_t obj_size = relStack[top].key_size;
+
+        zadbIter iterator;
+        int found = hashFirst(REL_CHILD_EVT, sizeof(REL_CHILD_EVT) - 1, obj, obj_size, &iterator);
+        while (found) {
+            zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+            zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+            if (!isStringEqual(REL_CHILD_EVT, sizeof(REL_CHILD_EVT) - 1, table, table_size) || !isStringEqual(obj, obj_size, key, key_size)) {
+                break;
+            }
+            if (!isVersionField(field_size) && !hashVisit(REL_PARENT_EVT, sizeof(REL_PARENT_EVT) - 1, field, field_size)) {
+                replyAppendBulk(field, field_size);
+                replyAppendInt(0);
+                count++;
+            }
+            found = zadbIterNext(rbtHandle, &iterator);
+            db_stat_get++;
+        }
+
+        found = hashFirst(REL_CHILD_OBJ, sizeof(REL_CHILD_OBJ) - 1, obj, obj_size, &iterator);
+        while (found) {
+            zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+            zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+            if (!isStringEqual(REL_CHILD_OBJ, sizeof(REL_CHILD_OBJ) - 1, table, table_size) || !isStringEqual(obj, obj_size, key, key_size)) {
+                break;
+            }
+            if (!isVersionField(field_size) && !hashVisit(REL_CHILD_OBJ, sizeof(REL_CHILD_OBJ) - 1, field, field_size)) {
+                relStackPush(field, field_size, top++);
+            }
+            found = zadbIterNext(rbtHandle, &iterator);
+            db_stat_get++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Append hash to reply as RESP array of field-value pairs in field order.
+ * Number of fields is known after scan, so array header is put before
+ * fields at the end.
+ *
+ * return number of fields
+ */
+long long replyAppendHash(const char *table, size_t table_size, const char *key, size_t key_size) {
+    char *k_table, *k_key, *field, *val;
+    ZADB_DATA_TYPE k_table_size, k_key_size, field_size, val_size;
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    ZADB_DATA_NUM num;
+    int isStr;
+    long long count = 0;
+
+    replyReserve(REPLY_HEADER_ROOM);
+    size_t start = reply.size;
+    reply.size += REPLY_HEADER_ROOM;
+    zadbIter iterator;
+    int found = key_size > 0 && hashFirst(table, table_size, key, key_size, &iterator);
+    while (found) {
+        zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+        zadbKeyGet(zdbkey, &k_table, &k_table_size, &k_key, &k_key_size, &field, &field_size);
+        if (!isStringEqual(table, table_size, k_table, k_table_size) || !isStringEqual(key, key_size, k_key, k_key_size)) {
+            break;
+        }
+        if (!isVersionField(field_size)) {
+            zadbValGet(zdbval, &val, &val_size, &num, &isStr);
+            replyAppendBulk(field, field_size);
+            if (isStr) {
+                replyAppendBulk(val, val != NULL ? val_size : 0);
+            } else {
+                replyAppendInt(num);
+            }
+            count++;
+        }
+        found = zadbIterNext(rbtHandle, &iterator);
+        db_stat_get++;
+    }
+    char header[REPLY_HEADER_ROOM];
+    int header_size = sprintf(header, "*%lld\r\n", count * 2);
+    size_t body = start + REPLY_HEADER_ROOM;
+    memcpy(reply.buf + start, header, header_size);
+    memmove(reply.buf + start + header_size, reply.buf + body, reply.size - body);
+    reply.size -= REPLY_HEADER_ROOM - header_size;
+    return count;
+}
+
+/*
+ * Get version of hash
+ *
+ * input on lua stack:
+ * 1 - table string
+ * 2 - key string
+ *
+ * L: lua state or lua thread
+ *
+ * put version number to lua stack, 0 if hash does not exist
+ * return number variables in lua stack
+ */
+int databaseHVersion(lua_State *L) {
+    size_t o_table_size, o_key_size;
+    if (lua_gettop(L) != 2 || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    const char * o_table = luaToString(L, 1, &o_table_size);
+    const char * o_key = luaToString(L, 2, &o_key_size);
+    lua_pushinteger(L, hashVersion(o_table, o_table_size, o_key, o_key_size));
+    return 1;
+}
+
+/*
+ * Get keys of all events under object and its children
+ *
+ * input on lua stack:
+ * 1 - object key string
+ *
+ * L: lua state or lua thread
+ *
+ * put RESP string to lua stack, map of event keys
+ * return number variables in lua stack
+ */
+int databaseGetEventsAll(lua_State *L) {
+    size_t objkey_size, size;
+    if (lua_gettop(L) != 1 || !lua_isstring(L, 1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    const char *objkey = luaToString(L, 1, &objkey_size);
+    replyReset();
+    long long count = relCollectEvents(objkey, objkey_size);
+    char *out = replyFinishArray(count * 2, &size);
+    lua_pushlstring(L, out, size);
+    return 1;
+}
+
+
+/*
+ * Argument of request in socket buffer
+ */
+typedef struct respArg {
+    const char *str;
+    size_t size;
+} respArg;
+
+/*
+ * Request which reply can be cached. Set before lua thread is run,
+ * reply is stored to cache in processLuaResult.
+ */
+typedef struct cacheRequest {
+    int active;
+    respArg cmd;
+    respArg key;
+} cacheRequest;
+
+cacheRequest cacheReq = { 0 };
+
+#define SOCKET_LOOP_ERR 1
+#define SOCKET_LOOP_OK 0
+#define SOCKET_LOOP_MAX_CONNECTIONS 100
+#define SOCKET_LOOP_MASTER 0
+
+
+/*
+ * init socket and set options
+ *
+ * input port
+ *
+ * return socket
+ */
+int socketInit(int* outSocket, int port) {
+    if ((*outSocket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+        perror("socket failed");
+        return SOCKET_LOOP_ERR;
+    }
+
+    int opt = 1;
+    if (setsockopt(*outSocket, SOL_SOCKET, SO_REUSEADDR, (char *) &opt, sizeof(opt)) < 0) {
+        perror("setsockopt failed");
+        return SOCKET_LOOP_ERR;
+    }
+
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(*outSocket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror("bind failed");
+        return SOCKET_LOOP_ERR;
+    }
+    if (listen(*outSocket, SOCKET_LOOP_MAX_CONNECTIONS) < 0) {
+        perror("listen failed");
+        return SOCKET_LOOP_ERR;
+    }
+    printf("Listener on port %d \n", port);
+    printf("Waiting for connections ...\n");
+    return 0;
+}
+
+#define PROTOCOL_OK 0
+#define PROTOCOL_ERR 1
+#define PROTOCOL_EMPTY 2
+#define RESP_ARRAY '*'
+#define RESP_BULKSTRING '$'
+#define RESP_INTEGER ':'
+
+#define RESP_MAX_REQUEST (512 * 1024 * 1024)
+
+/*
+ * parse RESP number terminated by \r\n
+ *
+ * buf: start of number
+ * end: end of buffer string
+ * num: out number
+ * err: set to 1 on protocol error
+ *
+ * return position after number or NULL if data is not complete or wrong
+ */
+char *respNumber(char * buf, char * end, long long *num, int *err) {
+    long long n = 0;
+    int digits = 0;
+    while (buf < end && *buf != '\r') {
+        if (*buf < '0' || *buf > '9' || digits > 18) {
+            *err = 1;
+            return NULL;
+        }
+        n = (n * 10) + (*buf - '0');
+        buf++;
+        digits++;
+    }
+    if (buf + 1 >= end) {
+        return NULL;
+    }
+    if (buf[1] != '\n' || digits == 0) {
+        *err = 1;
+        return NULL;
+    }
+    *num = n;
+    return buf + 2;
+}
+
+/*
+ * skip one RESP element: bulk string, integer or array of them
+ *
+ * return position after element or NULL if data is not complete or wrong
+ */
+char *respSkipElement(char * buf, char * end, int depth, int *err) {
+    long long n;
+    if (buf >= end) {
+        return NULL;
+    }
+    char type = *buf++;
+    if (type != RESP_INTEGER && type != RESP_BULKSTRING && type != RESP_ARRAY) {
+        *err = 1;
+        return NULL;
+    }
+    buf = respNumber(buf, end, &n, err);
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (type == RESP_BULKSTRING) {
+        if (end - buf < n + 2) {
+            return NULL;
+        }
+        if (buf[n] != '\r' || buf[n + 1] != '\n') {
+            *err = 1;
+            return NULL;
+        }
+        return buf + n + 2;
+    }
+    if (type == RESP_ARRAY) {
+        if (depth > 1 || (depth == 0 && n < 1)) {
+            *err = 1;
+            return NULL;
+        }
+        for (long long i = 0; i < n && buf != NULL; i++) {
+            buf = respSkipElement(buf, end, depth + 1, err);
+        }
+    }
+    return buf;
+}
+
+/*
+ * Progress of scan of not complete request, so big batch request is not
+ * scanned from its start after every read. Offsets are from start of
+ * request, next is 0 before header of request is read.
+ */
+typedef struct respFrame {
+    size_t next;            // first element not scanned yet
+    long long left;         // elements of request left
+    long long record_left;  // elements of current record left
+} respFrame;
+
+/*
+ * Find size of first request in buffer going on from frame. Request is
+ * array of bulk strings, integers or arrays of them (records of batch
+ * commands).
+ *
+ * frame: progress of scan, it is cleared when request is complete or wrong
+ *
+ * return size of request, 0 if request is not complete, -1 on protocol error
+ */
+long long respRequestScan(char * buf, char * end, respFrame *frame) {
+    int err = 0;
+    long long n;
+    if (frame->next == 0) {
+        if (buf >= end) {
+            return 0;
+        }
+        if (*buf != RESP_ARRAY) {
+            return -1;
+        }
+        char *next = respNumber(buf + 1, end, &n, &err);
+        if (err || (next != NULL && n < 1)) {
+            return -1;
+        }
+        if (next == NULL) {
+            return 0;
+        }
+        frame->next = next - buf;
+        frame->left = n;
+        frame->record_left = 0;
+    }
+    while (frame->left > 0 || frame->record_left > 0) {
+        char *p = buf + frame->next;
+        char *next;
+        if (frame->record_left == 0 && p < end && *p == RESP_ARRAY) {
+            next = respNumber(p + 1, end, &n, &err);
+            if (next != NULL) {
+                frame->record_left = n;
+                frame->left--;
+            }
+        } else {
+            next = respSkipElement(p, end, frame->record_left > 0 ? 2 : 1, &err);
+            if (next != NULL && frame->record_left > 0) {
+                frame->record_left--;
+            } else if (next != NULL) {
+                frame->left--;
+            }
+        }
+        if (err) {
+            memset(frame, 0, sizeof(respFrame));
+            return -1;
+        }
+        if (next == NULL) {
+            return 0;
+        }
+        frame->next = next - buf;
+    }
+    n = frame->next;
+    memset(frame, 0, sizeof(respFrame));
+    return n;
+}
+
+/*
+ * Find size of first request in buffer
+ *
+ * return size of request, 0 if request is not complete, -1 on protocol error
+ */
+long long respRequestSize(char * buf, char * end) {
+    respFrame frame = { 0, 0, 0 };
+    return respRequestScan(buf, end, &frame);
+}
+
+/*
+ * push bulk string or integer to lua stack
+ *
+ * return position after element or NULL on protocol error
+ */
+char *respPushScalar(lua_State *L, char * buf, char * end) {
+    long long n;
+    int err = 0;
+    if (buf >= end) {
+        return NULL;
+    }
+    char type = *buf++;
+    buf = respNumber(buf, end, &n, &err);
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (type == RESP_INTEGER) {
+        lua_pushinteger(L, n);
+        return buf;
+    }
+    if (type != RESP_BULKSTRING || end - buf < n + 2) {
+        return NULL;
+    }
+    lua_pushlstring(L, buf, n);
+    return buf + n + 2;
+}
+
+/*
+ * decode Redis serialization protocol (RESP) string to lua objects and put on stack
+ *
+ * First element of array is command. Next elements are field-value pairs
+ * of table. Element can be array of field-value pairs too, such arrays are
+ * records of batch command and they are put to table as array part.
+ *
+ * L: lua state or lua thread
+ * buf: start of buffer string
+ * end: end of buffer string
+ *
+ * return status: *
+ * PROTOCOL_OK - 0
+ * PROTOCOL_ERR - 1
+ * PROTOCOL_EMPTY - 2
+ *
+ */
+int parseRespToLua(lua_State *L, char * buf, char * end) {
+    int luatop = lua_gettop(L);
+    long long resp_array_size = 0;
+    int err = 0;
+    if (buf >= end) {
+        return PROTOCOL_EMPTY;
+    }
+    if (*buf != RESP_ARRAY) {
+        return PROTOCOL_ERR;
+    }
+    buf = respNumber(buf + 1, end, &resp_array_size, &err);
+    if (buf == NULL || resp_array_size < 1) {
+        return PROTOCOL_ERR;
+    }
+    buf = respPushScalar(L, buf, end);
+    if (buf == NULL) {
+        lua_settop(L, luatop);
+        return PROTOCOL_ERR;
+    }
+    lua_createtable(L, 0, resp_array_size / 2);
+    long long fields = 0;
+    lua_Integer records = 0;
+    for (long long i = 1; i < resp_array_size; i++) {
+        if (buf < end && *buf == RESP_ARRAY) {
+            long long record_size = 0;
+            buf = respNumber(buf + 1, end, &record_size, &err);
+            if (buf == NULL || fields % 2) {
+                lua_settop(L, luatop);
+                return PROTOCOL_ERR;
+            }
+            lua_createtable(L, 0, record_size / 2);
+            for (long long j = 0; j < record_size; j++) {
+                buf = respPushScalar(L, buf, end);
+                if (buf == NULL) {
+                    lua_settop(L, luatop);
+                    return PROTOCOL_ERR;
+                }
+                if (j % 2) {
+                    lua_rawset(L, -3);
+                }
+            }
+            if (record_size % 2) {
+                lua_pushlstring(L, "", 0);
+                lua_rawset(L, -3);
+            }
+            lua_rawseti(L, -2, ++records);
+            continue;
+        }
+        buf = respPushScalar(L, buf, end);
+        if (buf == NULL) {
+            lua_settop(L, luatop);
+            return PROTOCOL_ERR;
+        }
+        fields++;
+        if (!(fields % 2)) {
+            lua_rawset(L, -3);
+        }
+    }
+    if (fields % 2) {
+        lua_pushlstring(L, "", 0);
+        lua_rawset(L, -3);
+    }
+    return PROTOCOL_OK;
+}
+
+
+/*
+ * Start reading RESP array of strings without lua
+ *
+ * buf: start of buffer string
+ * end: end of buffer string
+ * count: out number of arguments
+ *
+ * return position of first argument or NULL if request is not array
+ */
+char *respArgsBegin(char * buf, char * end, long long *count) {
+    int err = 0;
+    if (buf >= end || *buf != RESP_ARRAY) {
+        return NULL;
+    }
+    buf = respNumber(buf + 1, end, count, &err);
+    if (buf == NULL || *count < 1) {
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Read next argument, it points to buffer
+ *
+ * return position after argument or NULL if argument is not string or integer
+ */
+char *respNextArg(char * buf, char * end, respArg *arg) {
+    long long size;
+    int err = 0;
+    if (buf >= end) {
+        return NULL;
+    }
+    char type = *buf++;
+    char *str = buf;
+    buf = respNumber(buf, end, &size, &err);
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (type == RESP_INTEGER) {
+        arg->str = str;
+        arg->size = buf - 2 - str;
+        return buf;
+    }
+    if (type != RESP_BULKSTRING || end - buf < size + 2) {
+        return NULL;
+    }
+    arg->str = buf;
+    arg->size = size;
+    return buf + size + 2;
+}
+
+/*
+ * decode Redis serialization protocol (RESP) array of strings without lua
+ *
+ * buf: start of buffer string
+ * end: end of buffer string
+ * args: out array of arguments, point to buffer
+ * max_args: size of args
+ *
+ * return number of arguments or -1 if request is not array of
+ * at most max_args strings
+ */
+int parseRespArgs(char * buf, char * end, respArg *args, int max_args) {
+    long long count;
+    buf = respArgsBegin(buf, end, &count);
+    if (buf == NULL || count > max_args) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        buf = respNextArg(buf, end, &args[i]);
+        if (buf == NULL) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+int isArg(respArg *arg, const char *str) {
+    return isStringEqual(arg->str, arg->size, str, strlen(str));
+}
+
+void replyAppendField(const char *name, long long num) {
+    replyAppendBulk(name, strlen(name));
+    replyAppendInt(num);
+}
+
+/*
+ * Commands with own latency stats, other commands are counted as OTHER
+ */
+const char *statCommandName[] = {
+    "ADDOBJECT", "ADDOBJECTS", "DELOLDOBJECT", "DELOLDSTATUS", "ADDREL", "ADDRELS",
+    "GETOBJECT", "GETCHILD", "ADDEVENT", "ADDEVENTS", "DELEVENT", "GETEVENT",
+    "GETEVENTSALL", "ADDFILTER", "ADDINDEX", "PRINTALL", "MGETOBJECT", "MGETEVENT",
+    "SCAN", "IQUERY", "SNAPSHOT", "SNAPSHOTSTATUS", "IMAGEMERGE", "REPLSYNC",
+    "REPLACK", "REPLSTATUS", "LOGREWRITE", "LOGSTATS", "CACHESTATS", "LUASTATS",
+    "SCHEDSTATS", "STATS", "SLOWLOG", "PROFILE", "MEMORY", "OTHER"
+};
+
+#define STAT_COMMANDS ((int) (sizeof(statCommandName) / sizeof(statCommandName[0])))
+
+/*
+ * Latency of command from start of parse to end of send in nanoseconds.
+ * Lua commands also sum time of parse, lua and send.
+ */
+typedef struct commandStats {
+    zadbHist latency;
+    long long parse_ns;
+    long long lua_ns;
+    long long send_ns;
+} commandStats;
+
+commandStats commandStat[STAT_COMMANDS];
+
+/*
+ * Request which latency is recorded, statReq is set before lua thread is
+ * run like cacheReq. Request stays in buffer of connection until it is
+ * recorded. cmd is -1 for internal events.
+ */
+typedef struct statRequest {
+    int cmd;
+    long long start;
+    long long parse_ns;
+    long long ops;           // tree operations
+    long long instructions;  // lua instructions, counted by hook steps
+    char *buf;
+    char *end;
+    const char *host;
+    int port;
+} statRequest;
+
+statRequest statReq = { -1 };
+
+/*
+ * Commands slower than slowlogThresholdUs are kept in ring buffer,
+ * oldest entry is overwritten. Negative threshold disables it.
+ */
+#define SLOWLOG_DEFAULT_LEN 128
+#define SLOWLOG_DEFAULT_US 10000
+#define SLOWLOG_KEY_MAX 64
+
+typedef struct slowlogEntry {
+    long long id;
+    long long time;         // unix time in seconds
+    long long duration_us;
+    long long ops;
+    long long instructions;
+    int cmd;
+    int key_size;
+    char key[SLOWLOG_KEY_MAX];
+    char host[INET_ADDRSTRLEN];
+    int port;
+} slowlogEntry;
+
+slowlogEntry *slowlog = NULL;
+int slowlogLen = SLOWLOG_DEFAULT_LEN;
+long long slowlogThresholdUs = SLOWLOG_DEFAULT_US;
+long long slowlogNextId = 0;
+long long slowlogCount = 0;
+
+/*
+ * Tree operations done by main thread so far
+ */
+long long statOps() {
+    return db_stat_get + db_stat_set + db_stat_upd + db_stat_del;
+}
+
+void slowlogAdd(statRequest *req, long long duration_us) {
+    if (slowlog == NULL && (slowlog = calloc(slowlogLen, sizeof(slowlogEntry))) == NULL) {
+        return;
+    }
+    slowlogEntry *entry = &slowlog[slowlogNextId % slowlogLen];
+    entry->id = slowlogNextId++;
+    entry->time = time(NULL);
+    entry->duration_us = duration_us;
+    entry->ops = req->ops;
+    entry->instructions = req->instructions;
+    entry->cmd = req->cmd;
+    entry->key_size = 0;
+    respArg field, value;
+    long long count;
+    char *next = respArgsBegin(req->buf, req->end, &count);
+    if (next != NULL && (next = respNextArg(next, req->end, &field)) != NULL) {
+        while ((next = respNextArg(next, req->end, &field)) != NULL
+                && (next = respNextArg(next, req->end, &value)) != NULL) {
+            if (isArg(&field, "key")) {
+                entry->key_size = value.size < SLOWLOG_KEY_MAX ? value.size : SLOWLOG_KEY_MAX;
+                memcpy(entry->key, value.str, entry->key_size);
+                break;
+            }
+        }
+    }
+    snprintf(entry->host, sizeof(entry->host), "%s", req->host != NULL ? req->host : "");
+    entry->port = req->port;
+    if (slowlogCount < slowlogLen) {
+        slowlogCount++;
+    }
+}
+
+/*
+ * Record latency of finished request to its command stats and slowlog
+ *
+ * lua_ns: time in lua
+ * send_ns: time of send of lua result
+ */
+void statFinish(statRequest *req, long long lua_ns, long long send_ns) {
+    commandStats *stat = &commandStat[req->cmd];
+    long long latency = clockNanos() - req->start;
+    zadbHistRecord(&stat->latency, latency);
+    stat->parse_ns += req->parse_ns;
+    stat->lua_ns += lua_ns;
+    stat->send_ns += send_ns;
+    if (slowlogThresholdUs >= 0 && latency >= slowlogThresholdUs * 1000) {
+        slowlogAdd(req, latency / 1000);
+    }
+}
+
+/*
+ * get from lua stack string and send with socket
+ *
+ * L: lua state or lua thread
+ *
+ * socket: socket
+ *
+ * cache: request which reply is stored to cache, NULL if reply is not cached
+ *
+ */
+int processLuaResult(lua_State *L, int socket, cacheRequest *cache) {
+    if (lua_gettop(L) != 1) {
+        return 0;
+    }
+    if (lua_isstring(L, 1)) {
+        size_t str_size;
+        char *str = (char *) lua_tolstring(L, 1, &str_size);
+        if (cache != NULL && cache->active && str != NULL && str_size > 0 && *str == '*') {
+            zadbCachePut(cache->cmd.str, cache->cmd.size, cache->key.str, cache->key.size, str, str_size);
+        }
+        if (str != NULL && str_size > 0) {
+            return send(socket, str, str_size, MSG_NOSIGNAL);
+        }
+        return 0;
+    }
+    printf("Lua script returns wrong data\n");
+    return 0;
+}
+
+/*
+ * Lua request runs in own coroutine. Coroutine is suspended when it runs
+ * more than luaBudget instructions and it is resumed from run queue after
+ * other connections got their turn. Coroutines are reused for next
+ * requests, lua thread is anchored in registry by ref.
+ *
+ * Read request commits log and ends write section of epoch after every
+ * slice. Write request keeps its write section and log batch open while
+ * it is suspended, they are ended when it finishes, so reader threads,
+ * log and replicas never see it half done. Only one write is suspended at
+ * a time: until it finishes, main loop runs read requests only.
+ */
+typedef struct luaTask {
+    lua_State *L;
+    int ref;
+    int socket;        // negative if result is dropped
+    int slot;          // connection in main loop, -1 if not preemptable
+    int write;         // request can change data
+    int slices;        // number of resumes of request
+    long long budget;  // instructions left in slice
+    int hook_step;     // instructions between calls of hook
+    cacheRequest cache;
+    statRequest stat;
+    struct luaTask *next;
+} luaTask;
+
+/*
+ * Counters of lua scheduling, requests that needed more slices wait in
+ * run queue behind the others
+ */
+typedef struct luaStats {
+    long long requests;
+    long long preempted;
+    long long slices;
+    long long max_slices;
+    long long queued;
+} luaStats;
+
+#define LUA_DEFAULT_BUDGET 1000000
+#define LUA_HOOK_STEP 1000
+
+int luaBudget = LUA_DEFAULT_BUDGET;
+int luaDispatchRef = LUA_NOREF;
+luaTask *luaTaskPool = NULL;
+luaTask *luaTaskCurrent = NULL;
+luaTask *luaTaskRunning = NULL;
+luaTask *luaRunQueue = NULL;
+luaTask *luaRunQueueTail = NULL;
+luaTask *luaWriter = NULL;       // suspended write request
+luaStats luaStat = { 0 };
+
+// commands which don't change data, they run while write is suspended
+const char *readCommands[] = { "GETOBJECT", "GETCHILD", "GETEVENT", "GETEVENTSALL", "MGETOBJECT", "MGETEVENT",
+    "SCAN", "IQUERY", "DELOLDSTATUS", "SNAPSHOTSTATUS", "REPLACK", "REPLSTATUS", "LOGSTATS", "CACHESTATS",
+    "LUASTATS", "SCHEDSTATS", "STATS", "SLOWLOG", "PROFILE", "MEMORY", NULL };
+
+/*
+ * Request does not change data
+ *
+ * buf: start of request
+ * end: end of request
+ */
+int requestReadOnly(char *buf, char *end) {
+    respArg cmd;
+    long long count;
+    char *next = respArgsBegin(buf, end, &count);
+    if (next == NULL || respNextArg(next, end, &cmd) == NULL) {
+        return 0;
+    }
+    for (const char **name = readCommands; *name != NULL; name++) {
+        if (isArg(&cmd, *name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Prepare coroutine for next request, function of main.lua is on its stack.
+ * Arguments of request are pushed to returned thread after it.
+ *
+ * return lua thread of request
+ */
+lua_State *luaTaskBegin() {
+    luaTask *task = luaTaskCurrent;
+    if (task == NULL) {
+        task = luaTaskPool;
+        if (task != NULL) {
+            luaTaskPool = task->next;
+        } else {
+            task = calloc(1, sizeof(luaTask));
+            if (task == NULL) {
+                perror("lua task alloc failed");
+                exit(1);
+            }
+            task->L = lua_newthread(luaState);
+            task->ref = luaL_ref(luaState, LUA_REGISTRYINDEX);
+        }
+        luaTaskCurrent = task;
+    }
+    lua_settop(task->L, 0);
+    lua_rawgeti(task->L, LUA_REGISTRYINDEX, luaDispatchRef);
+    return task->L;
+}
+
+/*
+ * Lua profiler. While it runs, count hook takes sample of lua stack every
+ * profilePeriod instructions and za_db functions are wrapped to count
+ * their calls by table.
+ */
+#define PROFILE_DEFAULT_PERIOD 10000
+#define PROFILE_MAX_FRAMES 64
+#define PROFILE_FRAME_MAX 128
+
+long long profilePeriod = PROFILE_DEFAULT_PERIOD;
+long long profileCountdown = 0;
+
+/*
+ * Take sample of lua stack as folded stack: frames from root as
+ * name@file:line of function, last frame is line of running code.
+ * Sample is weighted by instructions since previous sample.
+ */
+void profileSample(lua_State *L, int instructions) {
+    profileCountdown -= instructions;
+    if (profileCountdown > 0) {
+        return;
+    }
+    long long weight = profilePeriod - profileCountdown;
+    profileCountdown = profilePeriod;
+    char frames[PROFILE_MAX_FRAMES][PROFILE_FRAME_MAX];
+    int sizes[PROFILE_MAX_FRAMES];
+    char stack[(PROFILE_MAX_FRAMES + 1) * PROFILE_FRAME_MAX];
+    char line[PROFILE_FRAME_MAX];
+    int line_size = 0;
+    int depth = 0;
+    lua_Debug ar;
+    while (depth < PROFILE_MAX_FRAMES && lua_getstack(L, depth, &ar)) {
+        lua_getinfo(L, "Snl", &ar);
+        int size = snprintf(frames[depth], PROFILE_FRAME_MAX, "%s@%s:%d", ar.name != NULL ? ar.name : "?", ar.short_src, ar.linedefined);
+        sizes[depth] = size < PROFILE_FRAME_MAX ? size : PROFILE_FRAME_MAX - 1;
+        if (depth == 0) {
+            line_size = snprintf(line, sizeof(line), "%s:%d", ar.short_src, ar.currentline);
+            if (line_size >= PROFILE_FRAME_MAX) {
+                line_size = PROFILE_FRAME_MAX - 1;
+            }
+        }
+        depth++;
+    }
+    if (depth == 0) {
+        return;
+    }
+    size_t size = 0;
+    for (int i = depth - 1; i >= 0; i--) {
+        memcpy(stack + size, frames[i], sizes[i]);
+        size += sizes[i];
+        stack[size++] = ';';
+    }
+    memcpy(stack + size, line, line_size);
+    size += line_size;
+    zadbProfSample(stack, size, weight);
+}
+
+/*
+ * Wrapper of za_db function while profiler runs
+ *
+ * upvalues: 1 - function, 2 - its name
+ */
+int profileCall(lua_State *L) {
+    lua_CFunction fn = lua_tocfunction(L, lua_upvalueindex(1));
+    size_t name_size, table_size = 0;
+    const char *name = lua_tolstring(L, lua_upvalueindex(2), &name_size);
+    const char *table = "";
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        table = lua_tolstring(L, 1, &table_size);
+    }
+    char label[PROFILE_FRAME_MAX];
+    int size = snprintf(label, sizeof(label), "%.*s %.*s", (int) name_size, name, (int) table_size, table);
+    if (size >= PROFILE_FRAME_MAX) {
+        size = PROFILE_FRAME_MAX - 1;
+    }
+    long long start = clockNanos();
+    int n = fn(L);
+    zadbProfCall(label, size, clockNanos() - start);
+    return n;
+}
+
+/*
+ * Wrap functions of za_db by profileCall or put back the original ones
+ */
+void profileWrap(int on) {
+    lua_getglobal(luaState, "za_db");
+    lua_pushnil(luaState);
+    while (lua_next(luaState, -2) != 0) {
+        lua_CFunction fn = lua_tocfunction(luaState, -1);
+        if (fn == NULL || (fn == profileCall) == on) {
+            lua_pop(luaState, 1);
+            continue;
+        }
+        if (on) {
+            lua_pushvalue(luaState, -2);
+            lua_pushcclosure(luaState, profileCall, 2);
+        } else {
+            lua_getupvalue(luaState, -1, 1);
+            lua_remove(luaState, -2);
+        }
+        lua_pushvalue(luaState, -2);
+        lua_insert(luaState, -2);
+        lua_rawset(luaState, -4);
+    }
+    lua_pop(luaState, 1);
+}
+
+void profileDumpStack(const char *key, size_t size, long long count, long long ns, void *ctx) {
+    (void) ns;
+    (void) ctx;
+    replyAppend(key, size);
+    replyReserve(24);
+    reply.size += sprintf(reply.buf + reply.size, " %lld\n", count);
+}
+
+void profileDumpCall(const char *key, size_t size, long long count, long long ns, void *ctx) {
+    (*(long long *) ctx)++;
+    replyAppend("*3\r\n", 4);
+    replyAppendBulk(key, size);
+    replyAppendInt(count);
+    replyAppendInt(ns);
+}
+
+/*
+ * Lua garbage collector is stopped, it runs only in explicit steps. Main
+ * loop steps it before it sleeps in poll, so most of collection is done
+ * while no request waits. When heap grows faster, debt of collector is
+ * paid in requests by count hook and after every slice, so long write
+ * slices are collected too. All steps are counted in gc_pause_max_us.
+ */
+#define LUA_GC_STEP_KB 64
+#define LUA_GC_IDLE_US 1000
+#define LUA_GC_IDLE_MIN_KB 256
+#define LUA_GC_PAUSE 200          // percent of heap to start cycle in request
+#define LUA_GC_MINOR 20           // percent of heap for minor collection
+
+int luaGcGenerational = 0;
+int luaGcHeapKb = 0;      // heap after last finished cycle
+long long luaGcIdleUs = 0;
+long long luaGcRequestUs = 0;
+long long luaGcPauseMaxUs = 0;
+int luaGcSliceHeap = 0;   // heap when debt of running slice was paid
+
+/*
+ * Set mode of lua collector given by -lua-gc
+ */
+void luaGcInit() {
+    if (luaGcGenerational) {
+        lua_gc(luaState, LUA_GCGEN, 0, 0);
+    } else {
+        lua_gc(luaState, LUA_GCINC, 0, 0, 0);
+    }
+    lua_gc(luaState, LUA_GCSTOP, 0);
+}
+
+/*
+ * One step of lua collector doing work of kb allocated kilobytes.
+ *
+ * return 1 if cycle is finished
+ */
+int luaGcStep(int kb) {
+    long long start = clockMicros();
+    int done = lua_gc(luaState, LUA_GCSTEP, kb);
+    long long pause = clockMicros() - start;
+    if (pause > luaGcPauseMaxUs) {
+        luaGcPauseMaxUs = pause;
+    }
+    // generational step is whole minor collection
+    if (done || luaGcGenerational) {
+        luaGcHeapKb = lua_gc(luaState, LUA_GCCOUNT, 0);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Do steps of lua collector in idle time of main loop, at most budget
+ * microseconds. Nothing is done until heap grows after finished cycle.
+ *
+ * return time spent in microseconds
+ */
+long long luaGcIdle(long long budget) {
+    int heap = lua_gc(luaState, LUA_GCCOUNT, 0);
+    if (heap < luaGcHeapKb + LUA_GC_IDLE_MIN_KB) {
+        return 0;
+    }
+    long long start = clockMicros();
+    long long now = start;
+    while (now - start < budget) {
+        int done = luaGcStep(LUA_GC_STEP_KB);
+        now = clockMicros();
+        if (done) {
+            break;
+        }
+    }
+    luaGcIdleUs += now - start;
+    return now - start;
+}
+
+/*
+ * Step collector in slice of request when idle steps did not keep up.
+ * Step does work of heap allocated since debt was paid last time, as
+ * automatic collector would have done.
+ */
+void luaGcSlice() {
+    int heap = lua_gc(luaState, LUA_GCCOUNT, 0);
+    int percent = luaGcGenerational ? LUA_GC_MINOR : LUA_GC_PAUSE - 100;
+    if (heap < luaGcHeapKb + LUA_GC_IDLE_MIN_KB || heap - luaGcHeapKb < (long long) luaGcHeapKb * percent / 100) {
+        return;
+    }
+    long long start = clockMicros();
+    luaGcStep(heap - luaGcSliceHeap > LUA_GC_STEP_KB ? heap - luaGcSliceHeap : LUA_GC_STEP_KB);
+    luaGcRequestUs += clockMicros() - start;
+    luaGcSliceHeap = lua_gc(luaState, LUA_GCCOUNT, 0);
+}
+
+/*
+ * Count hook, it counts instructions of request, steps collector and
+ * yields when budget of slice is used. C functions of za_db are not
+ * interrupted, hook runs only between lua instructions.
+ */
+void luaBudgetHook(lua_State *L, lua_Debug *ar) {
+    (void) ar;
+    luaTask *task = luaTaskRunning;
+    task->stat.instructions += task->hook_step;
+    task->budget -= task->hook_step;
+    if (zadbProfActive()) {
+        profileSample(L, task->hook_step);
+    }
+    luaGcSlice();
+    if (task->budget <= 0 && lua_isyieldable(L)) {
+        lua_yield(L, 0);
+    }
+}
+
+/*
+ * Resume coroutine of request for one slice. Finished request sends its
+ * reply, reply is cached only if request was not interleaved with others.
+ *
+ * return 1 if request is preempted and put to run queue
+ */
+int luaTaskResume(luaTask *task, int nargs) {
+    int nres = 0;
+    task->slices++;
+    luaStat.slices++;
+    task->hook_step = LUA_HOOK_STEP;
+    task->budget = LLONG_MAX;
+    if (task->slot >= 0 && luaBudget > 0) {
+        task->budget = luaBudget;
+        if (luaBudget < LUA_HOOK_STEP) {
+            task->hook_step = luaBudget;
+        }
+    }
+    lua_sethook(task->L, luaBudgetHook, LUA_MASKCOUNT, task->hook_step);
+    long long ops = statOps();
+    luaTaskRunning = task;
+    luaGcSliceHeap = lua_gc(luaState, LUA_GCCOUNT, 0);
+    if (luaWriter != task) {
+        zadbEpochWriteBegin();
+    }
+    int rc = lua_resume(task->L, NULL, nargs, &nres);
+    if (task->write && rc == LUA_YIELD) {
+        luaWriter = task;
+    } else {
+        if (luaWriter == task) {
+            luaWriter = NULL;
+        }
+        // log batch of suspended write is committed when it finishes
+        if (luaWriter == NULL) {
+            zadbLogCommit();
+        }
+        zadbEpochWriteEnd();
+    }
+    luaTaskRunning = NULL;
+    luaGcSlice();
+    task->stat.ops += statOps() - ops;
+    switch (rc) {
+    case LUA_YIELD:
+        if (task->slices == 1) {
+            luaStat.preempted++;
+        }
+        lua_settop(task->L, 0);
+        task->next = NULL;
+        if (luaRunQueueTail != NULL) {
+            luaRunQueueTail->next = task;
+        } else {
+            luaRunQueue = task;
+        }
+        luaRunQueueTail = task;
+        luaStat.queued++;
+        return 1;
+    case LUA_OK:
+        if (nres == 0) {
+            printf("--- coroutine finished normally ---\n");
+            exit(1);
+        }
+        if (task->slices > luaStat.max_slices) {
+            luaStat.max_slices = task->slices;
+        }
+        long long sent = clockNanos();
+        if (task->socket >= 0) {
+            processLuaResult(task->L, task->socket, task->slices == 1 ? &task->cache : NULL);
+        }
+        if (task->stat.cmd >= 0) {
+            statFinish(&task->stat, sent - task->stat.start - task->stat.parse_ns, clockNanos() - sent);
+        }
+        lua_settop(task->L, 0);
+        task->next = luaTaskPool;
+        luaTaskPool = task;
+        return 0;
+    default:
+        printf("!!! coroutine finished for error !!!\n");
+        luaPrintLuaStack(task->L);
+        exit(1);
+    }
+    return 0;
+}
+
+/*
+ * run lua request prepared by luaTaskBegin
+ *
+ * socket: socket, if negative then result is dropped
+ *
+ * slot: connection of request, -1 runs request to the end
+ *
+ * write: request can change data
+ *
+ * return 1 if request is preempted, it goes on in luaTasksRun
+ */
+int processRequest(int socket, int slot, int write) {
+    luaTask *task = luaTaskCurrent;
+    luaTaskCurrent = NULL;
+    task->socket = socket;
+    task->slot = slot;
+    task->write = write;
+    task->slices = 0;
+    task->cache = cacheReq;
+    cacheReq.active = 0;
+    task->stat = statReq;
+    statReq.cmd = -1;
+    luaStat.requests++;
+    return luaTaskResume(task, 2);
+}
+
+#define NATIVE_MAX_ARGS 16
+
+/*
+ * Reply to MGETOBJECT and MGETEVENT: array of hashes in order of keys,
+ * empty array for missing key. Reply is streamed to socket by chunks.
+ *
+ * socket: negative to keep whole reply in buffer
+ * buf: position of first key
+ * count: number of keys
+ *
+ * return start of not sent reply in buffer
+ */
+size_t nativeMGet(int socket, const char *table, char * buf, char * end, long long count) {
+    respArg key;
+    size_t size;
+    size_t table_size = strlen(table);
+    replyReset();
+    char *out = replyFinishArray(count, &size);
+    size_t from = out - reply.buf;
+    for (long long i = 0; i < count; i++) {
+        key.size = 0;
+        if (buf != NULL) {
+            buf = respNextArg(buf, end, &key);
+        }
+        replyAppendHash(table, table_size, key.str, key.size);
+        if (socket >= 0 && reply.size > REPLY_STREAM_CHUNK) {
+            replyFlush(socket, from);
+            from = 0;
+        }
+    }
+    if (socket >= 0) {
+        replyFlush(socket, from);
+    }
+    return from;
+}
+
+/*
+ * Value of index query argument: number if argument is integer,
+ * string otherwise
+ */
+void indexQueryValue(respArg *arg, zadbIndexBound *bound) {
+    size_t i = 0;
+    ZADB_DATA_NUM num = 0;
+    int negative = arg->size > 1 && arg->str[0] == '-';
+    bound->open = 0;
+    bound->exclusive = 0;
+    bound->type = ZADB_INDEX_STR;
+    bound->str = arg->str;
+    bound->str_size = arg->size;
+    for (i = negative; i < arg->size && i < 19; i++) {
+        if (arg->str[i] < '0' || arg->str[i] > '9') {
+            return;
+        }
+        num = (num * 10) + (arg->str[i] - '0');
+    }
+    if (i == 0 || i < arg->size) {
+        return;
+    }
+    bound->type = ZADB_INDEX_NUM;
+    bound->num = negative ? -num : num;
+}
+
+void indexQueryReply(void *ctx, const char *key, size_t key_size, int type, ZADB_DATA_NUM num, const char *str, size_t str_size) {
+    replyAppendBulk(key, key_size);
+    if (type == ZADB_INDEX_NUM) {
+        replyAppendInt(num);
+    } else {
+        replyAppendBulk(str, str_size);
+    }
+}
+
+/*
+ * Query of secondary index:
+ *
+ * IQUERY table <table> field <field> op <op> value <value> [value2 <value>] [limit <n>]
+ *
+ * op: eq, gt, ge, lt, le, range (value <= x <= value2), top (biggest
+ * values first, numbers or strings by type of optional value)
+ *
+ * Reply is array of hash key - field value pairs in order of index.
+ */
+void nativeIndexQuery(int socket, respArg *args, int argc) {
+    respArg *table = NULL, *field = NULL, *op = NULL, *value = NULL, *value2 = NULL;
+    long long limit = 0;
+    size_t size;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (isArg(&args[i], "table")) {
+            table = &args[i + 1];
+        } else if (isArg(&args[i], "field")) {
+            field = &args[i + 1];
+        } else if (isArg(&args[i], "op")) {
+            op = &args[i + 1];
+        } else if (isArg(&args[i], "value")) {
+            value = &args[i + 1];
+        } else if (isArg(&args[i], "value2")) {
+            value2 = &args[i + 1];
+        } else if (isArg(&args[i], "limit")) {
+            limit = strtoll(args[i + 1].str, NULL, 10);
+        }
+    }
+    zadbIndex idx = NULL;
+    if (table != NULL && field != NULL) {
+        idx = zadbIndexFind(table->str, table->size, field->str, field->size);
+    }
+    if (idx == NULL || op == NULL || (value == NULL && !isArg(op, "top")) || limit < 0) {
+        send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+        return;
+    }
+    zadbIndexBound from, to;
+    int reverse = 0;
+    if (value != NULL) {
+        indexQueryValue(value, &from);
+        to = from;
+    } else {
+        memset(&from, 0, sizeof(from));
+        from.type = ZADB_INDEX_NUM;
+        to = from;
+    }
+    if (isArg(op, "gt") || isArg(op, "ge")) {
+        from.exclusive = isArg(op, "gt");
+        to.open = 1;
+    } else if (isArg(op, "lt") || isArg(op, "le")) {
+        to.exclusive = isArg(op, "lt");
+        from.open = 1;
+    } else if (isArg(op, "range") && value2 != NULL) {
+        indexQueryValue(value2, &to);
+    } else if (isArg(op, "top")) {
+        from.open = 1;
+        to.open = 1;
+        reverse = 1;
+    } else if (!isArg(op, "eq")) {
+        send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+        return;
+    }
+    replyReset();
+    long long count = zadbIndexQuery(idx, &from, &to, reverse, limit, indexQueryReply, NULL);
+    char *out = replyFinishArray(count * 2, &size);
+    send(socket, out, size, MSG_NOSIGNAL);
+}
+
+#define SCAN_DEFAULT_COUNT 10
+#define SCAN_MAX_COUNT 1000
+#define SCAN_SEEK_FACTOR 16
+
+/*
+ * Key where scan continues, cursor of SCAN is this key in hex
+ */
+unsigned char scanKey[ZADB_DATA_MAXSIZE + 1];
+
+/*
+ * Change key to next possible key in tree order. Keys are compared
+ * by length first, so after last key of some length goes first key
+ * of next length.
+ *
+ * return 0 if there is no next key
+ */
+int scanKeyNext(size_t *key_size) {
+    for (size_t i = *key_size; i > 0; i--) {
+        if (scanKey[i - 1] != 0xFF) {
+            scanKey[i - 1]++;
+            return 1;
+        }
+        scanKey[i - 1] = 0;
+    }
+    if (*key_size >= ZADB_DATA_MAXSIZE) {
+        return 0;
+    }
+    scanKey[(*key_size)++] = 0;
+    return 1;
+}
+
+/*
+ * Set scan key to first key with prefix and given length
+ */
+void scanKeyPrefix(const char *prefix, size_t prefix_size, size_t key_size) {
+    memcpy(scanKey, prefix, prefix_size);
+    memset(scanKey + prefix_size, 0, key_size - prefix_size);
+}
+
+/*
+ * Decode cursor to scan key, "0" is start of scan
+ *
+ * return 0 if cursor is wrong
+ */
+int scanKeyFromCursor(respArg *cursor, const char *prefix, size_t prefix_size, size_t *key_size) {
+    if (cursor == NULL || isArg(cursor, "0")) {
+        scanKeyPrefix(prefix, prefix_size, prefix_size);
+        *key_size = prefix_size;
+        return 1;
+    }
+    if (cursor->size % 2 || cursor->size / 2 > ZADB_DATA_MAXSIZE || cursor->size == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < cursor->size; i++) {
+        char c = cursor->str[i];
+        int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (digit < 0) {
+            return 0;
+        }
+        if (i % 2) {
+            scanKey[i / 2] |= digit;
+        } else {
+            scanKey[i / 2] = digit << 4;
+        }
+    }
+    *key_size = cursor->size / 2;
+    return 1;
+}
+
+/*
+ * Page of keys of table:
+ *
+ * SCAN table <table> [prefix <prefix>] [count <n>] [cursor <cursor>]
+ *
+ * Keys of one length are sorted, so keys with prefix are one range in
+ * every length. Scan seeks from key to next possible key and jumps
+ * over keys without prefix, number of seeks per call is limited too.
+ * Reply is array of next cursor and array of keys, cursor "0" means
+ * end of scan. Page can be empty before end of scan.
+ */
+void nativeScan(int socket, respArg *args, int argc) {
+    respArg *table = NULL, *cursor = NULL;
+    respArg prefix = { "", 0 };
+    long long count = SCAN_DEFAULT_COUNT;
+    char *k_table, *k_key, *k_field;
+    ZADB_DATA_TYPE k_table_size, k_key_size, k_field_size;
+    zadbDataKey from, zdbkey;
+    zadbDataVal zdbval;
+    size_t key_size, size;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (isArg(&args[i], "table")) {
+            table = &args[i + 1];
+        } else if (isArg(&args[i], "prefix")) {
+            prefix = args[i + 1];
+        } else if (isArg(&args[i], "count")) {
+            count = strtoll(args[i + 1].str, NULL, 10);
+        } else if (isArg(&args[i], "cursor")) {
+            cursor = &args[i + 1];
+        }
+    }
+    if (table == NULL || table->size == 0 || prefix.size > ZADB_DATA_MAXSIZE || count < 1
+            || !scanKeyFromCursor(cursor, prefix.str, prefix.size, &key_size)) {
+        send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+        return;
+    }
+    if (count > SCAN_MAX_COUNT) {
+        count = SCAN_MAX_COUNT;
+    }
+    if (key_size < prefix.size) {
+        scanKeyPrefix(prefix.str, prefix.size, prefix.size);
+        key_size = prefix.size;
+    }
+
+    replyReset();
+    long long found = 0;
+    long long seeks = count * SCAN_SEEK_FACTOR;
+    int done = 0;
+    while (found < count && seeks-- > 0) {
+        zadbIter iterator;
+        from = zadbKeyNew(table->str, table->size, (char *) scanKey, key_size, NULL, 0, 1);
+        int found = zadbIterScan(rbtHandle, &iterator, from);
+        zadbKeyFree(from);
+        if (found) {
+            zadbIterKeyValue(rbtHandle, &iterator, &zdbkey, &zdbval);
+            zadbKeyGet(zdbkey, &k_table, &k_table_size, &k_key, &k_key_size, &k_field, &k_field_size);
+        }
+        if (!found || !isStringEqual(table->str, table->size, k_table, k_table_size)) {
+            done = 1;
+            break;
+        }
+        int rc = memcmp(k_key, prefix.str, prefix.size);
+        if (rc == 0) {
+            replyAppendBulk(k_key, k_key_size);
+            found++;
+            memcpy(scanKey, k_key, k_key_size);
+            key_size = k_key_size;
+        } else if (rc < 0) {
+            scanKeyPrefix(prefix.str, prefix.size, k_key_size);
+            key_size = k_key_size;
+            continue;
+        } else {
+            // no more keys with prefix in this length, go to next length
+            if (k_key_size >= ZADB_DATA_MAXSIZE) {
+                done = 1;
+                break;
+            }
+            scanKeyPrefix(prefix.str, prefix.size, k_key_size + 1);
+            key_size = k_key_size + 1;
+            continue;
+        }
+        if (!scanKeyNext(&key_size)) {
+            done = 1;
+            break;
+        }
+        db_stat_get++;
+    }
+
+    char header[REPLY_HEADER_ROOM];
+    int header_size;
+    if (done) {
+        header_size = sprintf(header, "*2\r\n$1\r\n0\r\n");
+        send(socket, header, header_size, MSG_NOSIGNAL | MSG_MORE);
+    } else {
+        static const char hex[] = "0123456789abcdef";
+        header_size = sprintf(header, "*2\r\n$%zu\r\n", key_size * 2);
+        send(socket, header, header_size, MSG_NOSIGNAL | MSG_MORE);
+        char chunk[512];
+        size_t n = 0;
+        for (size_t i = 0; i < key_size; i++) {
+            chunk[n++] = hex[scanKey[i] >> 4];
+            chunk[n++] = hex[scanKey[i] & 0xF];
+            if (n == sizeof(chunk)) {
+                send(socket, chunk, n, MSG_NOSIGNAL | MSG_MORE);
+                n = 0;
+            }
+        }
+        chunk[n++] = '\r';
+        chunk[n++] = '\n';
+        send(socket, chunk, n, MSG_NOSIGNAL | MSG_MORE);
+    }
+    char *out = replyFinishArray(found, &size);
+    send(socket, out, size, MSG_NOSIGNAL);
+}
+
+/*
+ * Reader threads. MGETOBJECT, MGETEVENT and GETEVENTSALL are long reads,
+ * with -readers they are served by reader threads while main thread goes
+ * on with writes, see zadbepoch.h. Connection waits for reply of its
+ * reader job before its next request is processed, so replies keep
+ * order of requests.
+ */
+#define READER_RETRIES 8
+
+typedef struct readerJob {
+    int slot;          // connection in main loop
+    int socket;
+    const char *table; // table of MGET, NULL for GETEVENTSALL
+    char *buf;         // request in buffer of connection
+    char *end;
+    long long count;
+    respArg cmd;
+    respArg key;
+    char *cached;      // reply of GETEVENTSALL for cache
+    size_t cached_size;
+    unsigned long long seq;
+    statRequest stat;
+    struct readerJob *next;
+} readerJob;
+
+int readerCount = 0;
+int readerPipe[2] = { -1, -1 };
+pthread_mutex_t readerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t readerCond = PTHREAD_COND_INITIALIZER;
+readerJob *readerQueue = NULL;
+readerJob *readerQueueTail = NULL;
+readerJob *readerDone = NULL;
+_Atomic long long readerStatGet = 0;
+_Atomic long long readerStatRetries = 0;
+
+/*
+ * Build reply from consistent view of tree and send it. Read is repeated
+ * while writer changes tree, after READER_RETRIES writer waits for it.
+ */
+void readerServe(int reader, readerJob *job) {
+    size_t size;
+    char *out;
+    int exclusive = 0;
+    for (int attempt = 0; ; attempt++) {
+        if (attempt == READER_RETRIES) {
+            zadbEpochExclusive(1);
+            exclusive = 1;
+        }
+        db_stat_get = 0;
+        unsigned long long seq = zadbEpochReadBegin(reader);
+        if (job->table != NULL) {
+            size_t from = nativeMGet(-1, job->table, job->buf, job->end, job->count);
+            out = reply.buf + from;
+            size = reply.size - from;
+        } else {
+            replyReset();
+            long long count = relCollectEvents(job->key.str, job->key.size);
+            out = replyFinishArray(count * 2, &size);
+        }
+        if (zadbEpochReadEnd(reader, seq)) {
+            job->seq = seq;
+            break;
+        }
+        atomic_fetch_add(&readerStatRetries, 1);
+    }
+    if (exclusive) {
+        zadbEpochExclusive(0);
+    }
+    atomic_fetch_add(&readerStatGet, db_stat_get);
+    job->stat.ops = db_stat_get;
+    send(job->socket, out, size, MSG_NOSIGNAL);
+    job->cached = NULL;
+    if (job->table == NULL && (job->cached = malloc(size)) != NULL) {
+        memcpy(job->cached, out, size);
+        job->cached_size = size;
+    }
+}
+
+void *readerLoop(void *arg) {
+    int reader = (int) (intptr_t) arg;
+    while (1) {
+        pthread_mutex_lock(&readerLock);
+        while (readerQueue == NULL) {
+            pthread_cond_wait(&readerCond, &readerLock);
+        }
+        readerJob *job = readerQueue;
+        readerQueue = job->next;
+        if (readerQueue == NULL) {
+            readerQueueTail = NULL;
+        }
+        pthread_mutex_unlock(&readerLock);
+
+        readerServe(reader, job);
+
+        pthread_mutex_lock(&readerLock);
+        job->next = readerDone;
+        readerDone = job;
+        pthread_mutex_unlock(&readerLock);
+        if (write(readerPipe[1], "", 1) < 0 && errno != EAGAIN) {
+            perror("reader pipe write failed");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start reader threads. Memory of tree is freed after readers leave it
+ * since now.
+ *
+ * return 0 on success
+ */
+int readerStart(int readers) {
+    pthread_t thread;
+    if (zadbEpochStart(readers)) {
+        return 1;
+    }
+    if (pipe(readerPipe) != 0 || fcntl(readerPipe[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(readerPipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        perror("reader pipe failed");
+        return 1;
+    }
+    rbtSetFree(rbtHandle, zadbEpochFree);
+    for (int i = 0; i < readers; i++) {
+        if (pthread_create(&thread, NULL, readerLoop, (void *) (intptr_t) i) != 0) {
+            perror("pthread_create failed");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    readerCount = readers;
+    return 0;
+}
+
+/*
+ * Give request to reader thread
+ *
+ * job: job of connection, NULL if connection can't wait for reader
+ * table: table of MGET or NULL for GETEVENTSALL with cmd and key
+ *
+ * return 1 if request is given
+ */
+int readerSubmit(readerJob *job, int socket, const char *table, char *buf, char *end, long long count, respArg *cmd, respArg *key) {
+    if (job == NULL || readerCount == 0) {
+        return 0;
+    }
+    job->socket = socket;
+    job->table = table;
+    job->buf = buf;
+    job->end = end;
+    job->count = count;
+    if (cmd != NULL) {
+        job->cmd = *cmd;
+        job->key = *key;
+    }
+    job->next = NULL;
+    pthread_mutex_lock(&readerLock);
+    if (readerQueueTail != NULL) {
+        readerQueueTail->next = job;
+    } else {
+        readerQueue = job;
+    }
+    readerQueueTail = job;
+    pthread_cond_signal(&readerCond);
+    pthread_mutex_unlock(&readerLock);
+    return 1;
+}
+
+readerJob *readerTakeDone() {
+    pthread_mutex_lock(&readerLock);
+    readerJob *done = readerDone;
+    readerDone = NULL;
+    pthread_mutex_unlock(&readerLock);
+    return done;
+}
+
+/*
+ * Priority classes of scheduler. Requests waiting in client buffers are
+ * run class by class, interactive reads first and maintenance last.
+ */
+#define SCHED_INTERACTIVE 0
+#define SCHED_INGEST 1
+#define SCHED_BULK 2
+#define SCHED_MAINTENANCE 3
+#define SCHED_CLASSES 4
+
+const char *schedClassName[SCHED_CLASSES] = { "interactive", "ingest", "bulk", "maintenance" };
+
+const char *schedIngest[] = { "ADDEVENT", "ADDEVENTS", "DELEVENT", "ADDFILTER", NULL };
+const char *schedBulk[] = { "ADDOBJECT", "ADDOBJECTS", "ADDREL", "ADDRELS", NULL };
+const char *schedMaintenance[] = { "DELOLDOBJECT", "ADDINDEX", "SNAPSHOT", "IMAGEMERGE", "LOGREWRITE", "REPLSYNC", "PRINTALL", NULL };
+
+// commands of class, all other commands are interactive
+const char **schedCommands[SCHED_CLASSES] = { NULL, schedIngest, schedBulk, schedMaintenance };
+
+/*
+ * Requests of class one client runs in one pass of scheduler,
+ * changed by -sched-quota
+ */
+int schedQuota[SCHED_CLASSES] = { 64, 32, 8, 1 };
+
+/*
+ * Counters of class. Wait is time from read of request to its start.
+ */
+typedef struct schedStats {
+    long long queued;
+    long long max_queued;
+    long long requests;
+    long long wait_us;
+    long long max_wait_us;
+} schedStats;
+
+schedStats schedStat[SCHED_CLASSES];
+
+/*
+ * Some client has requests left after pass of scheduler, main loop does
+ * not sleep in poll
+ */
+int schedBacklog = 0;
+
+/*
+ * Class of request by its command
+ *
+ * buf: start of request
+ * end: end of request
+ */
+int schedClass(char *buf, char *end) {
+    respArg cmd;
+    long long count;
+    char *next = respArgsBegin(buf, end, &count);
+    if (next == NULL || respNextArg(next, end, &cmd) == NULL) {
+        return SCHED_INTERACTIVE;
+    }
+    for (int c = SCHED_INGEST; c < SCHED_CLASSES; c++) {
+        for (const char **name = schedCommands[c]; *name != NULL; name++) {
+            if (isArg(&cmd, *name)) {
+                return c;
+            }
+        }
+    }
+    return SCHED_INTERACTIVE;
+}
+
+/*
+ * Command of request in latency stats
+ */
+int statCommand(char *buf, char *end) {
+    respArg cmd;
+    long long count;
+    char *next = respArgsBegin(buf, end, &count);
+    if (next != NULL && respNextArg(next, end, &cmd) != NULL) {
+        for (int i = 0; i < STAT_COMMANDS - 1; i++) {
+            if (isArg(&cmd, statCommandName[i])) {
+                return i;
+            }
+        }
+    }
+    return STAT_COMMANDS - 1;
+}
+
+/*
+ * Requests completed by one read of client
+ */
+typedef struct schedArrival {
+    long long time;
+    int count;
+} schedArrival;
+
+/*
+ * Reply to MEMORY: bytes of keys, values and tree nodes by table prefix,
+ * allocations and lua heap. Bytes are sizes of malloc chunks. Counters are
+ * kept by changes of tree, see zadbMemEntry, so reply does not walk it.
+ * Allocations not reachable from tree are allocations - tree_allocations,
+ * they are in lazy free or leaked.
+ *
+ * tree: also walk tree for its shape, it takes time proportional to size
+ */
+void nativeMemory(int socket, int tree) {
+    zadbMemPrefix prefixes[ZADB_MEM_PREFIXES + 1];
+    long long tree_allocations = 0;
+    long long fields = 0;
+    char name[ZADB_MEM_PREFIX_MAX + 32];
+    size_t size;
+    RbtMem mem;
+    rbtMem(rbtHandle, &mem);
+    // nodes of bulk load are in one allocation, it is freed with the last of them
+    size_t node_chunk = zadbMemChunkSize(mem.node_size);
+    long long node_bytes = (mem.count - mem.arena_live) * node_chunk;
+    if (mem.arena_size > 0) {
+        node_bytes += zadbMemChunkSize(mem.arena_size * mem.node_size);
+    }
+    int count = zadbMemPrefixes(prefixes);
+    replyReset();
+    for (int i = 0; i < count; i++) {
+        zadbMemPrefix *prefix = &prefixes[i];
+        long long prefix_node_bytes = prefix->entries * node_chunk;
+        tree_allocations += prefix->allocations;
+        snprintf(name, sizeof(name), "%.*s_entries", (int) prefix->size, prefix->name);
+        replyAppendField(name, prefix->entries);
+        snprintf(name, sizeof(name), "%.*s_key_bytes", (int) prefix->size, prefix->name);
+        replyAppendField(name, prefix->key_bytes);
+        snprintf(name, sizeof(name), "%.*s_value_bytes", (int) prefix->size, prefix->name);
+        replyAppendField(name, prefix->value_bytes);
+        snprintf(name, sizeof(name), "%.*s_node_bytes", (int) prefix->size, prefix->name);
+        replyAppendField(name, prefix_node_bytes);
+        snprintf(name, sizeof(name), "%.*s_total_bytes", (int) prefix->size, prefix->name);
+        replyAppendField(name, prefix->key_bytes + prefix->value_bytes + prefix_node_bytes);
+        fields += 5;
+    }
+    replyAppendField("tree_nodes", mem.count);
+    replyAppendField("tree_node_bytes", node_bytes);
+    fields += 2;
+    if (tree) {
+        RbtStat shape;
+        char avg[32];
+        rbtStat(rbtHandle, &shape);
+        replyAppendField("tree_height", shape.height);
+        int avg_size = snprintf(avg, sizeof(avg), "%.2f", shape.count ? (double) shape.depth_sum / shape.count : 0.0);
+        replyAppendBulk("tree_avg_compares", 17);
+        replyAppendBulk(avg, avg_size);
+        fields += 2;
+    }
+    replyAppendField("image_entries", zadbImageEntries());
+    replyAppendField("allocations", malloccounter);
+    replyAppendField("tree_allocations", tree_allocations);
+    replyAppendField("lazyfree_pending_bytes", zadbLazyFreePending() + zadbEpochPending());
+    replyAppendField("lua_heap_bytes", (long long) lua_gc(luaState, LUA_GCCOUNT, 0) * 1024 + lua_gc(luaState, LUA_GCCOUNTB, 0));
+    fields += 5;
+    char *out = replyFinishArray(fields * 2, &size);
+    send(socket, out, size, MSG_NOSIGNAL);
+}
+
+/*
+ * Name of snapshot file from client: plain name with .snap suffix,
+ * no directories and no hidden files
+ */
+int snapshotNameValid(const char *name, size_t size) {
+    size_t suffix = sizeof(SNAPSHOT_SUFFIX) - 1;
+    if (size <= suffix || name[0] == '.' || memcmp(name + size - suffix, SNAPSHOT_SUFFIX, suffix)) {
+        return 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (name[i] == '/' || name[i] == '\0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Serve request without lua if possible.
+ *
+ * Cached replies of GETEVENTSALL and GETCHILD are sent from cache,
+ * on miss request is remembered for storing its reply.
+ * MGETOBJECT, MGETEVENT, IQUERY and SCAN are always served here.
+ * With reader threads MGETOBJECT, MGETEVENT and GETEVENTSALL on cache
+ * miss are given to them.
+ *
+ * socket: socket
+ * buf: start of buffer string
+ * end: end of buffer string
+ * job: reader job of connection or NULL
+ *
+ * return 1 if request is served, 2 if it is given to reader thread
+ */
+int processNative(int socket, char * buf, char * end, readerJob *job) {
+    respArg args[NATIVE_MAX_ARGS];
+    size_t size;
+    long long count;
+    cacheReq.active = 0;
+    char *next = respArgsBegin(buf, end, &count);
+    if (next == NULL || (next = respNextArg(next, end, &args[0])) == NULL) {
+        return 0;
+    }
+    if (isArg(&args[0], "MGETOBJECT")) {
+        if (readerSubmit(job, socket, "obj.", next, end, count - 1, NULL, NULL)) {
+            return 2;
+        }
+        nativeMGet(socket, "obj.", next, end, count - 1);
+        return 1;
+    }
+    if (isArg(&args[0], "MGETEVENT")) {
+        if (readerSubmit(job, socket, "evt.", next, end, count - 1, NULL, NULL)) {
+            return 2;
+        }
+        nativeMGet(socket, "evt.", next, end, count - 1);
+        return 1;
+    }
+    int argc = parseRespArgs(buf, end, args, NATIVE_MAX_ARGS);
+    if (argc < 1) {
+        return 0;
+    }
+    if (argc == 3 && (isArg(&args[0], "GETEVENTSALL") || isArg(&args[0], "GETCHILD")) && isArg(&args[1], "key")) {
+        const char *cached = zadbCacheGet(args[0].str, args[0].size, args[2].str, args[2].size, &size);
+        if (cached != NULL) {
+            send(socket, cached, size, MSG_NOSIGNAL);
+            return 1;
+        }
+        if (isArg(&args[0], "GETEVENTSALL") && readerSubmit(job, socket, NULL, NULL, NULL, 0, &args[0], &args[2])) {
+            return 2;
+        }
+        cacheReq.active = 1;
+        cacheReq.cmd = args[0];
+        cacheReq.key = args[2];
+        return 0;
+    }
+    if (isArg(&args[0], "SCAN")) {
+        nativeScan(socket, args, argc);
+        return 1;
+    }
+    if (isArg(&args[0], "IQUERY")) {
+        nativeIndexQuery(socket, args, argc);
+        return 1;
+    }
+    if (isArg(&args[0], "SNAPSHOT")) {
+        // client gives only name of file in snapshot dir, so it can't write over other files
+        char path[1024];
+        const char *name = DEFAULT_SNAPSHOT_NAME;
+        size_t name_size = sizeof(DEFAULT_SNAPSHOT_NAME) - 1;
+        if (argc == 3 && isArg(&args[1], "name")) {
+            name = args[2].str;
+            name_size = args[2].size;
+        }
+        if (!snapshotNameValid(name, name_size)
+                || snprintf(path, sizeof(path), "%s/%.*s", snapshotDir, (int) name_size, name) >= (int) sizeof(path) - 8) {
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+            return 1;
+        }
+        if (shardId >= 0) {
+            size_t len = strlen(path);
+            snprintf(path + len, sizeof(path) - len, ".%d", shardId);
+        }
+        if (zadbSnapStart(rbtHandle, path, db_version_seq)) {
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+        } else {
+            send(socket, "+OK\r\n", 5, MSG_NOSIGNAL);
+        }
+        return 1;
+    }
+    if (isArg(&args[0], "SNAPSHOTSTATUS")) {
+        zadbSnapStat stat;
+        zadbSnapGetStat(&stat);
+        replyReset();
+        replyAppendField("running", stat.running);
+        replyAppendField("last_ok", stat.last_ok);
+        replyAppendField("snapshots", stat.snapshots);
+        replyAppendField("entries", stat.entries);
+        replyAppendField("bytes", stat.bytes);
+        replyAppendField("cow_bytes", stat.cow_bytes);
+        replyAppendField("duration_ms", stat.duration_ms);
+        replyAppendField("seq", stat.seq);
+        char *out = replyFinishArray(16, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "IMAGEMERGE")) {
+        long long entries = -1;
+        if (imagePath != NULL) {
+            // image is remapped, no reader may be in it
+            zadbEpochWriteBegin();
+            zadbEpochWriteBarrier();
+            entries = zadbImageMerge(rbtHandle, imagePath, db_version_seq);
+            zadbEpochWriteEnd();
+        }
+        if (entries < 0 || zadbLogReset(db_version_seq)) {
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+        } else {
+            replyReset();
+            replyAppendInt(entries);
+            send(socket, reply.buf + REPLY_HEADER_ROOM, reply.size - REPLY_HEADER_ROOM, MSG_NOSIGNAL);
+        }
+        return 1;
+    }
+    if (isArg(&args[0], "REPLSYNC")) {
+        if (zadbReplIsReplica() || zadbReplSync(socket, rbtHandle, db_version_seq)) {
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+        }
+        return 1;
+    }
+    if (isArg(&args[0], "REPLACK")) {
+        if (argc == 3) {
+            zadbReplAck(socket, strtoll(args[1].str, NULL, 10), strtoll(args[2].str, NULL, 10));
+        }
+        return 1;
+    }
+    if (isArg(&args[0], "REPLSTATUS")) {
+        zadbReplStat stat;
+        long long lag_bytes, lag_ms;
+        int synced;
+        char name[64];
+        zadbReplGetStat(&stat);
+        replyReset();
+        replyAppendField("replica", stat.replica);
+        replyAppendField("connected", stat.connected);
+        replyAppendField("synced", stat.synced);
+        replyAppendField("offset", stat.offset);
+        replyAppendField("master_offset", stat.master_offset);
+        replyAppendField("lag_bytes", stat.lag_bytes);
+        replyAppendField("lag_ms", stat.lag_ms);
+        replyAppendField("full_syncs", stat.full_syncs);
+        replyAppendField("replicas", stat.replicas);
+        int fields = 9;
+        for (int i = 0; zadbReplReplicaStat(i, &lag_bytes, &lag_ms, &synced); i++) {
+            snprintf(name, sizeof(name), "replica%d_synced", i);
+            replyAppendField(name, synced);
+            snprintf(name, sizeof(name), "replica%d_lag_bytes", i);
+            replyAppendField(name, lag_bytes);
+            snprintf(name, sizeof(name), "replica%d_lag_ms", i);
+            replyAppendField(name, lag_ms);
+            fields += 3;
+        }
+        char *out = replyFinishArray(fields * 2, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "LOGREWRITE")) {
+        if (zadbLogRewrite(rbtHandle, db_version_seq)) {
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+        } else {
+            send(socket, "+OK\r\n", 5, MSG_NOSIGNAL);
+        }
+        return 1;
+    }
+    if (isArg(&args[0], "LOGSTATS")) {
+        zadbLogStat stat;
+        zadbLogGetStat(&stat);
+        replyReset();
+        replyAppendField("enabled", zadbLogEnabled());
+        replyAppendField("records", stat.records);
+        replyAppendField("commits", stat.commits);
+        replyAppendField("fsyncs", stat.fsyncs);
+        replyAppendField("rewrites", stat.rewrites);
+        replyAppendField("rewrite_running", stat.rewrite_running);
+        replyAppendField("replayed", stat.replayed);
+        replyAppendField("first_segment", stat.first_segment);
+        replyAppendField("segment", stat.segment);
+        replyAppendField("bytes", stat.bytes);
+        replyAppendField("base_bytes", stat.base_bytes);
+        char *out = replyFinishArray(22, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "STATS")) {
+        respArg arg;
+        if (count == 2 && respNextArg(next, end, &arg) != NULL && isArg(&arg, "RESET")) {
+            for (int i = 0; i < STAT_COMMANDS; i++) {
+                zadbHistReset(&commandStat[i].latency);
+                commandStat[i].parse_ns = 0;
+                commandStat[i].lua_ns = 0;
+                commandStat[i].send_ns = 0;
+            }
+            send(socket, "+OK\r\n", 5, MSG_NOSIGNAL);
+            return 1;
+        }
+        char name[64];
+        long long fields = 0;
+        replyReset();
+        for (int i = 0; i < STAT_COMMANDS; i++) {
+            commandStats *stat = &commandStat[i];
+            long long n = stat->latency.count;
+            if (n == 0) {
+                continue;
+            }
+            snprintf(name, sizeof(name), "%s_count", statCommandName[i]);
+            replyAppendField(name, n);
+            snprintf(name, sizeof(name), "%s_p50_ns", statCommandName[i]);
+            replyAppendField(name, zadbHistPercentile(&stat->latency, 0.5));
+            snprintf(name, sizeof(name), "%s_p99_ns", statCommandName[i]);
+            replyAppendField(name, zadbHistPercentile(&stat->latency, 0.99));
+            snprintf(name, sizeof(name), "%s_p999_ns", statCommandName[i]);
+            replyAppendField(name, zadbHistPercentile(&stat->latency, 0.999));
+            snprintf(name, sizeof(name), "%s_max_ns", statCommandName[i]);
+            replyAppendField(name, stat->latency.max);
+            snprintf(name, sizeof(name), "%s_parse_avg_ns", statCommandName[i]);
+            replyAppendField(name, stat->parse_ns / n);
+            snprintf(name, sizeof(name), "%s_lua_avg_ns", statCommandName[i]);
+            replyAppendField(name, stat->lua_ns / n);
+            snprintf(name, sizeof(name), "%s_send_avg_ns", statCommandName[i]);
+            replyAppendField(name, stat->send_ns / n);
+            fields += 8;
+        }
+        char *out = replyFinishArray(fields * 2, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "SLOWLOG")) {
+        respArg arg;
+        if (count < 2 || (next = respNextArg(next, end, &arg)) == NULL) {
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+            return 1;
+        }
+        if (isArg(&arg, "RESET")) {
+            slowlogCount = 0;
+            send(socket, "+OK\r\n", 5, MSG_NOSIGNAL);
+            return 1;
+        }
+        if (isArg(&arg, "LEN")) {
+            replyReset();
+            replyAppendInt(slowlogCount);
+            send(socket, reply.buf + REPLY_HEADER_ROOM, reply.size - REPLY_HEADER_ROOM, MSG_NOSIGNAL);
+            return 1;
+        }
+        // SLOWLOG GET [count], newest entries first
+        long long n = slowlogCount;
+        if (count > 2 && respNextArg(next, end, &arg) != NULL) {
+            long long want = strtoll(arg.str, NULL, 10);
+            if (want >= 0 && want < n) {
+                n = want;
+            }
+        }
+        replyReset();
+        for (long long i = 0; i < n; i++) {
+            slowlogEntry *entry = &slowlog[(slowlogNextId - 1 - i) % slowlogLen];
+            char client[INET_ADDRSTRLEN + 8];
+            int client_size = snprintf(client, sizeof(client), "%s:%d", entry->host, entry->port);
+            replyAppend("*16\r\n", 5);
+            replyAppendField("id", entry->id);
+            replyAppendField("time", entry->time);
+            replyAppendField("duration_us", entry->duration_us);
+            replyAppendBulk("command", 7);
+            replyAppendBulk(statCommandName[entry->cmd], strlen(statCommandName[entry->cmd]));
+            replyAppendBulk("key", 3);
+            replyAppendBulk(entry->key, entry->key_size);
+            replyAppendField("tree_ops", entry->ops);
+            replyAppendField("lua_instructions", entry->instructions);
+            replyAppendBulk("client", 6);
+            replyAppendBulk(client, client_size);
+        }
+        char *out = replyFinishArray(n, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "PROFILE")) {
+        // PROFILE START [period] | STOP | RESET | DUMP | CALLS
+        respArg arg;
+        if (count < 2 || (next = respNextArg(next, end, &arg)) == NULL) {
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+            return 1;
+        }
+        if (isArg(&arg, "START")) {
+            profilePeriod = PROFILE_DEFAULT_PERIOD;
+            if (count > 2 && respNextArg(next, end, &arg) != NULL) {
+                long long period = strtoll(arg.str, NULL, 10);
+                if (period > 0) {
+                    profilePeriod = period;
+                }
+            }
+            profileCountdown = profilePeriod;
+            profileWrap(1);
+            zadbProfStart();
+        } else if (isArg(&arg, "STOP")) {
+            zadbProfStop();
+            profileWrap(0);
+        } else if (isArg(&arg, "RESET")) {
+            zadbProfReset();
+        } else if (isArg(&arg, "DUMP")) {
+            replyReset();
+            zadbProfStacks(profileDumpStack, NULL);
+            char *out = replyFinishBulk(&size);
+            send(socket, out, size, MSG_NOSIGNAL);
+            return 1;
+        } else if (isArg(&arg, "CALLS")) {
+            long long calls = 0;
+            replyReset();
+            zadbProfCalls(profileDumpCall, &calls);
+            char *out = replyFinishArray(calls, &size);
+            send(socket, out, size, MSG_NOSIGNAL);
+            return 1;
         } else {
-            num = lua_tointeger(L, -1);
-            zdbval = zadbValNewInt(num);
+            send(socket, "+ERR\r\n", 6, MSG_NOSIGNAL);
+            return 1;
         }
-
-        zdbkey = zadbKeyNew(o_table, o_table_size, o_key, o_key_size, field, field_size, 0);
-
-        RbtStatus status = rbtInsert(rbtHandle, zdbkey, zdbval, &rbdup);
-        switch (status) {
-        case RBT_STATUS_DUPLICATE_KEY:
-            zadbKeyFree(zdbkey);
-            zadbValFree(rbdup);
-            db_stat_upd++;
-            break;
-        case RBT_STATUS_OK:
-            db_stat_set++;
-            break;
-        default:
-            perror("error databaseHSet");
+        send(socket, "+OK\r\n", 5, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "MEMORY")) {
+        nativeMemory(socket, argc > 1 && isArg(&args[1], "TREE"));
+        return 1;
+    }
+    if (isArg(&args[0], "SCHEDSTATS")) {
+        char name[64];
+        replyReset();
+        for (int c = 0; c < SCHED_CLASSES; c++) {
+            schedStats *stat = &schedStat[c];
+            snprintf(name, sizeof(name), "%s_queued", schedClassName[c]);
+            replyAppendField(name, stat->queued);
+            snprintf(name, sizeof(name), "%s_max_queued", schedClassName[c]);
+            replyAppendField(name, stat->max_queued);
+            snprintf(name, sizeof(name), "%s_requests", schedClassName[c]);
+            replyAppendField(name, stat->requests);
+            snprintf(name, sizeof(name), "%s_wait_avg_us", schedClassName[c]);
+            replyAppendField(name, stat->requests ? stat->wait_us / stat->requests : 0);
+            snprintf(name, sizeof(name), "%s_wait_max_us", schedClassName[c]);
+            replyAppendField(name, stat->max_wait_us);
+            snprintf(name, sizeof(name), "%s_quota", schedClassName[c]);
+            replyAppendField(name, schedQuota[c]);
         }
-        lua_pop(L, 1);
+        char *out = replyFinishArray(SCHED_CLASSES * 12, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "LUASTATS")) {
+        replyReset();
+        replyAppendField("requests", luaStat.requests);
+        replyAppendField("preempted", luaStat.preempted);
+        replyAppendField("slices", luaStat.slices);
+        replyAppendField("max_slices", luaStat.max_slices);
+        replyAppendField("queued", luaStat.queued);
+        replyAppendField("budget", luaBudget);
+        char *out = replyFinishArray(12, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
+    }
+    if (isArg(&args[0], "CACHESTATS")) {
+        zadbCacheStat stat;
+        zadbCacheGetStat(&stat);
+        replyReset();
+        replyAppendField("hits", stat.hits);
+        replyAppendField("misses", stat.misses);
+        replyAppendField("stale", stat.stale);
+        replyAppendField("evictions", stat.evictions);
+        replyAppendField("entries", stat.entries);
+        replyAppendField("objects", stat.objects);
+        replyAppendField("bytes", stat.bytes);
+        replyAppendField("max_bytes", stat.max_bytes);
+        char *out = replyFinishArray(16, &size);
+        send(socket, out, size, MSG_NOSIGNAL);
+        return 1;
     }
     return 0;
 }
 
 
 /*
- * get from lua stack string and send with socket
+ * helper function
  *
- * L: lua state or lua thread
+ * put to lua stack input
  *
- * socket: socket
+ * 1 - cmd: some string
+ * 2 - host: host string
+ * 3 - port: port
  *
  */
-int processLuaResult(lua_State *L, int socket) {
-    if (lua_gettop(L) != 1) {
-        return 0;
-    }
-    if (lua_isstring(L, 1)) {
-        size_t str_size;
-        char *str = (char *) lua_tolstring(L, 1, &str_size);
-        if (str != NULL && str_size > 0) {
-            return send(socket, str, str_size, MSG_NOSIGNAL);
-        }
-        return 0;
-    }
-    printf("Lua script returns wrong data\n");
-    return 0;
+void internalEventToLua(lua_State *L, char * cmd, char * host, int port) {
+    lua_pushstring(L, cmd);
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, "name");
+    lua_pushstring(L, host);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "port");
+    lua_pushinteger(L, port);
+    lua_rawset(L, -3);
 }
 
-
 /*
- * run lua thread
+ * helper function
+ *
+ * put to lua stack input
+ *
+ * 1 - cmd: TICK
+ * 2 - table with budget: max time for tick in milliseconds
  *
- * socket: socket
  */
-int processRequest(int socket) {
-    int nres = 0;
-    int rc = lua_resume(luaStateThread, NULL, 2, &nres);
-    switch (rc) {
-    case LUA_YIELD:
-        if (nres > 0) {
-            processLuaResult(luaStateThread, socket);
-            lua_settop(luaStateThread, 0);
-        }
-        break;
-    case 0:
-        printf("--- coroutine finished normally ---\n");
-        exit(1);
-    default:
-        printf("!!! coroutine finished for error !!!\n");
-        luaPrintLuaStack(luaStateThread);
-        exit(1);
-    }
-    return 0;
+void internalTickToLua(lua_State *L, int budget) {
+    lua_pushstring(L, "TICK");
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "budget");
+    lua_pushinteger(L, budget);
+    lua_rawset(L, -3);
 }
 
-#define SOCKET_LOOP_ERR 1
-#define SOCKET_LOOP_OK 0
-#define SOCKET_LOOP_MAX_CONNECTIONS 100
-#define SOCKET_LOOP_MASTER 0
+#define MASTER_SOCKET_IDX 0
+#define BACKGROUND_TICK_MS 5
+#define REPL_SOCKET_IDX 1
+#define READER_PIPE_IDX 2
+#define MAINLOOP_START_IDX 3
 
 
 /*
- * init socket and set options
- *
- * input port
+ * Connected client. Input buffer keeps data of not complete request,
+ * it grows for big batch requests.
  *
- * return socket
+ * While request is served by reader thread or preempted lua request
+ * waits in run queue, socket is out of poll and buffer is not changed:
+ * job points to request in it.
  */
-int socketInit(int* outSocket, int port) {
-    if ((*outSocket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        return SOCKET_LOOP_ERR;
+typedef struct clientConn {
+    char *buf;
+    size_t size;
+    size_t cap;
+    char host[INET_ADDRSTRLEN];
+    int port;
+    int pending;
+    int fd;
+    size_t consumed;
+    readerJob job;
+    size_t scanned;          // end of complete requests known to scheduler
+    respFrame frame;         // scan of not complete request at scanned
+    int queued;              // complete requests not run yet
+    int broken;              // wrong request after queued ones
+    schedArrival *arrivals;  // read times of queued requests, oldest first
+    int arrival_head;
+    int arrival_count;
+    int arrival_cap;
+} clientConn;
+
+/*
+ * Find requests completed by last read, count them to queue of their
+ * class and remember time of read for wait stats
+ */
+void clientScan(clientConn *conn) {
+    int count = 0;
+    while (conn->scanned < conn->size && !conn->broken) {
+        char *request = conn->buf + conn->scanned;
+        long long request_size = respRequestScan(request, conn->buf + conn->size, &conn->frame);
+        if (request_size == 0 && conn->size - conn->scanned < RESP_MAX_REQUEST) {
+            break;
+        }
+        if (request_size <= 0) {
+            conn->broken = 1;
+            break;
+        }
+        schedStats *stat = &schedStat[schedClass(request, request + request_size)];
+        if (++stat->queued > stat->max_queued) {
+            stat->max_queued = stat->queued;
+        }
+        conn->scanned += request_size;
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+    if (conn->arrival_count == conn->arrival_cap) {
+        if (conn->arrival_head > 0) {
+            conn->arrival_count -= conn->arrival_head;
+            memmove(conn->arrivals, conn->arrivals + conn->arrival_head, conn->arrival_count * sizeof(schedArrival));
+            conn->arrival_head = 0;
+        } else {
+            int cap = conn->arrival_cap ? conn->arrival_cap * 2 : 16;
+            schedArrival *arrivals = realloc(conn->arrivals, cap * sizeof(schedArrival));
+            if (arrivals == NULL) {
+                perror("client arrivals realloc failed");
+                exit(1);
+            }
+            conn->arrivals = arrivals;
+            conn->arrival_cap = cap;
+        }
     }
+    conn->arrivals[conn->arrival_count].time = clockMicros();
+    conn->arrivals[conn->arrival_count].count = count;
+    conn->arrival_count++;
+    conn->queued += count;
+}
 
-    int opt = 1;
-    if (setsockopt(*outSocket, SOL_SOCKET, SO_REUSEADDR, (char *) &opt, sizeof(opt)) < 0) {
-        perror("setsockopt failed");
-        return SOCKET_LOOP_ERR;
+/*
+ * Take oldest queued request of client, it is run now
+ */
+void clientTake(clientConn *conn, int cls, long long now) {
+    schedStats *stat = &schedStat[cls];
+    schedArrival *arrival = &conn->arrivals[conn->arrival_head];
+    long long wait = now - arrival->time;
+    stat->queued--;
+    stat->requests++;
+    stat->wait_us += wait;
+    if (wait > stat->max_wait_us) {
+        stat->max_wait_us = wait;
+    }
+    conn->queued--;
+    if (--arrival->count == 0 && ++conn->arrival_head == conn->arrival_count) {
+        conn->arrival_head = 0;
+        conn->arrival_count = 0;
     }
+}
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+/*
+ * Close client connection and tell lua about it
+ */
+void clientClose(struct pollfd *pfd, clientConn *conn) {
+    size_t offset = 0;
+    while (offset < conn->scanned) {
+        char *request = conn->buf + offset;
+        long long request_size = respRequestSize(request, conn->buf + conn->scanned);
+        schedStat[schedClass(request, request + request_size)].queued--;
+        offset += request_size;
+    }
+    conn->scanned = 0;
+    memset(&conn->frame, 0, sizeof(respFrame));
+    conn->queued = 0;
+    conn->broken = 0;
+    conn->arrival_head = 0;
+    conn->arrival_count = 0;
+    internalEventToLua(luaTaskBegin(), "DISCONNECT", conn->host, conn->port);
+    processRequest(pfd->fd, -1, 0);
+    zadbReplClosed(pfd->fd);
+    close(pfd->fd);
+    pfd->fd = -1;
+    free(conn->buf);
+    conn->buf = NULL;
+    conn->size = 0;
+    conn->cap = 0;
+}
 
-    if (bind(*outSocket, (struct sockaddr *) &address, sizeof(address)) < 0) {
-        perror("bind failed");
-        return SOCKET_LOOP_ERR;
+/*
+ * Drop processed requests from buffer of client
+ */
+void clientConsume(clientConn *conn, size_t offset) {
+    conn->size -= offset;
+    conn->scanned -= offset;
+    if (conn->size > 0 && offset > 0) {
+        memmove(conn->buf, conn->buf + offset, conn->size);
     }
-    if (listen(*outSocket, SOCKET_LOOP_MAX_CONNECTIONS) < 0) {
-        perror("listen failed");
-        return SOCKET_LOOP_ERR;
+    if (conn->size == 0 && conn->cap > SOCKET_CLIENT_BUFFER * 4) {
+        free(conn->buf);
+        conn->buf = NULL;
+        conn->cap = 0;
     }
-    printf("Listener on port %d \n", port);
-    printf("Waiting for connections ...\n");
-    return 0;
 }
 
-#define PROTOCOL_OK 0
-#define PROTOCOL_ERR 1
-#define PROTOCOL_EMPTY 2
-#define RESP_ARRAY '*'
-#define RESP_BULKSTRING '$'
-#define RESP_INTEGER ':'
+/*
+ * Take socket of client out of poll until clientResume, requests up to
+ * offset are processed
+ */
+void clientPause(struct pollfd *pfd, clientConn *conn, size_t offset) {
+    conn->pending = 1;
+    conn->fd = pfd->fd;
+    conn->consumed = offset;
+    pfd->fd = -1;
+}
 
 /*
- * decode Redis serialization protocol (RESP) string to lua objects and put on stack
+ * Process complete requests of class cls in buffer of client, at most
+ * limit of them. Processing stops at request of other class, at write
+ * request while other write is suspended or after request given to
+ * reader thread or preempted lua request, it goes on in next pass of
+ * scheduler.
  *
+ * return number of processed requests or -1 if connection is closed
+ */
+int clientProcess(struct pollfd *pfd, clientConn *conn, int cls, int limit) {
+    int requests = 0;
+    size_t offset = 0;
+    long long now = clockMicros();
+    while (requests < limit && (offset < conn->scanned || conn->broken)) {
+        char *request = conn->buf + offset;
+        long long request_size = offset < conn->scanned ? respRequestSize(request, conn->buf + conn->scanned) : -1;
+        if (request_size <= 0) {
+            printf("Wrong protocol. Host disconnected , ip %s , port %d \n", conn->host, conn->port);
+            clientConsume(conn, offset);
+            clientClose(pfd, conn);
+            return -1;
+        }
+        int c = schedClass(request, request + request_size);
+        if (c != cls || (luaWriter != NULL && !requestReadOnly(request, request + request_size))) {
+            break;
+        }
+        clientTake(conn, c, now);
+        offset += request_size;
+        requests++;
+        statRequest *stat = &conn->job.stat;
+        stat->start = clockNanos();
+        stat->cmd = statCommand(request, request + request_size);
+        stat->parse_ns = 0;
+        stat->ops = 0;
+        stat->instructions = 0;
+        stat->buf = request;
+        stat->end = request + request_size;
+        stat->host = conn->host;
+        stat->port = conn->port;
+        long long ops = statOps();
+        int native = processNative(pfd->fd, request, request + request_size, &conn->job);
+        if (native == 2) {
+            clientPause(pfd, conn, offset);
+            return requests;
+        }
+        if (native) {
+            stat->ops = statOps() - ops;
+            statFinish(stat, 0, 0);
+            continue;
+        }
+        if (parseRespToLua(luaTaskBegin(), request, request + request_size) != PROTOCOL_OK) {
+            printf("Wrong protocol. Host disconnected , ip %s , port %d \n", conn->host, conn->port);
+            clientConsume(conn, offset);
+            clientClose(pfd, conn);
+            return -1;
+        }
+        statReq = *stat;
+        statReq.parse_ns = clockNanos() - stat->start;
+        if (processRequest(pfd->fd, conn->job.slot, !requestReadOnly(request, request + request_size))) {
+            clientPause(pfd, conn, offset);
+            return requests;
+        }
+    }
+    clientConsume(conn, offset);
+    return requests;
+}
+
+/*
+ * Connection goes back to poll, its next requests are run by scheduler
+ */
+void clientResume(struct pollfd *pfd, clientConn *conn) {
+    pfd->fd = conn->fd;
+    pfd->revents = 0;
+    conn->pending = 0;
+    clientConsume(conn, conn->consumed);
+}
+
+/*
+ * Read data from client, complete requests are queued for scheduler
  *
- * L: lua state or lua thread
- * buf: start of buffer string
- * end: end of buffer string
- *
- * return status: *
- * PROTOCOL_OK - 0
- * PROTOCOL_ERR - 1
- * PROTOCOL_EMPTY - 2
- *
+ * return 0 or -1 if connection is closed
  */
-int parseRespToLua(lua_State *L, char * buf, char * end) {
-    int luatop = lua_gettop(L);
-    if (*buf != RESP_ARRAY) {
-        return PROTOCOL_ERR;
+int clientRead(struct pollfd *pfd, clientConn *conn) {
+    if (conn->cap - conn->size < SOCKET_CLIENT_BUFFER) {
+        // grows by doubling, big batch request is not copied on every read
+        size_t cap = conn->cap * 2;
+        if (cap < conn->size + SOCKET_CLIENT_BUFFER) {
+            cap = conn->size + SOCKET_CLIENT_BUFFER;
+        }
+        char *buf = realloc(conn->buf, cap);
+        if (buf == NULL) {
+            perror("client buffer realloc failed");
+            clientClose(pfd, conn);
+            return -1;
+        }
+        conn->buf = buf;
+        conn->cap = cap;
     }
-    buf++;
-    int resp_array_size = 0;
-    while (*buf != '\r') {
-        resp_array_size = (resp_array_size * 10) + (*buf - '0');
-        buf++;
-        if (buf > end) {
-            return PROTOCOL_ERR;
+    errno = 0;
+    int nread = read(pfd->fd, conn->buf + conn->size, conn->cap - conn->size);
+    if (nread < 1) {
+        if (errno != 0) {
+            perror("read failed");
         }
+        clientClose(pfd, conn);
+        return -1;
     }
+    conn->size += nread;
+    clientScan(conn);
+    return 0;
+}
 
-    if (resp_array_size < 1) {
-        return PROTOCOL_ERR;
+/*
+ * Take jobs done by reader threads. Reply of GETEVENTSALL is stored to
+ * cache if nothing was written after it was read. Connection goes back
+ * to poll and scheduler runs its next requests.
+ */
+void readerFinish(struct pollfd *pfds, clientConn *conns) {
+    char drain[256];
+    while (read(readerPipe[0], drain, sizeof(drain)) > 0) {
     }
-    buf += 2;
-    int i = 0;
-    for (i = 0; i < resp_array_size; i++) {
-        if (*buf == RESP_BULKSTRING) {
-            buf++;
-            int str_size = 0;
-            while (*buf != '\r') {
-                str_size = (str_size * 10) + (*buf - '0');
-                buf++;
-                if (buf > end) {
-                    lua_settop(luaStateThread, luatop);
-                    return PROTOCOL_ERR;
-                }
-            }
-            buf += 2;
-
-            char * endstr = buf + str_size;
-            if (endstr + 2 > end) {
-                lua_settop(luaStateThread, luatop);
-                return PROTOCOL_ERR;
-            }
-            if (i == 0) {
-                lua_pushlstring(luaStateThread, buf, str_size);
-                lua_createtable(luaStateThread, resp_array_size, 0);
-            } else {
-                lua_pushlstring(luaStateThread, buf, str_size);
-                if (!(i % 2)) {
-                    lua_rawset(luaStateThread, -3);
-                }
-            }
-            buf = endstr + 2;
-        } else if (*buf == RESP_INTEGER) {
-            buf++;
-            lua_Integer num = 0;
-            while (*buf != '\r') {
-                num = (num * 10) + (*buf - '0');
-                buf++;
-                if (buf > end) {
-                    lua_settop(L, luatop);
-                    return PROTOCOL_ERR;
-                }
-            }
-
-            buf += 2;
-            if (i == 0) {
-                lua_pushinteger(L, num);
-                lua_createtable(luaStateThread, resp_array_size, 0);
-            } else {
-                lua_pushinteger(L, num);
-                if (!(i % 2)) {
-                    lua_rawset(luaStateThread, -3);
-                }
+    readerJob *job = readerTakeDone();
+    while (job != NULL) {
+        readerJob *next = job->next;
+        clientConn *conn = &conns[job->slot];
+        if (job->cached != NULL) {
+            if (job->seq == zadbEpochWriteSeq()) {
+                zadbCachePut(job->cmd.str, job->cmd.size, job->key.str, job->key.size, job->cached, job->cached_size);
             }
-
-        } else {
-            lua_settop(L, luatop);
-            return PROTOCOL_ERR;
+            free(job->cached);
+            job->cached = NULL;
         }
-
-    }
-    if (!(i % 2)) {
-        lua_pushlstring(L, "", 0);
-        lua_rawset(L, -3);
+        statFinish(&job->stat, 0, 0);
+        clientResume(&pfds[job->slot], conn);
+        job = next;
     }
-    return PROTOCOL_OK;
 }
 
+/*
+ * Give one slice to every lua request in run queue. Request preempted
+ * again waits behind requests queued in this pass. Connection of finished
+ * request goes back to poll and scheduler runs its next requests.
+ */
+void luaTasksRun(struct pollfd *pfds, clientConn *conns) {
+    long long count = luaStat.queued;
+    while (count-- > 0 && luaRunQueue != NULL) {
+        luaTask *task = luaRunQueue;
+        luaRunQueue = task->next;
+        if (luaRunQueue == NULL) {
+            luaRunQueueTail = NULL;
+        }
+        luaStat.queued--;
+        int slot = task->slot;
+        if (luaTaskResume(task, 0)) {
+            continue;
+        }
+        clientResume(&pfds[slot], &conns[slot]);
+    }
+}
 
 /*
- * helper function
- *
- * put to lua stack input
- *
- * 1 - cmd: some string
- * 2 - host: host string
- * 3 - port: port
+ * One pass of scheduler over requests waiting in client buffers. Classes
+ * are run in order of priority, every client runs at most quota requests
+ * of class in pass. Clients are taken round robin starting from next one
+ * in every pass. Requests over quota wait for next pass.
  *
+ * return number of processed requests
  */
-void internalEventToLua(lua_State *L, char * cmd, char * host, int port) {
-    lua_pushstring(luaStateThread, cmd);
-    lua_createtable(luaStateThread, 0, 3);
-    lua_pushstring(luaStateThread, "name");
-    lua_pushstring(luaStateThread, host);
-    lua_rawset(luaStateThread, -3);
-    lua_pushstring(luaStateThread, "port");
-    lua_pushinteger(luaStateThread, port);
-    lua_rawset(luaStateThread, -3);
+int schedRun(struct pollfd *pfds, clientConn *conns, int nfds) {
+    static int next = 0;
+    int requests = 0;
+    int clients = nfds - MAINLOOP_START_IDX;
+    next = (next + 1) % clients;
+    for (int c = 0; c < SCHED_CLASSES; c++) {
+        for (int k = 0; k < clients; k++) {
+            int i = MAINLOOP_START_IDX + (next + k) % clients;
+            clientConn *conn = &conns[i];
+            if (pfds[i].fd < 0 || conn->pending || (conn->queued == 0 && !conn->broken)) {
+                continue;
+            }
+            int rc = clientProcess(&pfds[i], conn, c, schedQuota[c]);
+            if (rc > 0) {
+                requests += rc;
+            }
+        }
+    }
+    schedBacklog = 0;
+    for (int i = MAINLOOP_START_IDX; i < nfds; i++) {
+        if (pfds[i].fd >= 0 && !conns[i].pending && (conns[i].queued > 0 || conns[i].broken)) {
+            schedBacklog = 1;
+            break;
+        }
+    }
+    return requests;
 }
 
-#define MASTER_SOCKET_IDX 0
-#define MAINLOOP_START_IDX 1
-
-
-//for debug malloc-free counter
-extern long long  malloccounter;
-
 
 /*
  * main function for read data from socket and run lua thread
@@ -700,15 +4049,18 @@ int mainLoop(int port) {
     long long timediff = 0;
     struct timespec stime = {0, 0}, etime = {0, 0};
     int requests = 0;
-    char buf[SOCKET_CLIENT_BUFFER];
     struct sockaddr_in address;
     int addrlen = sizeof(address);
-    const int nfds = SOCKET_LOOP_MAX_CONNECTIONS + 1;
+    const int nfds = SOCKET_LOOP_MAX_CONNECTIONS + MAINLOOP_START_IDX;
     struct pollfd pfds[nfds];
+    clientConn conns[nfds];
+    memset(conns, 0, sizeof(conns));
     for (int i = 0; i < nfds; i++) {
         pfds[i].fd = -1;
         pfds[i].events = POLLIN;
+        conns[i].job.slot = i;
     }
+    pfds[READER_PIPE_IDX].fd = readerPipe[0];
 
     if (socketInit(&pfds[MASTER_SOCKET_IDX].fd, port)) {
         fprintf(stderr, "za_socket_init failed\n");
@@ -719,7 +4071,17 @@ int mainLoop(int port) {
     }
     int timeout = 1000;
     while (1) {
-        int ready = poll(pfds, nfds, timeout);
+        int wait = backgroundJobs || luaRunQueue != NULL || schedBacklog ? 0 : timeout;
+        pfds[REPL_SOCKET_IDX].fd = zadbReplFd();
+        pfds[REPL_SOCKET_IDX].revents = 0;
+        // collector steps only when no socket is ready already
+        if (wait > 0 && poll(pfds, nfds, 0) == 0) {
+            wait -= luaGcIdle(wait * 1000 < LUA_GC_IDLE_US ? wait * 1000 : LUA_GC_IDLE_US) / 1000;
+        }
+        if (zadbReplActive() && wait > ZADB_REPL_TICK_MS) {
+            wait = ZADB_REPL_TICK_MS;
+        }
+        int ready = poll(pfds, nfds, wait);
         if ((ready < 0) && (errno != EINTR)) {
             perror("listen failed");
             return SOCKET_LOOP_ERR;
@@ -731,48 +4093,52 @@ int mainLoop(int port) {
                 return SOCKET_LOOP_ERR;
             }
             for (int i = MAINLOOP_START_IDX; i < nfds; i++) {
-                if (pfds[i].fd < 0) {
+                if (pfds[i].fd < 0 && !conns[i].pending) {
                     pfds[i].fd = new_socket;
-                    internalEventToLua(luaStateThread, "CONNECT", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                    processRequest(new_socket);
+                    pfds[i].revents = 0;
+                    inet_ntop(AF_INET, &address.sin_addr, conns[i].host, sizeof(conns[i].host));
+                    conns[i].port = ntohs(address.sin_port);
+                    internalEventToLua(luaTaskBegin(), "CONNECT", conns[i].host, conns[i].port);
+                    processRequest(new_socket, -1, 0);
                     break;
                 }
             }
         }
 
+        if (pfds[REPL_SOCKET_IDX].fd >= 0 && pfds[REPL_SOCKET_IDX].revents && luaWriter == NULL) {
+            zadbEpochWriteBegin();
+            zadbReplRead();
+            zadbEpochWriteEnd();
+        }
+        if (pfds[READER_PIPE_IDX].fd >= 0 && pfds[READER_PIPE_IDX].revents) {
+            readerFinish(pfds, conns);
+        }
         for (int i = MAINLOOP_START_IDX; i < nfds; i++) {
-            if (pfds[i].revents) {
-                int nread = read(pfds[i].fd, buf, SOCKET_CLIENT_BUFFER);
-                if (nread < 1) {
-                    if (errno != 0) {
-                        perror("read failed");
-                    }
-                    internalEventToLua(luaStateThread, "DISCONNECT", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                    processRequest(pfds[i].fd);
-                    close(pfds[i].fd);
-                    pfds[i].fd = -1;
-                } else {
-                    int rc = parseRespToLua(luaStateThread, buf, buf + nread);
-                    if (rc == PROTOCOL_ERR) {
-                        printf("Wrong protocol. Host disconnected , ip %s , port %d \n", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                        internalEventToLua(luaStateThread, "DISCONNECT", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                        processRequest(pfds[i].fd);
-                        close(pfds[i].fd);
-                        pfds[i].fd = -1;
-                    } else {
-                        requests++;
-                        processRequest(pfds[i].fd);
-                    }
-                }
+            if (pfds[i].fd >= 0 && pfds[i].revents) {
+                clientRead(&pfds[i], &conns[i]);
             }
         }
+        if (luaRunQueue != NULL) {
+            luaTasksRun(pfds, conns);
+        }
+        requests += schedRun(pfds, conns, nfds);
+        // background jobs and log rewrite wait for suspended write
+        if (backgroundJobs && luaWriter == NULL) {
+            internalTickToLua(luaTaskBegin(), BACKGROUND_TICK_MS);
+            processRequest(-1, -1, 1);
+        }
+        if (luaWriter == NULL) {
+            zadbLogTick(rbtHandle, db_version_seq);
+        }
+        zadbSnapTick();
+        zadbReplTick();
         if (clock_gettime(CLOCK_REALTIME, &etime) == -1) {
             perror("clock_gettime");
             exit(SOCKET_LOOP_ERR);
         }
         timediff = difftime(etime.tv_sec,stime.tv_sec)*1e9 +  etime.tv_nsec - stime.tv_nsec;
         if (timediff > 1000000000) {
-            fprintf(stderr, "Req_sec=%8d mem_alloc=%8lld db_get_sec=%8lld db_set_sec=%8lld db_del_sec=%8lld db_upd_sec=%8lld\n", requests, malloccounter, db_stat_get, db_stat_set, db_stat_del, db_stat_upd);
+            fprintf(stderr, "Req_sec=%8d mem_alloc=%8lld db_get_sec=%8lld db_set_sec=%8lld db_del_sec=%8lld db_upd_sec=%8lld lazyfree_pending=%8lld reader_retries=%8lld lua_heap_kb=%8d gc_idle_us=%8lld gc_request_us=%8lld gc_pause_max_us=%6lld\n", requests, malloccounter, db_stat_get + atomic_exchange(&readerStatGet, 0), db_stat_set, db_stat_del, db_stat_upd, zadbLazyFreePending() + zadbEpochPending(), atomic_exchange(&readerStatRetries, 0), lua_gc(luaState, LUA_GCCOUNT, 0), luaGcIdleUs, luaGcRequestUs, luaGcPauseMaxUs);
             if (clock_gettime(CLOCK_REALTIME, &stime) == -1) {
                 perror("clock_gettime");
                 exit(SOCKET_LOOP_ERR);
@@ -782,9 +4148,13 @@ int mainLoop(int port) {
             db_stat_set = 0;
             db_stat_del = 0;
             db_stat_upd = 0;
+            luaGcIdleUs = 0;
+            luaGcRequestUs = 0;
+            luaGcPauseMaxUs = 0;
             timeout = 1000;
         } else {
-            timeout = timeout - timediff / 1000;
+            // time left to next stats line in milliseconds
+            timeout = 1000 - timediff / 1000000;
             if (timeout < 0) {
                 timeout = 0;
             }
@@ -802,6 +4172,7 @@ int mainLoop(int port) {
 int initLua() {
     luaState = luaL_newstate();
     luaL_openlibs(luaState);
+    luaGcInit();
     lua_newtable(luaState);
     lua_pushcfunction(luaState, databaseHGet);
     lua_setfield(luaState, -2, "hget");
@@ -811,10 +4182,24 @@ int initLua() {
     lua_setfield(luaState, -2, "hdel");
     lua_pushcfunction(luaState, databaseHDelall);
     lua_setfield(luaState, -2, "hdelall");
+    lua_pushcfunction(luaState, databaseHKeys);
+    lua_setfield(luaState, -2, "hkeys");
     lua_pushcfunction(luaState, databaseHSet);
     lua_setfield(luaState, -2, "hset");
+    lua_pushcfunction(luaState, databaseHVersion);
+    lua_setfield(luaState, -2, "hversion");
+    lua_pushcfunction(luaState, databaseIndex);
+    lua_setfield(luaState, -2, "index");
+    lua_pushcfunction(luaState, databaseGetEventsAll);
+    lua_setfield(luaState, -2, "geteventsall");
     lua_pushcfunction(luaState, databasePrintAll);
     lua_setfield(luaState, -2, "printall");
+    lua_pushcfunction(luaState, databaseBackground);
+    lua_setfield(luaState, -2, "background");
+    lua_pushcfunction(luaState, databaseClock);
+    lua_setfield(luaState, -2, "clock");
+    lua_pushcfunction(luaState, databaseReadonly);
+    lua_setfield(luaState, -2, "readonly");
     lua_setglobal(luaState, "za_db");
     int status = luaL_loadfile(luaState, "main.lua");
     if (status != LUA_OK) {
@@ -823,14 +4208,18 @@ int initLua() {
         return 1;
     }
     lua_setfield(luaState, LUA_REGISTRYINDEX, "za_code");
-    luaStateThread = lua_newthread(luaState);
-    lua_getfield(luaStateThread, LUA_REGISTRYINDEX, "za_code");
-    status = lua_pcall(luaStateThread, 0, 1, 0);
+    lua_getfield(luaState, LUA_REGISTRYINDEX, "za_code");
+    status = lua_pcall(luaState, 0, 1, 0);
     if (status != LUA_OK) {
         fprintf(stderr, "lua_pcall failed. ");
         luaCheckErrors(status);
         return 1;
     }
+    if (!lua_isfunction(luaState, -1)) {
+        fprintf(stderr, "main.lua does not return request function\n");
+        return 1;
+    }
+    luaDispatchRef = luaL_ref(luaState, LUA_REGISTRYINDEX);
 
     return 0;
 }
@@ -838,11 +4227,105 @@ int initLua() {
 
 int main(int argc, char **argv) {
     int port = DEFAULT_PORT;
+    size_t cache_bytes = DEFAULT_CACHE_BYTES;
+    char *log_path = NULL;
+    char *snapshot_path = NULL;
+    char *replica_of = NULL;
+    int readers = 0;
+    int shards = 0;
+    const char *shard_key = ZADB_SHARD_DEFAULT_KEY;
+    char shard_paths[3][1024];
+    int log_fsync = ZADB_LOG_FSYNC_DEFAULT_MS;
     char *ptr;
     for (int i = 1; i < argc - 1; i++) {
         if (!strcmp(argv[i], "-port")) {
             port = strtol(argv[i + 1], &ptr, 10);
-            break;
+        } else if (!strcmp(argv[i], "-cache-bytes")) {
+            cache_bytes = strtoll(argv[i + 1], &ptr, 10);
+        } else if (!strcmp(argv[i], "-snapshot-load")) {
+            snapshot_path = argv[i + 1];
+        } else if (!strcmp(argv[i], "-snapshot-dir")) {
+            snapshotDir = argv[i + 1];
+        } else if (!strcmp(argv[i], "-image")) {
+            imagePath = argv[i + 1];
+        } else if (!strcmp(argv[i], "-shards")) {
+            shards = strtol(argv[i + 1], &ptr, 10);
+        } else if (!strcmp(argv[i], "-shard-key")) {
+            shard_key = argv[i + 1];
+        } else if (!strcmp(argv[i], "-sched-quota")) {
+            // quotas of classes: interactive,ingest,bulk,maintenance
+            ptr = argv[i + 1];
+            for (int c = 0; c < SCHED_CLASSES && *ptr != '\0'; c++) {
+                int quota = strtol(ptr, &ptr, 10);
+                if (quota > 0) {
+                    schedQuota[c] = quota;
+                }
+                if (*ptr == ',') {
+                    ptr++;
+                }
+            }
+        } else if (!strcmp(argv[i], "-slowlog-us")) {
+            slowlogThresholdUs = strtoll(argv[i + 1], &ptr, 10);
+        } else if (!strcmp(argv[i], "-slowlog-len")) {
+            slowlogLen = strtol(argv[i + 1], &ptr, 10);
+            if (slowlogLen < 1) {
+                slowlogLen = SLOWLOG_DEFAULT_LEN;
+            }
+        } else if (!strcmp(argv[i], "-lua-gc")) {
+            luaGcGenerational = !strcmp(argv[i + 1], "generational");
+        } else if (!strcmp(argv[i], "-lua-budget")) {
+            luaBudget = strtol(argv[i + 1], &ptr, 10);
+        } else if (!strcmp(argv[i], "-readers")) {
+            readers = strtol(argv[i + 1], &ptr, 10);
+        } else if (!strcmp(argv[i], "-replicaof")) {
+            replica_of = argv[i + 1];
+        } else if (!strcmp(argv[i], "-log")) {
+            log_path = argv[i + 1];
+        } else if (!strcmp(argv[i], "-log-fsync")) {
+            if (!strcmp(argv[i + 1], "always")) {
+                log_fsync = ZADB_LOG_FSYNC_ALWAYS;
+            } else if (!strcmp(argv[i + 1], "never")) {
+                log_fsync = ZADB_LOG_FSYNC_NEVER;
+            } else {
+                log_fsync = strtol(argv[i + 1], &ptr, 10);
+                if (log_fsync <= 0) {
+                    log_fsync = ZADB_LOG_FSYNC_DEFAULT_MS;
+                }
+            }
+        }
+    }
+    if (replica_of != NULL && (log_path != NULL || snapshot_path != NULL || imagePath != NULL)) {
+        fprintf(stderr, "-replicaof takes data from master, it can't be used with -log, -snapshot-load or -image\n");
+        return 1;
+    }
+    if (shards > 0) {
+        if (replica_of != NULL) {
+            fprintf(stderr, "-replicaof can't be used with -shards\n");
+            return 1;
+        }
+        if (zadbShardStart(shards, &shardId)) {
+            return 1;
+        }
+        if (shardId < 0) {
+            int listen_fd;
+            if (socketInit(&listen_fd, port)) {
+                fprintf(stderr, "router socket init failed\n");
+                return 1;
+            }
+            return zadbShardRouter(listen_fd, port, shard_key);
+        }
+        port += 1 + shardId;
+        if (log_path != NULL) {
+            snprintf(shard_paths[0], sizeof(shard_paths[0]), "%s.%d", log_path, shardId);
+            log_path = shard_paths[0];
+        }
+        if (snapshot_path != NULL) {
+            snprintf(shard_paths[1], sizeof(shard_paths[1]), "%s.%d", snapshot_path, shardId);
+            snapshot_path = shard_paths[1];
+        }
+        if (imagePath != NULL) {
+            snprintf(shard_paths[2], sizeof(shard_paths[2]), "%s.%d", imagePath, shardId);
+            imagePath = shard_paths[2];
         }
     }
 
@@ -851,9 +4334,50 @@ int main(int argc, char **argv) {
         perror("rbtNew failed\n");
         return 1;
     }
+    zadbCacheInit(cache_bytes);
+    if (zadbLazyFreeStart()) {
+        return 1;
+    }
+    if (imagePath != NULL && access(imagePath, F_OK) == 0) {
+        ZADB_DATA_NUM seq = 0;
+        if (zadbImageOpen(imagePath, &seq)) {
+            return 1;
+        }
+        db_version_seq = seq;
+    }
+    bulk.startup = 1;
+    bulkLoadStart();
+    if (snapshot_path != NULL) {
+        ZADB_DATA_NUM seq = 0;
+        if (zadbSnapLoad(snapshot_path, &logApply, &seq)) {
+            return 1;
+        }
+        if (seq > db_version_seq) {
+            db_version_seq = seq;
+        }
+    }
+    if (log_path != NULL && zadbLogOpen(log_path, log_fsync, &logApply)) {
+        return 1;
+    }
+    bulkLoadFinish();
+    bulk.startup = 0;
+    if (replica_of != NULL) {
+        char host[256];
+        int master_port = DEFAULT_PORT;
+        snprintf(host, sizeof(host), "%s", replica_of);
+        char *colon = strrchr(host, ':');
+        if (colon != NULL) {
+            *colon = 0;
+            master_port = strtol(colon + 1, &ptr, 10);
+        }
+        zadbReplConnect(host, master_port, &logApply);
+    }
     if (initLua()) {
         return 1;
     }
+    if (readers > 0 && readerStart(readers)) {
+        return 1;
+    }
     mainLoop(port);
     return 0;
 }
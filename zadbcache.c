@@ -0,0 +1,348 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zadbcache.h"
+
+/*
+ * Object version. Shared by all entries of one object key,
+ * freed with last entry. Its key is counted in bytes once.
+ */
+typedef struct zadbCacheObject {
+    struct zadbCacheObject *next;    // hash chain
+    unsigned long long version;
+    long long refs;
+    size_t key_size;
+    char key[];
+} zadbCacheObject;
+
+typedef struct zadbCacheEntry {
+    struct zadbCacheEntry *next;     // hash chain
+    struct zadbCacheEntry *lru_prev; // more recently used
+    struct zadbCacheEntry *lru_next; // less recently used
+    zadbCacheObject *object;
+    unsigned long long version;
+    unsigned long hash;
+    size_t cmd_size;
+    size_t reply_size;
+    char *reply;
+    char data[];                     // cmd, then reply
+} zadbCacheEntry;
+
+typedef struct zadbCacheTable {
+    void **buckets;
+    size_t size;
+    size_t count;
+} zadbCacheTable;
+
+static zadbCacheTable entries = { NULL, 0, 0 };
+static zadbCacheTable objects = { NULL, 0, 0 };
+static zadbCacheEntry *lruHead = NULL;
+static zadbCacheEntry *lruTail = NULL;
+static zadbCacheStat cacheStat;
+
+#define CACHE_INIT_BUCKETS 1024
+
+static unsigned long zadbCacheHash(unsigned long hash, const char *data, size_t size) {
+    while (size-- > 0) {
+        hash ^= (unsigned char) *data++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+#define CACHE_HASH_SEED 14695981039346656037UL
+
+static unsigned long zadbCacheEntryHash(const char *cmd, size_t cmd_size, const char *key, size_t key_size) {
+    unsigned long hash = zadbCacheHash(CACHE_HASH_SEED, cmd, cmd_size);
+    hash = zadbCacheHash(hash, "\n", 1);
+    return zadbCacheHash(hash, key, key_size);
+}
+
+static int zadbCacheTableInit(zadbCacheTable *t) {
+    t->size = CACHE_INIT_BUCKETS;
+    t->count = 0;
+    t->buckets = calloc(t->size, sizeof(void *));
+    return t->buckets == NULL;
+}
+
+void zadbCacheInit(size_t max_bytes) {
+    memset(&cacheStat, 0, sizeof(cacheStat));
+    cacheStat.max_bytes = max_bytes;
+    if (zadbCacheTableInit(&entries) || zadbCacheTableInit(&objects)) {
+        perror("zadbCacheInit failed");
+        cacheStat.max_bytes = 0;
+    }
+}
+
+static void zadbCacheEntriesResize() {
+    size_t size = entries.size * 2;
+    void **buckets = calloc(size, sizeof(void *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < entries.size; i++) {
+        zadbCacheEntry *e = entries.buckets[i];
+        while (e != NULL) {
+            zadbCacheEntry *next = e->next;
+            e->next = buckets[e->hash % size];
+            buckets[e->hash % size] = e;
+            e = next;
+        }
+    }
+    free(entries.buckets);
+    entries.buckets = buckets;
+    entries.size = size;
+}
+
+static void zadbCacheObjectsResize() {
+    size_t size = objects.size * 2;
+    void **buckets = calloc(size, sizeof(void *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < objects.size; i++) {
+        zadbCacheObject *o = objects.buckets[i];
+        while (o != NULL) {
+            zadbCacheObject *next = o->next;
+            unsigned long hash = zadbCacheHash(CACHE_HASH_SEED, o->key, o->key_size);
+            o->next = buckets[hash % size];
+            buckets[hash % size] = o;
+            o = next;
+        }
+    }
+    free(objects.buckets);
+    objects.buckets = buckets;
+    objects.size = size;
+}
+
+static zadbCacheObject *zadbCacheObjectFind(const char *key, size_t key_size, int create) {
+    unsigned long hash = zadbCacheHash(CACHE_HASH_SEED, key, key_size);
+    zadbCacheObject *o = objects.buckets[hash % objects.size];
+    while (o != NULL) {
+        if (o->key_size == key_size && !memcmp(o->key, key, key_size)) {
+            return o;
+        }
+        o = o->next;
+    }
+    if (!create) {
+        return NULL;
+    }
+    o = malloc(sizeof(zadbCacheObject) + key_size);
+    if (o == NULL) {
+        return NULL;
+    }
+    o->version = 0;
+    o->refs = 0;
+    o->key_size = key_size;
+    memcpy(o->key, key, key_size);
+    o->next = objects.buckets[hash % objects.size];
+    objects.buckets[hash % objects.size] = o;
+    objects.count++;
+    cacheStat.objects++;
+    cacheStat.bytes += sizeof(zadbCacheObject) + key_size;
+    if (objects.count > objects.size) {
+        zadbCacheObjectsResize();
+    }
+    return o;
+}
+
+static void zadbCacheObjectRelease(zadbCacheObject *o) {
+    if (--o->refs > 0) {
+        return;
+    }
+    unsigned long hash = zadbCacheHash(CACHE_HASH_SEED, o->key, o->key_size);
+    zadbCacheObject **p = (zadbCacheObject **) &objects.buckets[hash % objects.size];
+    while (*p != o) {
+        p = &(*p)->next;
+    }
+    *p = o->next;
+    objects.count--;
+    cacheStat.objects--;
+    cacheStat.bytes -= sizeof(zadbCacheObject) + o->key_size;
+    free(o);
+}
+
+static void zadbCacheLruUnlink(zadbCacheEntry *e) {
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        lruHead = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        lruTail = e->lru_prev;
+    }
+}
+
+static void zadbCacheLruPush(zadbCacheEntry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = lruHead;
+    if (lruHead) {
+        lruHead->lru_prev = e;
+    } else {
+        lruTail = e;
+    }
+    lruHead = e;
+}
+
+static size_t zadbCacheEntrySize(zadbCacheEntry *e) {
+    return sizeof(zadbCacheEntry) + e->cmd_size + e->reply_size;
+}
+
+static void zadbCacheEntryRemove(zadbCacheEntry *e) {
+    zadbCacheEntry **p = (zadbCacheEntry **) &entries.buckets[e->hash % entries.size];
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    zadbCacheLruUnlink(e);
+    entries.count--;
+    cacheStat.entries--;
+    cacheStat.bytes -= zadbCacheEntrySize(e);
+    zadbCacheObjectRelease(e->object);
+    free(e);
+}
+
+static zadbCacheEntry *zadbCacheEntryFind(const char *cmd, size_t cmd_size, const char *key, size_t key_size) {
+    unsigned long hash = zadbCacheEntryHash(cmd, cmd_size, key, key_size);
+    zadbCacheEntry *e = entries.buckets[hash % entries.size];
+    while (e != NULL) {
+        if (e->hash == hash && e->cmd_size == cmd_size && e->object->key_size == key_size && !memcmp(e->data, cmd, cmd_size)
+                && !memcmp(e->object->key, key, key_size)) {
+            return e;
+        }
+        e = e->next;
+    }
+    return NULL;
+}
+
+/*
+ * Find valid reply in cache
+ *
+ * size: out reply size
+ *
+ * return reply or NULL
+ */
+const char *zadbCacheGet(const char *cmd, size_t cmd_size, const char *key, size_t key_size, size_t *size) {
+    if (cacheStat.max_bytes == 0) {
+        return NULL;
+    }
+    zadbCacheEntry *e = zadbCacheEntryFind(cmd, cmd_size, key, key_size);
+    if (e == NULL) {
+        cacheStat.misses++;
+        return NULL;
+    }
+    if (e->version != e->object->version) {
+        cacheStat.stale++;
+        cacheStat.misses++;
+        zadbCacheEntryRemove(e);
+        return NULL;
+    }
+    cacheStat.hits++;
+    zadbCacheLruUnlink(e);
+    zadbCacheLruPush(e);
+    *size = e->reply_size;
+    return e->reply;
+}
+
+/*
+ * Store reply. Reply is valid until version of object key is bumped.
+ */
+void zadbCachePut(const char *cmd, size_t cmd_size, const char *key, size_t key_size, const char *reply, size_t size) {
+    if (cacheStat.max_bytes == 0 || sizeof(zadbCacheEntry) + cmd_size + sizeof(zadbCacheObject) + key_size + size > cacheStat.max_bytes / 2) {
+        return;
+    }
+    zadbCacheEntry *e = zadbCacheEntryFind(cmd, cmd_size, key, key_size);
+    if (e != NULL) {
+        zadbCacheEntryRemove(e);
+    }
+    zadbCacheObject *o = zadbCacheObjectFind(key, key_size, 1);
+    if (o == NULL) {
+        return;
+    }
+    e = malloc(sizeof(zadbCacheEntry) + cmd_size + size);
+    if (e == NULL) {
+        o->refs++;
+        zadbCacheObjectRelease(o);
+        return;
+    }
+    o->refs++;
+    e->object = o;
+    e->version = o->version;
+    e->hash = zadbCacheEntryHash(cmd, cmd_size, key, key_size);
+    e->cmd_size = cmd_size;
+    e->reply_size = size;
+    e->reply = e->data + cmd_size;
+    memcpy(e->data, cmd, cmd_size);
+    memcpy(e->reply, reply, size);
+    e->next = entries.buckets[e->hash % entries.size];
+    entries.buckets[e->hash % entries.size] = e;
+    zadbCacheLruPush(e);
+    entries.count++;
+    cacheStat.entries++;
+    cacheStat.bytes += zadbCacheEntrySize(e);
+    while (cacheStat.bytes > cacheStat.max_bytes && lruTail != NULL) {
+        zadbCacheEntryRemove(lruTail);
+        cacheStat.evictions++;
+    }
+    if (entries.count > entries.size) {
+        zadbCacheEntriesResize();
+    }
+}
+
+/*
+ * Drop all entries, data is replaced as a whole
+ */
+void zadbCacheClear() {
+    while (lruTail != NULL) {
+        zadbCacheEntryRemove(lruTail);
+    }
+}
+
+int zadbCacheIsEmpty() {
+    return entries.count == 0;
+}
+
+/*
+ * Something under object is changed, all replies for it are stale.
+ */
+void zadbCacheBump(const char *key, size_t key_size) {
+    if (objects.count == 0) {
+        return;
+    }
+    zadbCacheObject *o = zadbCacheObjectFind(key, key_size, 0);
+    if (o != NULL) {
+        o->version++;
+    }
+}
+
+void zadbCacheGetStat(zadbCacheStat *out) {
+    *out = cacheStat;
+}
@@ -0,0 +1,64 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+
+#ifndef ZADBCACHE_H_
+#define ZADBCACHE_H_
+
+/*
+ * Cache of serialized replies for expensive commands.
+ *
+ * Entry is keyed by command and object key. Every cached object has
+ * version counter, entry is valid while version is the same as when the
+ * entry was stored. Owner of data bumps version of object when something
+ * under the object changes. Memory is limited by byte budget, least
+ * recently used entries are evicted.
+ */
+
+typedef struct zadbCacheStat {
+    long long hits;
+    long long misses;
+    long long stale;
+    long long evictions;
+    long long entries;
+    long long objects;
+    size_t bytes;
+    size_t max_bytes;
+} zadbCacheStat;
+
+void zadbCacheInit(size_t max_bytes);
+
+const char *zadbCacheGet(const char *cmd, size_t cmd_size, const char *key, size_t key_size, size_t *size);
+void zadbCachePut(const char *cmd, size_t cmd_size, const char *key, size_t key_size, const char *reply, size_t size);
+
+void zadbCacheClear();
+int zadbCacheIsEmpty();
+void zadbCacheBump(const char *key, size_t key_size);
+
+void zadbCacheGetStat(zadbCacheStat *stat);
+
+#endif /* ZADBCACHE_H_ */
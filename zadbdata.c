@@ -27,21 +27,20 @@ SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include "zadbdata.h"
+#include "zadbepoch.h"
 
 typedef enum {
     ZADBDATASTR, ZADBDATAINT
 } zadbType;
 
-typedef struct zadbKey {
-    ZADB_DATA_TYPE table_size;
-    ZADB_DATA_TYPE key_size;
-    ZADB_DATA_TYPE filed_size;
-    char * table;
-    char * key;
-    char * field;
-} zadbKey;
-
+/*
+ * Both headers have the same layout before data.
+ */
 typedef struct zadbVal {
     zadbType type;
     ZADB_DATA_TYPE size;
@@ -49,13 +48,40 @@ typedef struct zadbVal {
 
 typedef struct zadbValInt {
     zadbType type;
+    ZADB_DATA_TYPE size;
     ZADB_DATA_NUM num;
 } zadbValInt;
 
+/*
+ * Freed key or value waiting in lazy free queue.
+ * Placed over the freed memory, so all allocations are not less than it.
+ */
+typedef struct zadbLazyNode {
+    struct zadbLazyNode *next;
+    size_t size;
+} zadbLazyNode;
+
 long long malloccounter = 0;
 
+static _Atomic(zadbLazyNode *) lazyHead = NULL;
+static _Atomic long long lazyPendingBytes = 0;
+static sem_t lazySem;
+static int lazyStarted = 0;
+
+/*
+ * Values not owned by allocator: mapped image and tombstone, they are
+ * never freed.
+ */
+static const char *staticStart = NULL;
+static const char *staticEnd = NULL;
+static zadbValInt tombstone = { ZADBDATAINT, 0, 0 };
+
 zadbDataVal zadbValNewStr(const char * val, ZADB_DATA_TYPE val_size) {
-    zadbVal *out = malloc(sizeof(zadbVal) + val_size * sizeof(char));
+    size_t alloc_size = sizeof(zadbVal) + val_size * sizeof(char);
+    if (alloc_size < sizeof(zadbLazyNode)) {
+        alloc_size = sizeof(zadbLazyNode);
+    }
+    zadbVal *out = malloc(alloc_size);
     malloccounter++;
     if (out == NULL) {
         perror("zadbVal_new filed");
@@ -80,6 +106,7 @@ zadbDataVal zadbValNewInt(ZADB_DATA_NUM num) {
         return NULL;
     }
     out->type = ZADBDATAINT;
+    out->size = 0;
     out->num = num;
     return (zadbDataVal) out;
 }
@@ -103,11 +130,201 @@ void zadbValSwap(zadbDataVal to, zadbDataVal from) {
     *b = c;
 }
 
+/*
+ * Replace number in place, value must be number
+ */
+void zadbValSetInt(zadbDataVal d, ZADB_DATA_NUM num) {
+    zadbValInt *z = (zadbValInt*) d;
+    z->num = num;
+}
+
+/*
+ * Replace string in place if new string fits allocation
+ *
+ * return 1 if replaced, 0 if new value is needed
+ */
+int zadbValSetStr(zadbDataVal d, const char * val, ZADB_DATA_TYPE val_size) {
+    zadbVal *z = (zadbVal*) d;
+    size_t capacity = z->size;
+    if (capacity < sizeof(zadbLazyNode) - sizeof(zadbVal)) {
+        capacity = sizeof(zadbLazyNode) - sizeof(zadbVal);
+    }
+    if (z->type != ZADBDATASTR || val_size > capacity) {
+        return 0;
+    }
+    if (val_size > 0) {
+        memcpy(z + 1, val, val_size);
+    }
+    z->size = val_size;
+    return 1;
+}
+
+/*
+ * Size of value stored in image. Value is kept with header, so it is used
+ * from mapped memory as is. String data takes at least as much as in
+ * allocation, so zadbValSetStr works on it too. Size is multiple of 8.
+ */
+size_t zadbValImageSize(zadbDataVal d) {
+    zadbVal *z = (zadbVal*) d;
+    if (z->type != ZADBDATASTR) {
+        return sizeof(zadbValInt);
+    }
+    size_t size = z->size;
+    if (size < sizeof(zadbLazyNode) - sizeof(zadbVal)) {
+        size = sizeof(zadbLazyNode) - sizeof(zadbVal);
+    }
+    return (sizeof(zadbVal) + size + 7) & ~(size_t) 7;
+}
+
+/*
+ * Copy value to image, out has zadbValImageSize bytes
+ */
+void zadbValImageWrite(zadbDataVal d, void *out) {
+    zadbVal *z = (zadbVal*) d;
+    size_t size = zadbValImageSize(d);
+    memset(out, 0, size);
+    if (z->type != ZADBDATASTR) {
+        memcpy(out, z, sizeof(zadbValInt));
+    } else {
+        memcpy(out, z, sizeof(zadbVal) + z->size);
+    }
+}
+
+void zadbDataSetStatic(const void *start, size_t size) {
+    staticStart = start;
+    staticEnd = staticStart + size;
+}
+
+int zadbValIsStatic(zadbDataVal d) {
+    const char *p = d;
+    return d == &tombstone || (p >= staticStart && p < staticEnd);
+}
+
+/*
+ * Value of entry deleted from delta over image, see zadbimage.h
+ */
+zadbDataVal zadbValTombstone() {
+    return &tombstone;
+}
+
+int zadbValIsTombstone(zadbDataVal d) {
+    return d == &tombstone;
+}
+
+/*
+ * Bytes taken by allocation from malloc: usable size, capacity left by
+ * shrink in place included, and header of chunk
+ */
+static size_t memChunk(void *p) {
+    return malloc_usable_size(p) + sizeof(size_t);
+}
+
+/*
+ * Bytes taken from malloc by allocation of size
+ */
+size_t zadbMemChunkSize(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        return size;
+    }
+    size_t chunk = memChunk(p);
+    free(p);
+    return chunk;
+}
+
+/*
+ * Bytes allocated for value, 0 for value not owned by allocator
+ */
+size_t zadbValMemSize(zadbDataVal d) {
+    if (zadbValIsStatic(d)) {
+        return 0;
+    }
+    return memChunk(d);
+}
+
 void zadbValFree(zadbDataVal d) {
     //printf("zadbValFree\n");
     zadbVal *z = (zadbVal*) d;
+    if (zadbValIsStatic(d)) {
+        return;
+    }
+    malloccounter--;
+    if (zadbEpochActive()) {
+        zadbEpochFree(z, z->type == ZADBDATASTR ? sizeof(zadbVal) + z->size : sizeof(zadbValInt));
+        return;
+    }
     free(z);
+}
+
+/*
+ * Push memory block to lazy free queue. Lock-free push, the only consumer
+ * takes whole list at once, so there is no ABA problem.
+ * Wake up free thread if queue was empty.
+ */
+static void zadbLazyPush(void *p, size_t size) {
+    zadbLazyNode *node = (zadbLazyNode *) p;
+    node->size = size;
+    atomic_fetch_add(&lazyPendingBytes, size);
+    zadbLazyNode *head = atomic_load(&lazyHead);
+    do {
+        node->next = head;
+    } while (!atomic_compare_exchange_weak(&lazyHead, &head, node));
+    if (head == NULL) {
+        sem_post(&lazySem);
+    }
+}
+
+static void *zadbLazyFreeThread(void *arg) {
+    while (1) {
+        sem_wait(&lazySem);
+        zadbLazyNode *node = atomic_exchange(&lazyHead, NULL);
+        while (node != NULL) {
+            zadbLazyNode *next = node->next;
+            atomic_fetch_sub(&lazyPendingBytes, node->size);
+            free(node);
+            node = next;
+        }
+    }
+    return NULL;
+}
+
+int zadbLazyFreeStart() {
+    pthread_t thread;
+    if (sem_init(&lazySem, 0, 0) != 0) {
+        perror("sem_init failed");
+        return 1;
+    }
+    if (pthread_create(&thread, NULL, zadbLazyFreeThread, NULL) != 0) {
+        perror("pthread_create failed");
+        return 1;
+    }
+    pthread_detach(thread);
+    lazyStarted = 1;
+    return 0;
+}
+
+long long zadbLazyFreePending() {
+    return atomic_load(&lazyPendingBytes);
+}
+
+void zadbValFreeLazy(zadbDataVal d) {
+    zadbVal *z = (zadbVal*) d;
+    if (zadbValIsStatic(d)) {
+        return;
+    }
+    if (!lazyStarted || zadbEpochActive()) {
+        zadbValFree(d);
+        return;
+    }
+    size_t size = sizeof(zadbValInt);
+    if (z->type == ZADBDATASTR) {
+        size = sizeof(zadbVal) + z->size;
+        if (size < sizeof(zadbLazyNode)) {
+            size = sizeof(zadbLazyNode);
+        }
+    }
     malloccounter--;
+    zadbLazyPush(z, size);
 }
 
 zadbKey tmpzadbKey;
@@ -141,6 +358,19 @@ zadbDataKey zadbKeyNew(const char *table, ZADB_DATA_TYPE table_size, const char*
     return (zadbDataKey) out;
 }
 
+/*
+ * Reference key in storage of caller
+ */
+zadbDataKey zadbKeyRefInit(zadbKey *ref, const char *table, ZADB_DATA_TYPE table_size, const char* key, ZADB_DATA_TYPE key_size, const char* field, ZADB_DATA_TYPE field_size) {
+    ref->table = (char *) table;
+    ref->key = (char *) key;
+    ref->field = (char *) field;
+    ref->table_size = table_size;
+    ref->key_size = key_size;
+    ref->filed_size = field_size;
+    return (zadbDataKey) ref;
+}
+
 void zadbKeyGet(zadbDataKey d, char **table, ZADB_DATA_TYPE *table_size, char **key, ZADB_DATA_TYPE *key_size, char ** field, ZADB_DATA_TYPE *field_size) {
     zadbKey *z = (zadbKey*) d;
 
@@ -152,12 +382,130 @@ void zadbKeyGet(zadbDataKey d, char **table, ZADB_DATA_TYPE *table_size, char **
     *field_size = z->filed_size;
 }
 
+/*
+ * Bytes allocated for key, 0 for reference key
+ */
+size_t zadbKeyMemSize(zadbDataKey d) {
+    zadbKey *z = (zadbKey*) d;
+    if (z->table != (char *) (z + 1)) {
+        return 0;
+    }
+    return memChunk(z);
+}
+
+/*
+ * Memory of tree entries by table prefix. Counters are changed by
+ * functions which change the tree, so MEMORY does not walk it. Prefixes
+ * over ZADB_MEM_PREFIXES are counted together as "other".
+ */
+static zadbMemPrefix memPrefixes[ZADB_MEM_PREFIXES];
+static zadbMemPrefix memOther = { "other", 5, 0, 0, 0, 0 };
+static int memPrefixCount = 0;
+static int memPrefixLast = -1;
+
+/*
+ * Prefix of table is up to its second dot, e.g. "rel.index."
+ */
+static size_t memPrefixSize(const char *table, size_t size) {
+    int dots = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (table[i] == '.' && ++dots == 2) {
+            size = i + 1;
+            break;
+        }
+    }
+    return size < ZADB_MEM_PREFIX_MAX ? size : ZADB_MEM_PREFIX_MAX - 1;
+}
+
+static zadbMemPrefix *memPrefix(zadbDataKey key) {
+    zadbKey *z = (zadbKey*) key;
+    size_t size = memPrefixSize(z->table, z->table_size);
+    if (memPrefixLast >= 0 && memPrefixes[memPrefixLast].size == size
+            && !memcmp(memPrefixes[memPrefixLast].name, z->table, size)) {
+        return &memPrefixes[memPrefixLast];
+    }
+    for (int i = 0; i < memPrefixCount; i++) {
+        if (memPrefixes[i].size == size && !memcmp(memPrefixes[i].name, z->table, size)) {
+            memPrefixLast = i;
+            return &memPrefixes[i];
+        }
+    }
+    if (memPrefixCount == ZADB_MEM_PREFIXES) {
+        return &memOther;
+    }
+    zadbMemPrefix *prefix = &memPrefixes[memPrefixCount];
+    memset(prefix, 0, sizeof(zadbMemPrefix));
+    memcpy(prefix->name, z->table, size);
+    prefix->size = size;
+    memPrefixLast = memPrefixCount++;
+    return prefix;
+}
+
+/*
+ * Entry is added to tree (sign 1) or removed from it (sign -1), call it
+ * before key and value are freed
+ */
+void zadbMemEntry(zadbDataKey key, zadbDataVal val, int sign) {
+    zadbMemPrefix *prefix = memPrefix(key);
+    size_t key_bytes = zadbKeyMemSize(key);
+    size_t value_bytes = zadbValMemSize(val);
+    prefix->entries += sign;
+    prefix->key_bytes += sign * (long long) key_bytes;
+    prefix->value_bytes += sign * (long long) value_bytes;
+    prefix->allocations += sign * ((key_bytes > 0) + (value_bytes > 0));
+}
+
+/*
+ * Value of entry is replaced, key stays in tree
+ */
+void zadbMemValue(zadbDataKey key, zadbDataVal old, zadbDataVal val) {
+    zadbMemPrefix *prefix = memPrefix(key);
+    size_t old_bytes = zadbValMemSize(old);
+    size_t value_bytes = zadbValMemSize(val);
+    prefix->value_bytes += (long long) value_bytes - (long long) old_bytes;
+    prefix->allocations += (value_bytes > 0) - (old_bytes > 0);
+}
+
+/*
+ * Copy counters of prefixes, "other" is last if it has entries
+ *
+ * out: array of ZADB_MEM_PREFIXES + 1 prefixes
+ *
+ * return number of prefixes
+ */
+int zadbMemPrefixes(zadbMemPrefix *out) {
+    memcpy(out, memPrefixes, memPrefixCount * sizeof(zadbMemPrefix));
+    if (memOther.entries == 0) {
+        return memPrefixCount;
+    }
+    out[memPrefixCount] = memOther;
+    return memPrefixCount + 1;
+}
+
 void zadbKeyFree(zadbDataKey d) {
     zadbKey *z = (zadbKey*) d;
-    if (z->table == (char *) (z + 1)) {
-        free(z);
-        malloccounter--;
+    if (z->table != (char *) (z + 1)) {
+        return;
+    }
+    malloccounter--;
+    if (zadbEpochActive()) {
+        zadbEpochFree(z, sizeof(zadbKey) + z->table_size + z->key_size + z->filed_size);
+        return;
+    }
+    free(z);
+}
+
+void zadbKeyFreeLazy(zadbDataKey d) {
+    zadbKey *z = (zadbKey*) d;
+    if (z->table != (char *) (z + 1)) {
+        return;
+    }
+    if (!lazyStarted || zadbEpochActive()) {
+        zadbKeyFree(d);
+        return;
     }
+    malloccounter--;
+    zadbLazyPush(z, sizeof(zadbKey) + z->table_size + z->key_size + z->filed_size);
 }
 
 int zadbKeyCompareStr(const char *key1, const size_t key1_size, const char *key2, const size_t key2_size) {
@@ -24,6 +24,7 @@ SOFTWARE.
 */
 
 #include <limits.h>
+#include <stddef.h>
 
 #ifndef ZADBDATA_H_
 #define ZADBDATA_H_
@@ -35,16 +36,66 @@ SOFTWARE.
 typedef void *zadbDataKey;
 typedef void *zadbDataVal;
 
+/*
+ * Key header. Key made by zadbKeyNew keeps strings right after header,
+ * reference key points to strings stored elsewhere.
+ */
+typedef struct zadbKey {
+    ZADB_DATA_TYPE table_size;
+    ZADB_DATA_TYPE key_size;
+    ZADB_DATA_TYPE filed_size;
+    char * table;
+    char * key;
+    char * field;
+} zadbKey;
+
 zadbDataVal zadbValNewStr(const char * val, ZADB_DATA_TYPE val_size);
 zadbDataVal zadbValNewInt(ZADB_DATA_NUM num);
 
 void zadbValGet(zadbDataVal d, char **str, ZADB_DATA_TYPE *str_size, ZADB_DATA_NUM *num, int *isString);
 void zadbValSwap(zadbDataVal to, zadbDataVal from);
+void zadbValSetInt(zadbDataVal d, ZADB_DATA_NUM num);
+int zadbValSetStr(zadbDataVal d, const char * val, ZADB_DATA_TYPE val_size);
 void zadbValFree(zadbDataVal d);
+void zadbValFreeLazy(zadbDataVal d);
+
+size_t zadbValMemSize(zadbDataVal d);
+size_t zadbValImageSize(zadbDataVal d);
+void zadbValImageWrite(zadbDataVal d, void *out);
+void zadbDataSetStatic(const void *start, size_t size);
+int zadbValIsStatic(zadbDataVal d);
+zadbDataVal zadbValTombstone();
+int zadbValIsTombstone(zadbDataVal d);
 
 zadbDataKey zadbKeyNew(const char *table, ZADB_DATA_TYPE table_size, const char* key, ZADB_DATA_TYPE key_size, const char* field, ZADB_DATA_TYPE field_size, int ref);
+zadbDataKey zadbKeyRefInit(zadbKey *ref, const char *table, ZADB_DATA_TYPE table_size, const char* key, ZADB_DATA_TYPE key_size, const char* field, ZADB_DATA_TYPE field_size);
 void zadbKeyGet(zadbDataKey in, char **table, ZADB_DATA_TYPE *table_size, char **key, ZADB_DATA_TYPE *key_size, char ** field, ZADB_DATA_TYPE *field_size);
+size_t zadbKeyMemSize(zadbDataKey d);
 void zadbKeyFree(zadbDataKey d);
+void zadbKeyFreeLazy(zadbDataKey d);
+
+#define ZADB_MEM_PREFIXES 64
+#define ZADB_MEM_PREFIX_MAX 48
+
+/*
+ * Bytes of tree entries with tables of one prefix, see zadbMemEntry
+ */
+typedef struct zadbMemPrefix {
+    char name[ZADB_MEM_PREFIX_MAX];
+    size_t size;
+    long long entries;
+    long long key_bytes;
+    long long value_bytes;
+    long long allocations;
+} zadbMemPrefix;
+
+size_t zadbMemChunkSize(size_t size);
+void zadbMemEntry(zadbDataKey key, zadbDataVal val, int sign);
+void zadbMemValue(zadbDataKey key, zadbDataVal old, zadbDataVal val);
+int zadbMemPrefixes(zadbMemPrefix *out);
+
+int zadbLazyFreeStart();
+long long zadbLazyFreePending();
 
 int zadbKeyFieldCompare(void *a, void *b);
 
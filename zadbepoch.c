@@ -0,0 +1,271 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "zadbepoch.h"
+
+#define ZADB_EPOCH_LIMBO_SIZE 1024
+
+/*
+ * Memory waiting for readers
+ */
+typedef struct limboEntry {
+    void (*fn)(void *p, size_t size);
+    void *p;
+    size_t size;
+} limboEntry;
+
+typedef struct limboChunk {
+    struct limboChunk *next;
+    size_t count;
+    limboEntry entries[ZADB_EPOCH_LIMBO_SIZE];
+} limboChunk;
+
+static int epochReaders = 0;
+static _Atomic unsigned long long writeSeq = 0;
+static _Atomic int exclusiveReaders = 0;
+static _Atomic unsigned long long globalEpoch = 1;
+// epoch of reader in read, 0 when reader is out
+static _Atomic unsigned long long readerEpoch[ZADB_EPOCH_MAX_READERS];
+static int writeDepth = 0;
+
+// filled by main thread, it is the only writer
+static limboChunk *limbo = NULL;
+static _Atomic(limboChunk *) limboHead = NULL;
+static _Atomic long long limboPendingBytes = 0;
+static sem_t limboSem;
+
+static void limboFlush() {
+    if (limbo == NULL || limbo->count == 0) {
+        return;
+    }
+    limboChunk *head = atomic_load(&limboHead);
+    do {
+        limbo->next = head;
+    } while (!atomic_compare_exchange_weak(&limboHead, &head, limbo));
+    limbo = NULL;
+    if (head == NULL) {
+        sem_post(&limboSem);
+    }
+}
+
+/*
+ * Wait until every reader is out or entered after epoch
+ */
+static void epochSync(unsigned long long epoch) {
+    for (int i = 0; i < epochReaders; i++) {
+        unsigned long long e;
+        while ((e = atomic_load(&readerEpoch[i])) != 0 && e < epoch) {
+            sched_yield();
+        }
+    }
+}
+
+static void *reclaimThread(void *arg) {
+    while (1) {
+        sem_wait(&limboSem);
+        limboChunk *chunk = atomic_exchange(&limboHead, NULL);
+        if (chunk == NULL) {
+            continue;
+        }
+        epochSync(atomic_fetch_add(&globalEpoch, 1) + 1);
+        while (chunk != NULL) {
+            limboChunk *next = chunk->next;
+            for (size_t i = 0; i < chunk->count; i++) {
+                limboEntry *e = &chunk->entries[i];
+                e->fn(e->p, e->size);
+                atomic_fetch_sub(&limboPendingBytes, e->size);
+            }
+            free(chunk);
+            chunk = next;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Enable reads from reader threads, must be called before they start
+ *
+ * readers: number of reader threads
+ *
+ * return 0 on success
+ */
+int zadbEpochStart(int readers) {
+    pthread_t thread;
+    if (readers < 1 || readers > ZADB_EPOCH_MAX_READERS) {
+        fprintf(stderr, "number of readers must be 1..%d\n", ZADB_EPOCH_MAX_READERS);
+        return 1;
+    }
+    if (sem_init(&limboSem, 0, 0) != 0) {
+        perror("sem_init failed");
+        return 1;
+    }
+    if (pthread_create(&thread, NULL, reclaimThread, NULL) != 0) {
+        perror("pthread_create failed");
+        return 1;
+    }
+    pthread_detach(thread);
+    epochReaders = readers;
+    return 0;
+}
+
+/*
+ * return 1 if readers can see memory, so it must be freed by zadbEpochFree
+ */
+int zadbEpochActive() {
+    return epochReaders > 0;
+}
+
+/*
+ * Call fn(p, size) when no reader can see p. Main thread only.
+ * Without readers it is called at once.
+ *
+ * size: bytes for accounting
+ */
+void zadbEpochDefer(void (*fn)(void *p, size_t size), void *p, size_t size) {
+    if (!epochReaders) {
+        fn(p, size);
+        return;
+    }
+    if (limbo == NULL) {
+        limbo = malloc(sizeof(limboChunk));
+        if (limbo == NULL) {
+            perror("limbo alloc failed");
+            exit(1);
+        }
+        limbo->count = 0;
+    }
+    limbo->entries[limbo->count++] = (limboEntry) { fn, p, size };
+    atomic_fetch_add(&limboPendingBytes, size);
+    if (limbo->count == ZADB_EPOCH_LIMBO_SIZE) {
+        limboFlush();
+    }
+}
+
+static void epochFree(void *p, size_t size) {
+    free(p);
+}
+
+void zadbEpochFree(void *p, size_t size) {
+    zadbEpochDefer(epochFree, p, size);
+}
+
+long long zadbEpochPending() {
+    return atomic_load(&limboPendingBytes);
+}
+
+/*
+ * Start of changes. Sections can be nested, only outer one counts.
+ */
+void zadbEpochWriteBegin() {
+    if (!epochReaders || writeDepth++ > 0) {
+        return;
+    }
+    while (1) {
+        while (atomic_load(&exclusiveReaders) > 0) {
+            sched_yield();
+        }
+        atomic_fetch_add(&writeSeq, 1);
+        if (atomic_load(&exclusiveReaders) == 0) {
+            return;
+        }
+        // exclusive reader came meanwhile, let it in
+        atomic_fetch_add(&writeSeq, 1);
+    }
+}
+
+void zadbEpochWriteEnd() {
+    if (!epochReaders || --writeDepth > 0) {
+        return;
+    }
+    atomic_fetch_add(&writeSeq, 1);
+    limboFlush();
+}
+
+/*
+ * Wait until no reader is in read, for changes which can't be seen
+ * even for a moment. Only inside write section, new reads wait for end
+ * of section.
+ */
+void zadbEpochWriteBarrier() {
+    for (int i = 0; i < epochReaders; i++) {
+        while (atomic_load(&readerEpoch[i]) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Sequence of last write section, even out of section
+ */
+unsigned long long zadbEpochWriteSeq() {
+    return atomic_load(&writeSeq);
+}
+
+/*
+ * Enter read, waits while main thread is in write section
+ *
+ * reader: number of reader thread
+ *
+ * return sequence for zadbEpochReadEnd
+ */
+unsigned long long zadbEpochReadBegin(int reader) {
+    while (1) {
+        while (atomic_load(&writeSeq) & 1) {
+            sched_yield();
+        }
+        atomic_store(&readerEpoch[reader], atomic_load(&globalEpoch));
+        unsigned long long seq = atomic_load(&writeSeq);
+        if ((seq & 1) == 0) {
+            return seq;
+        }
+        atomic_store(&readerEpoch[reader], 0);
+    }
+}
+
+/*
+ * Leave read
+ *
+ * return 1 if nothing was changed during read, read must be repeated otherwise
+ */
+int zadbEpochReadEnd(int reader, unsigned long long seq) {
+    atomic_thread_fence(memory_order_acquire);
+    int ok = atomic_load(&writeSeq) == seq;
+    atomic_store(&readerEpoch[reader], 0);
+    return ok;
+}
+
+/*
+ * Ask writer to wait for end of reads, used after many repeated reads
+ */
+void zadbEpochExclusive(int on) {
+    atomic_fetch_add(&exclusiveReaders, on ? 1 : -1);
+}
@@ -0,0 +1,66 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+
+#ifndef ZADBEPOCH_H_
+#define ZADBEPOCH_H_
+
+/*
+ * Reads from reader threads while main thread writes.
+ *
+ * Main thread wraps every change of tree, keys and values into write
+ * section. Write sequence is odd inside section. Reader takes sequence
+ * before read and checks it after, read is repeated if sequence changed,
+ * so reader sees state between two write sections.
+ *
+ * Memory unlinked by writer is not freed at once: reader can still walk
+ * over it. It waits in limbo list until every reader which could see it
+ * leaves its read, then reclaim thread frees it.
+ *
+ * Reader which failed too many times asks for exclusive read, writer
+ * waits before next write section until it is done.
+ */
+
+#define ZADB_EPOCH_MAX_READERS 64
+
+int zadbEpochStart(int readers);
+int zadbEpochActive();
+
+void zadbEpochDefer(void (*fn)(void *p, size_t size), void *p, size_t size);
+void zadbEpochFree(void *p, size_t size);
+long long zadbEpochPending();
+
+void zadbEpochWriteBegin();
+void zadbEpochWriteEnd();
+void zadbEpochWriteBarrier();
+unsigned long long zadbEpochWriteSeq();
+
+unsigned long long zadbEpochReadBegin(int reader);
+int zadbEpochReadEnd(int reader, unsigned long long seq);
+void zadbEpochExclusive(int on);
+
+#endif /* ZADBEPOCH_H_ */
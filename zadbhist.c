@@ -0,0 +1,105 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <string.h>
+#include "zadbhist.h"
+
+static int histIndex(long long value) {
+    if (value < ZADB_HIST_SUB) {
+        return value < 0 ? 0 : value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb > ZADB_HIST_MAX_BITS) {
+        return ZADB_HIST_BUCKETS - 1;
+    }
+    int shift = msb - ZADB_HIST_SUB_BITS;
+    return (shift + 1) * ZADB_HIST_SUB + ((value >> shift) & (ZADB_HIST_SUB - 1));
+}
+
+/*
+ * Highest value of bucket
+ */
+static long long histValue(int index) {
+    if (index < ZADB_HIST_SUB) {
+        return index;
+    }
+    int shift = index / ZADB_HIST_SUB - 1;
+    long long low = (long long) (ZADB_HIST_SUB + index % ZADB_HIST_SUB) << shift;
+    return low + (1LL << shift) - 1;
+}
+
+void zadbHistRecord(zadbHist *hist, long long value) {
+    hist->buckets[histIndex(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/*
+ * Value below which given part of recorded values is
+ *
+ * percentile: from 0 to 1, 0.99 for p99
+ *
+ * return upper bound of bucket, at most max recorded value
+ */
+long long zadbHistPercentile(zadbHist *hist, double percentile) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    long long rank = (long long) (percentile * hist->count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    long long seen = 0;
+    for (int i = 0; i < ZADB_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            long long value = histValue(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void zadbHistReset(zadbHist *hist) {
+    memset(hist, 0, sizeof(zadbHist));
+}
+
+/*
+ * Add values of histogram from to histogram to
+ */
+void zadbHistMerge(zadbHist *to, const zadbHist *from) {
+    for (int i = 0; i < ZADB_HIST_BUCKETS; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max) {
+        to->max = from->max;
+    }
+}
@@ -0,0 +1,55 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef ZADBHIST_H_
+#define ZADBHIST_H_
+
+/*
+ * Latency histogram with buckets of fixed relative precision.
+ *
+ * Values below 16 have own bucket. Every power of two above is split
+ * into 16 buckets, so value is kept with error below 1/16. Values over
+ * 2^ZADB_HIST_MAX_BITS go to last bucket.
+ */
+
+#define ZADB_HIST_SUB_BITS 4
+#define ZADB_HIST_SUB (1 << ZADB_HIST_SUB_BITS)
+#define ZADB_HIST_MAX_BITS 40
+#define ZADB_HIST_BUCKETS ((ZADB_HIST_MAX_BITS - ZADB_HIST_SUB_BITS + 2) * ZADB_HIST_SUB)
+
+typedef struct zadbHist {
+    long long count;
+    long long sum;
+    long long max;
+    long long buckets[ZADB_HIST_BUCKETS];
+} zadbHist;
+
+void zadbHistRecord(zadbHist *hist, long long value);
+long long zadbHistPercentile(zadbHist *hist, double percentile);
+void zadbHistReset(zadbHist *hist);
+void zadbHistMerge(zadbHist *to, const zadbHist *from);
+
+#endif /* ZADBHIST_H_ */
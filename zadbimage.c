@@ -0,0 +1,464 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "zadbimage.h"
+
+#define ZADB_IMAGE_MAGIC "ZADBIMG1"
+#define ZADB_IMAGE_MAGIC_SIZE 8
+#define ZADB_IMAGE_BUFFER (1024 * 1024)
+#define ZADB_IMAGE_PATH_MAX 4096
+
+/*
+ * File: header, offsets of entries from start of file (8 bytes each),
+ * entries. Entry: header with sizes of table, key and field, their data
+ * padded to 8 bytes and value as it is in memory (see zadbValImageWrite).
+ */
+typedef struct imageHeader {
+    char magic[ZADB_IMAGE_MAGIC_SIZE];
+    unsigned long long entries;
+    ZADB_DATA_NUM seq;
+    unsigned long long size;
+} imageHeader;
+
+typedef struct imageEntryHeader {
+    ZADB_DATA_TYPE table_size;
+    ZADB_DATA_TYPE key_size;
+    ZADB_DATA_TYPE field_size;
+    ZADB_DATA_TYPE pad;
+} imageEntryHeader;
+
+typedef struct imageWriter {
+    int fd;
+    int err;
+    char *buf;
+    size_t cap;
+    size_t size;
+    off_t pos;
+} imageWriter;
+
+static char *imageData = NULL;
+static size_t imageSize = 0;
+static const unsigned long long *imageOffsets = NULL;
+static size_t imageCount = 0;
+
+/*
+ * Key and value of image entry at position
+ */
+static zadbDataVal imageEntry(size_t pos, zadbKey *ref) {
+    const char *p = imageData + imageOffsets[pos];
+    const imageEntryHeader *h = (const imageEntryHeader *) p;
+    const char *table = p + sizeof(*h);
+    const char *key = table + h->table_size;
+    const char *field = key + h->key_size;
+    zadbKeyRefInit(ref, table, h->table_size, key, h->key_size, field, h->field_size);
+    size_t data = (sizeof(*h) + h->table_size + h->key_size + h->field_size + 7) & ~(size_t) 7;
+    return (zadbDataVal) (p + data);
+}
+
+/*
+ * Position of first image entry not less than key
+ */
+static size_t imageLowerBound(zadbDataKey from) {
+    zadbKey ref;
+    size_t lo = 0, hi = imageCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        imageEntry(mid, &ref);
+        if (zadbKeyFieldCompare(&ref, from) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Map image file. Mapping is private, file is never changed.
+ *
+ * return 0 on success
+ */
+static int imageMap(const char *path, ZADB_DATA_NUM *seq) {
+    imageHeader h;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("image open failed");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h)
+            || memcmp(h.magic, ZADB_IMAGE_MAGIC, ZADB_IMAGE_MAGIC_SIZE) || h.size != size
+            || h.entries > (size - sizeof(h)) / sizeof(unsigned long long)) {
+        fprintf(stderr, "image %s is broken\n", path);
+        close(fd);
+        return 1;
+    }
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("image mmap failed");
+        return 1;
+    }
+    if (imageData != NULL) {
+        munmap(imageData, imageSize);
+    }
+    imageData = data;
+    imageSize = size;
+    imageOffsets = (const unsigned long long *) (data + sizeof(h));
+    imageCount = h.entries;
+    zadbDataSetStatic(imageData, imageSize);
+    *seq = h.seq;
+    return 0;
+}
+
+/*
+ * Open image as base layer of tree. Entries are not read, only header.
+ *
+ * seq: out number saved in image
+ *
+ * return 0 on success
+ */
+int zadbImageOpen(const char *path, ZADB_DATA_NUM *seq) {
+    return imageMap(path, seq);
+}
+
+long long zadbImageEntries() {
+    return imageCount;
+}
+
+static void imageFlush(imageWriter *w) {
+    if (w->err || w->size == 0) {
+        return;
+    }
+    size_t done = 0;
+    while (done < w->size) {
+        ssize_t n = pwrite(w->fd, w->buf + done, w->size - done, w->pos + done);
+        if (n <= 0) {
+            w->err = 1;
+            return;
+        }
+        done += n;
+    }
+    w->pos += w->size;
+    w->size = 0;
+}
+
+/*
+ * Space for size bytes in buffer of writer, buffer grows for entry
+ * bigger than it
+ *
+ * return NULL after write error, nothing is written since then
+ */
+static void *imagePut(imageWriter *w, size_t size) {
+    if (w->size + size > w->cap) {
+        imageFlush(w);
+    }
+    if (!w->err && size > w->cap) {
+        char *buf = realloc(w->buf, size);
+        if (buf == NULL) {
+            w->err = 1;
+        } else {
+            w->buf = buf;
+            w->cap = size;
+        }
+    }
+    if (w->err) {
+        return NULL;
+    }
+    void *p = w->buf + w->size;
+    w->size += size;
+    return p;
+}
+
+/*
+ * Skip to first entry of merged data at or after position of iterator.
+ * Tombstones are skipped with image entries hidden by them.
+ */
+static int iterSettle(RbtHandle tree, zadbIter *it) {
+    zadbDataKey key;
+    zadbDataVal val;
+    while (it->node != NULL || it->pos < imageCount) {
+        int cmp = 1;
+        if (it->pos < imageCount) {
+            imageEntry(it->pos, &it->ref);
+        }
+        if (it->node != NULL) {
+            rbtKeyValue(tree, it->node, (void *) &key, (void *) &val);
+            cmp = it->pos < imageCount ? zadbKeyFieldCompare(key, &it->ref) : -1;
+        }
+        if (cmp > 0) {
+            it->src = ZADB_ITER_IMAGE;
+            return 1;
+        }
+        if (!zadbValIsTombstone(val)) {
+            it->src = cmp == 0 ? ZADB_ITER_TREE | ZADB_ITER_IMAGE : ZADB_ITER_TREE;
+            return 1;
+        }
+        it->node = rbtNext(tree, it->node);
+        if (cmp == 0) {
+            it->pos++;
+        }
+    }
+    it->src = 0;
+    return 0;
+}
+
+/*
+ * Iterator functions return 1 if iterator is at entry, 0 at end
+ */
+int zadbIterBegin(RbtHandle tree, zadbIter *it) {
+    it->node = rbtBegin(tree);
+    it->pos = 0;
+    return iterSettle(tree, it);
+}
+
+int zadbIterScan(RbtHandle tree, zadbIter *it, zadbDataKey from) {
+    it->node = rbtScan(tree, from);
+    it->pos = imageCount > 0 ? imageLowerBound(from) : 0;
+    return iterSettle(tree, it);
+}
+
+int zadbIterFind(RbtHandle tree, zadbIter *it, zadbDataKey key) {
+    zadbDataKey found;
+    zadbDataVal val;
+    if (imageCount == 0) {
+        it->node = rbtFind(tree, key);
+        it->pos = 0;
+        it->src = 0;
+        if (it->node != NULL) {
+            rbtKeyValue(tree, it->node, (void *) &found, (void *) &val);
+            it->src = zadbValIsTombstone(val) ? 0 : ZADB_ITER_TREE;
+        }
+        return it->src != 0;
+    }
+    if (!zadbIterScan(tree, it, key)) {
+        return 0;
+    }
+    zadbIterKeyValue(tree, it, &found, &val);
+    if (zadbKeyFieldCompare(found, key) != 0) {
+        it->src = 0;
+        return 0;
+    }
+    return 1;
+}
+
+int zadbIterNext(RbtHandle tree, zadbIter *it) {
+    if (it->src & ZADB_ITER_TREE) {
+        it->node = rbtNext(tree, it->node);
+    }
+    if (it->src & ZADB_ITER_IMAGE) {
+        it->pos++;
+    }
+    return iterSettle(tree, it);
+}
+
+void zadbIterKeyValue(RbtHandle tree, zadbIter *it, zadbDataKey *key, zadbDataVal *val) {
+    if (it->src & ZADB_ITER_TREE) {
+        rbtKeyValue(tree, it->node, (void *) key, (void *) val);
+    } else {
+        *val = imageEntry(it->pos, &it->ref);
+        *key = &it->ref;
+    }
+}
+
+/*
+ * Copy of image key for tree
+ */
+static zadbDataKey iterKeyCopy(zadbIter *it) {
+    zadbKey *ref = &it->ref;
+    return zadbKeyNew(ref->table, ref->table_size, ref->key, ref->key_size, ref->field, ref->filed_size, 0);
+}
+
+/*
+ * Replace value of current entry, old value of tree is freed. Image entry
+ * gets changed copy in tree. Iterator must be found again after it.
+ *
+ * Functions changing the tree keep memory counters, see zadbMemEntry.
+ */
+void zadbIterUpdate(RbtHandle tree, zadbIter *it, zadbDataVal val) {
+    zadbDataKey key;
+    zadbDataVal old;
+    if (it->src & ZADB_ITER_TREE) {
+        rbtKeyValue(tree, it->node, (void *) &key, (void *) &old);
+        zadbMemValue(key, old, val);
+        rbtUpdate(tree, it->node, val);
+        zadbValFreeLazy(old);
+        return;
+    }
+    key = iterKeyCopy(it);
+    if (rbtInsert(tree, key, val, (void *) &old) != RBT_STATUS_OK) {
+        perror("error zadbIterUpdate");
+        return;
+    }
+    zadbMemEntry(key, val, 1);
+}
+
+/*
+ * Delete current entry, key and value of tree are freed. Entry which is
+ * in image is replaced by tombstone. Iterator must be found again after it.
+ */
+void zadbIterErase(RbtHandle tree, zadbIter *it) {
+    zadbDataKey key;
+    zadbDataVal val;
+    if (it->src == ZADB_ITER_TREE) {
+        rbtKeyValue(tree, it->node, (void *) &key, (void *) &val);
+        zadbMemEntry(key, val, -1);
+        rbtErase(tree, it->node);
+        zadbKeyFreeLazy(key);
+        zadbValFreeLazy(val);
+    } else if (it->src & ZADB_ITER_TREE) {
+        rbtKeyValue(tree, it->node, (void *) &key, (void *) &val);
+        zadbMemValue(key, val, zadbValTombstone());
+        rbtUpdate(tree, it->node, zadbValTombstone());
+        zadbValFreeLazy(val);
+    } else if (it->src & ZADB_ITER_IMAGE) {
+        key = iterKeyCopy(it);
+        if (rbtInsert(tree, key, zadbValTombstone(), (void *) &val) != RBT_STATUS_OK) {
+            perror("error zadbIterErase");
+        } else {
+            zadbMemEntry(key, zadbValTombstone(), 1);
+        }
+    }
+    it->src = 0;
+}
+
+/*
+ * Insert entry not found by zadbIterFind. Tree can have tombstone
+ * for the key, it is replaced and the key is freed.
+ */
+RbtStatus zadbInsert(RbtHandle tree, zadbDataKey key, zadbDataVal val) {
+    zadbDataVal old;
+    RbtStatus status = rbtInsert(tree, key, val, (void *) &old);
+    if (status == RBT_STATUS_DUPLICATE_KEY) {
+        zadbMemValue(key, old, val);
+        zadbKeyFree(key);
+        zadbValFreeLazy(old);
+        return RBT_STATUS_OK;
+    }
+    if (status == RBT_STATUS_OK) {
+        zadbMemEntry(key, val, 1);
+    }
+    return status;
+}
+
+/*
+ * Write merged data to new image, map it and empty the tree. Merge is
+ * done in place, it blocks for time of writing whole data.
+ *
+ * seq: number saved in image and returned by open
+ *
+ * return number of entries in image or -1 on error
+ */
+long long zadbImageMerge(RbtHandle tree, const char *path, ZADB_DATA_NUM seq) {
+    char tmp[ZADB_IMAGE_PATH_MAX + 8];
+    zadbIter it;
+    zadbDataKey key;
+    zadbDataVal val;
+    char *table, *k_key, *field;
+    ZADB_DATA_TYPE table_size, key_size, field_size;
+    imageHeader h;
+    unsigned long long entries = 0;
+    RbtIterator iterator;
+
+    if (strlen(path) >= ZADB_IMAGE_PATH_MAX) {
+        return -1;
+    }
+    for (int ok = zadbIterBegin(tree, &it); ok; ok = zadbIterNext(tree, &it)) {
+        entries++;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    imageWriter offsets = { open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644), 0, malloc(ZADB_IMAGE_BUFFER), ZADB_IMAGE_BUFFER, 0, sizeof(h) };
+    imageWriter data = { offsets.fd, 0, malloc(ZADB_IMAGE_BUFFER), ZADB_IMAGE_BUFFER, 0, sizeof(h) + entries * sizeof(unsigned long long) };
+    if (offsets.fd < 0 || offsets.buf == NULL || data.buf == NULL) {
+        perror("image merge open failed");
+        if (offsets.fd >= 0) {
+            close(offsets.fd);
+            unlink(tmp);
+        }
+        free(offsets.buf);
+        free(data.buf);
+        return -1;
+    }
+    for (int ok = zadbIterBegin(tree, &it); ok && !data.err && !offsets.err; ok = zadbIterNext(tree, &it)) {
+        zadbIterKeyValue(tree, &it, &key, &val);
+        zadbKeyGet(key, &table, &table_size, &k_key, &key_size, &field, &field_size);
+        size_t key_part = (sizeof(imageEntryHeader) + table_size + key_size + field_size + 7) & ~(size_t) 7;
+        size_t val_part = zadbValImageSize(val);
+        unsigned long long *offset = imagePut(&offsets, sizeof(*offset));
+        off_t entry_pos = data.pos + data.size;
+        imageEntryHeader *eh = imagePut(&data, key_part + val_part);
+        if (offset == NULL || eh == NULL) {
+            break;
+        }
+        *offset = entry_pos;
+        memset(eh, 0, key_part);
+        eh->table_size = table_size;
+        eh->key_size = key_size;
+        eh->field_size = field_size;
+        char *p = (char *) (eh + 1);
+        memcpy(p, table, table_size);
+        memcpy(p + table_size, k_key, key_size);
+        memcpy(p + table_size + key_size, field, field_size);
+        zadbValImageWrite(val, (char *) eh + key_part);
+    }
+    imageFlush(&offsets);
+    imageFlush(&data);
+    memcpy(h.magic, ZADB_IMAGE_MAGIC, ZADB_IMAGE_MAGIC_SIZE);
+    h.entries = entries;
+    h.seq = seq;
+    h.size = data.pos;
+    int err = data.err || offsets.err || pwrite(data.fd, &h, sizeof(h), 0) != sizeof(h) || fsync(data.fd) != 0;
+    free(offsets.buf);
+    free(data.buf);
+    if (close(data.fd) != 0 || err || rename(tmp, path) != 0) {
+        perror("image merge write failed");
+        unlink(tmp);
+        return -1;
+    }
+    if (imageMap(path, &seq)) {
+        return -1;
+    }
+    while ((iterator = rbtBegin(tree)) != NULL) {
+        rbtKeyValue(tree, iterator, (void *) &key, (void *) &val);
+        zadbMemEntry(key, val, -1);
+        rbtErase(tree, iterator);
+        zadbKeyFreeLazy(key);
+        zadbValFreeLazy(val);
+    }
+    return entries;
+}
@@ -0,0 +1,76 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+#include "rbtr.h"
+#include "zadbdata.h"
+
+#ifndef ZADBIMAGE_H_
+#define ZADBIMAGE_H_
+
+/*
+ * Read-only base image under the tree.
+ *
+ * Image is sorted file of entries mapped to memory, pages are read on
+ * first access, so start does not depend on size of data. Tree keeps
+ * only changes over image: new and changed entries and tombstones of
+ * deleted ones. Iterator merges both layers, entry of tree hides entry
+ * of image with the same key. Merge writes merged data to new image and
+ * empties tree.
+ *
+ * Values of image are used from mapped memory, they are static (see
+ * zadbValIsStatic): they are not freed and must not be changed in place,
+ * except mark. Numbers are in host byte order.
+ */
+
+#define ZADB_ITER_TREE 1
+#define ZADB_ITER_IMAGE 2
+
+/*
+ * Position in merged data. src is sources of current entry, 0 at end.
+ * Key of image entry is kept in ref, it is valid while iterator is.
+ */
+typedef struct zadbIter {
+    RbtIterator node;
+    size_t pos;
+    int src;
+    zadbKey ref;
+} zadbIter;
+
+int zadbImageOpen(const char *path, ZADB_DATA_NUM *seq);
+long long zadbImageEntries();
+long long zadbImageMerge(RbtHandle tree, const char *path, ZADB_DATA_NUM seq);
+
+int zadbIterBegin(RbtHandle tree, zadbIter *it);
+int zadbIterScan(RbtHandle tree, zadbIter *it, zadbDataKey from);
+int zadbIterFind(RbtHandle tree, zadbIter *it, zadbDataKey key);
+int zadbIterNext(RbtHandle tree, zadbIter *it);
+void zadbIterKeyValue(RbtHandle tree, zadbIter *it, zadbDataKey *key, zadbDataVal *val);
+void zadbIterUpdate(RbtHandle tree, zadbIter *it, zadbDataVal val);
+void zadbIterErase(RbtHandle tree, zadbIter *it);
+RbtStatus zadbInsert(RbtHandle tree, zadbDataKey key, zadbDataVal val);
+
+#endif /* ZADBIMAGE_H_ */
@@ -0,0 +1,248 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rbtr.h"
+#include "zadbindex.h"
+
+/*
+ * Entry of index, it is key in tree of index. Bound entries are used
+ * only for search: -1/1 is before/after all entries with the same value,
+ * -2/2 is before/after all entries with the same type.
+ */
+typedef struct zadbIndexEntry {
+    int type;
+    int bound;
+    ZADB_DATA_NUM num;
+    const char *str;
+    size_t str_size;
+    const char *key;
+    size_t key_size;
+    char data[];
+} zadbIndexEntry;
+
+typedef struct zadbIndexTag {
+    struct zadbIndexTag *next;
+    RbtHandle tree;
+    long long entries;
+    size_t table_size;
+    size_t field_size;
+    char *table;
+    char *field;
+} zadbIndexType;
+
+static zadbIndexType *indexes = NULL;
+
+static int compareBytes(const char *a, size_t a_size, const char *b, size_t b_size) {
+    int rc = memcmp(a, b, a_size < b_size ? a_size : b_size);
+    if (rc != 0) {
+        return rc;
+    }
+    return (a_size > b_size) - (a_size < b_size);
+}
+
+static int zadbIndexCompare(void *a, void *b) {
+    zadbIndexEntry *x = a;
+    zadbIndexEntry *y = b;
+    if (x->type != y->type) {
+        return x->type - y->type;
+    }
+    if (x->bound == -2 || x->bound == 2 || y->bound == -2 || y->bound == 2) {
+        return x->bound - y->bound;
+    }
+    int rc;
+    if (x->type == ZADB_INDEX_NUM) {
+        rc = (x->num > y->num) - (x->num < y->num);
+    } else {
+        rc = compareBytes(x->str, x->str_size, y->str, y->str_size);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    if (x->bound || y->bound) {
+        return x->bound - y->bound;
+    }
+    return compareBytes(x->key, x->key_size, y->key, y->key_size);
+}
+
+/*
+ * Create index or return existing one. New index is empty, owner of data
+ * fills it with existing values.
+ *
+ * created: out 1 if index is new
+ */
+zadbIndex zadbIndexCreate(const char *table, size_t table_size, const char *field, size_t field_size, int *created) {
+    zadbIndexType *idx = zadbIndexFind(table, table_size, field, field_size);
+    *created = 0;
+    if (idx != NULL) {
+        return idx;
+    }
+    idx = malloc(sizeof(zadbIndexType) + table_size + field_size);
+    if (idx == NULL) {
+        perror("zadbIndexCreate malloc failed");
+        return NULL;
+    }
+    idx->table = (char *) (idx + 1);
+    idx->field = idx->table + table_size;
+    memcpy(idx->table, table, table_size);
+    memcpy(idx->field, field, field_size);
+    idx->table_size = table_size;
+    idx->field_size = field_size;
+    idx->entries = 0;
+    idx->tree = rbtNew(zadbIndexCompare);
+    idx->next = indexes;
+    indexes = idx;
+    *created = 1;
+    return idx;
+}
+
+zadbIndex zadbIndexFind(const char *table, size_t table_size, const char *field, size_t field_size) {
+    for (zadbIndexType *idx = indexes; idx != NULL; idx = idx->next) {
+        if (idx->table_size == table_size && idx->field_size == field_size && !memcmp(idx->table, table, table_size) && !memcmp(idx->field, field, field_size)) {
+            return idx;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Check if any field of table is indexed, used to skip lookups of
+ * indexes on changes of not indexed tables.
+ */
+int zadbIndexHasTable(const char *table, size_t table_size) {
+    for (zadbIndexType *idx = indexes; idx != NULL; idx = idx->next) {
+        if (idx->table_size == table_size && !memcmp(idx->table, table, table_size)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void zadbIndexAdd(zadbIndex h, const char *key, size_t key_size, int type, ZADB_DATA_NUM num, const char *str, size_t str_size) {
+    zadbIndexType *idx = h;
+    void *dup;
+    if (type == ZADB_INDEX_NUM) {
+        str_size = 0;
+    }
+    zadbIndexEntry *e = malloc(sizeof(zadbIndexEntry) + key_size + str_size);
+    if (e == NULL) {
+        perror("zadbIndexAdd malloc failed");
+        return;
+    }
+    e->type = type;
+    e->bound = 0;
+    e->num = num;
+    e->key = e->data;
+    e->key_size = key_size;
+    e->str = e->data + key_size;
+    e->str_size = str_size;
+    memcpy(e->data, key, key_size);
+    if (str_size > 0) {
+        memcpy(e->data + key_size, str, str_size);
+    }
+    if (rbtInsert(idx->tree, e, NULL, &dup) != RBT_STATUS_OK) {
+        free(e);
+        return;
+    }
+    idx->entries++;
+}
+
+void zadbIndexDel(zadbIndex h, const char *key, size_t key_size, int type, ZADB_DATA_NUM num, const char *str, size_t str_size) {
+    zadbIndexType *idx = h;
+    zadbIndexEntry probe = { type, 0, num, str, type == ZADB_INDEX_STR ? str_size : 0, key, key_size };
+    void *e, *val;
+    RbtIterator it = rbtFind(idx->tree, &probe);
+    if (it == NULL) {
+        return;
+    }
+    rbtKeyValue(idx->tree, it, &e, &val);
+    rbtErase(idx->tree, it);
+    free(e);
+    idx->entries--;
+}
+
+long long zadbIndexEntries(zadbIndex h) {
+    zadbIndexType *idx = h;
+    return idx->entries;
+}
+
+static void zadbIndexBoundEntry(zadbIndexEntry *e, const zadbIndexBound *b, int upper) {
+    memset(e, 0, sizeof(zadbIndexEntry));
+    e->type = b->type;
+    if (b->open) {
+        e->bound = upper ? 2 : -2;
+        return;
+    }
+    e->num = b->num;
+    e->str = b->str;
+    e->str_size = b->str_size;
+    if (upper) {
+        e->bound = b->exclusive ? -1 : 1;
+    } else {
+        e->bound = b->exclusive ? 1 : -1;
+    }
+}
+
+/*
+ * Walk over entries between bounds and call callback for every entry.
+ *
+ * reverse: walk from upper bound down
+ * limit: max number of entries, 0 - no limit
+ *
+ * return number of entries
+ */
+long long zadbIndexQuery(zadbIndex h, const zadbIndexBound *from, const zadbIndexBound *to, int reverse, long long limit, zadbIndexCallback callback, void *ctx) {
+    zadbIndexType *idx = h;
+    zadbIndexEntry lower, upper;
+    zadbIndexEntry *e;
+    void *val;
+    long long count = 0;
+
+    zadbIndexBoundEntry(&lower, from, 0);
+    zadbIndexBoundEntry(&upper, to, 1);
+    if (zadbIndexCompare(&lower, &upper) > 0) {
+        return 0;
+    }
+    RbtIterator it;
+    if (reverse) {
+        it = rbtScan(idx->tree, &upper);
+        it = it != NULL ? rbtPrev(idx->tree, it) : rbtLast(idx->tree);
+    } else {
+        it = rbtScan(idx->tree, &lower);
+    }
+    while (it != NULL && (limit == 0 || count < limit)) {
+        rbtKeyValue(idx->tree, it, (void *) &e, &val);
+        if (reverse ? zadbIndexCompare(e, &lower) < 0 : zadbIndexCompare(e, &upper) > 0) {
+            break;
+        }
+        callback(ctx, e->key, e->key_size, e->type, e->num, e->str, e->str_size);
+        count++;
+        it = reverse ? rbtPrev(idx->tree, it) : rbtNext(idx->tree, it);
+    }
+    return count;
+}
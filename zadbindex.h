@@ -0,0 +1,72 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+#include "zadbdata.h"
+
+#ifndef ZADBINDEX_H_
+#define ZADBINDEX_H_
+
+/*
+ * Secondary indexes on declared fields of hashes.
+ *
+ * Index is ordered by value of field, then by key of hash. Numbers are
+ * ordered before strings, numbers by value, strings byte by byte.
+ * Index is kept in its own red-black tree and is updated by owner of
+ * data on every change of indexed field.
+ */
+
+#define ZADB_INDEX_NUM 0
+#define ZADB_INDEX_STR 1
+
+typedef void *zadbIndex;
+
+/*
+ * Bound of range query. Open bound has only type, range goes to the
+ * first or last value of this type.
+ */
+typedef struct zadbIndexBound {
+    int open;
+    int exclusive;
+    int type;
+    ZADB_DATA_NUM num;
+    const char *str;
+    size_t str_size;
+} zadbIndexBound;
+
+typedef void (*zadbIndexCallback)(void *ctx, const char *key, size_t key_size, int type, ZADB_DATA_NUM num, const char *str, size_t str_size);
+
+zadbIndex zadbIndexCreate(const char *table, size_t table_size, const char *field, size_t field_size, int *created);
+zadbIndex zadbIndexFind(const char *table, size_t table_size, const char *field, size_t field_size);
+int zadbIndexHasTable(const char *table, size_t table_size);
+
+void zadbIndexAdd(zadbIndex idx, const char *key, size_t key_size, int type, ZADB_DATA_NUM num, const char *str, size_t str_size);
+void zadbIndexDel(zadbIndex idx, const char *key, size_t key_size, int type, ZADB_DATA_NUM num, const char *str, size_t str_size);
+
+long long zadbIndexQuery(zadbIndex idx, const zadbIndexBound *from, const zadbIndexBound *to, int reverse, long long limit, zadbIndexCallback callback, void *ctx);
+long long zadbIndexEntries(zadbIndex idx);
+
+#endif /* ZADBINDEX_H_ */
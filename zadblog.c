@@ -0,0 +1,728 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "zadblog.h"
+#include "zadbimage.h"
+
+#define ZADB_LOG_MAGIC "ZADBLOG1"
+#define ZADB_LOG_MAGIC_SIZE 8
+#define ZADB_LOG_SEGMENT_SIZE (64LL * 1024 * 1024)
+#define ZADB_LOG_REWRITE_MIN (64LL * 1024 * 1024)
+#define ZADB_LOG_REWRITE_BUFFER (1024 * 1024)
+#define ZADB_LOG_PATH_MAX 4096
+
+/*
+ * Record: op (1 byte), sizes of table, key, field and string value
+ * (2 bytes each), data, number (8 bytes, only for integer value and
+ * clear), crc32 of all before (4 bytes). Numbers are in host byte order.
+ */
+#define LOG_HEADER_SIZE 9
+#define LOG_CRC_SIZE 4
+
+enum {
+    LOG_SET_STR = 1, LOG_SET_INT, LOG_DEL, LOG_DEL_ALL, LOG_CLEAR
+};
+
+static char logPath[ZADB_LOG_PATH_MAX];
+static int logFd = -1;
+static int logFsyncMs = ZADB_LOG_FSYNC_DEFAULT_MS;
+static int logDirty = 0;
+
+static char *logBuf = NULL;
+static size_t logBufSize = 0;
+static size_t logBufCap = 0;
+
+static long long logSegment = 1;
+static long long logFirstSegment = 1;
+static long long logSegmentBytes = 0;
+static long long logBytes = 0;
+static long long logBaseBytes = 0;
+
+static pid_t rewritePid = -1;
+static long long rewriteSegment = 0;
+
+static pthread_mutex_t logFdLock = PTHREAD_MUTEX_INITIALIZER;
+
+static zadbLogStat logStat;
+
+/*
+ * Receiver of committed records besides log file (replication)
+ */
+static void (*logFeed)(const char *data, size_t size) = NULL;
+
+static unsigned int crcTable[256];
+
+unsigned int zadbCrc32(unsigned int crc, const void *data, size_t size) {
+    const unsigned char *p = data;
+    if (crcTable[1] == 0) {
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            crcTable[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (size--) {
+        crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void logSegmentName(char *out, size_t size, long long segment, const char *suffix) {
+    snprintf(out, size, "%s.%lld%s", logPath, segment, suffix);
+}
+
+static int logWriteAll(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("log write failed");
+            return 1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void logReserve(size_t need) {
+    if (logBufSize + need <= logBufCap) {
+        return;
+    }
+    size_t cap = logBufCap ? logBufCap : 65536;
+    while (cap < logBufSize + need) {
+        cap *= 2;
+    }
+    char *buf = realloc(logBuf, cap);
+    if (buf == NULL) {
+        perror("log buffer realloc failed");
+        exit(1);
+    }
+    logBuf = buf;
+    logBufCap = cap;
+}
+
+static void logAppend(int op, const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, const char *val, size_t val_size, ZADB_DATA_NUM num) {
+    ZADB_DATA_TYPE sizes[4] = { table_size, key_size, field_size, val_size };
+    size_t need = LOG_HEADER_SIZE + table_size + key_size + field_size + val_size + sizeof(num) + LOG_CRC_SIZE;
+    logReserve(need);
+    char *start = logBuf + logBufSize;
+    char *p = start;
+    *p++ = op;
+    memcpy(p, sizes, sizeof(sizes));
+    p += sizeof(sizes);
+    if (table_size) {
+        memcpy(p, table, table_size);
+        p += table_size;
+    }
+    if (key_size) {
+        memcpy(p, key, key_size);
+        p += key_size;
+    }
+    if (field_size) {
+        memcpy(p, field, field_size);
+        p += field_size;
+    }
+    if (val_size) {
+        memcpy(p, val, val_size);
+        p += val_size;
+    }
+    if (op == LOG_SET_INT || op == LOG_CLEAR) {
+        memcpy(p, &num, sizeof(num));
+        p += sizeof(num);
+    }
+    unsigned int crc = zadbCrc32(0, start, p - start);
+    memcpy(p, &crc, LOG_CRC_SIZE);
+    p += LOG_CRC_SIZE;
+    logBufSize += p - start;
+    logStat.records++;
+}
+
+static int logOpenSegment(long long segment) {
+    char name[ZADB_LOG_PATH_MAX + 32];
+    logSegmentName(name, sizeof(name), segment, "");
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("log segment open failed");
+        return -1;
+    }
+    if (logWriteAll(fd, ZADB_LOG_MAGIC, ZADB_LOG_MAGIC_SIZE)) {
+        close(fd);
+        return -1;
+    }
+    logSegmentBytes = ZADB_LOG_MAGIC_SIZE;
+    logBytes += ZADB_LOG_MAGIC_SIZE;
+    return fd;
+}
+
+/*
+ * Close current segment and start next one
+ */
+static void logRotate() {
+    int fd = logOpenSegment(logSegment + 1);
+    if (fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&logFdLock);
+    if (logFsyncMs != ZADB_LOG_FSYNC_NEVER) {
+        fdatasync(logFd);
+    }
+    close(logFd);
+    logFd = fd;
+    logSegment++;
+    pthread_mutex_unlock(&logFdLock);
+}
+
+/*
+ * Sync thread for interval policy, written data is synced every
+ * logFsyncMs, main thread does not wait for disk.
+ */
+static void *zadbLogSyncThread(void *arg) {
+    while (1) {
+        usleep(logFsyncMs * 1000);
+        if (!__atomic_exchange_n(&logDirty, 0, __ATOMIC_ACQ_REL)) {
+            continue;
+        }
+        pthread_mutex_lock(&logFdLock);
+        if (logFd >= 0) {
+            fdatasync(logFd);
+        }
+        pthread_mutex_unlock(&logFdLock);
+        __atomic_add_fetch(&logStat.fsyncs, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Find numbers of first and last segments, remove not finished rewrites
+ *
+ * return 0 if there is no segments
+ */
+static int logFindSegments(long long *first, long long *last) {
+    char dir[ZADB_LOG_PATH_MAX];
+    const char *base = strrchr(logPath, '/');
+    if (base == NULL) {
+        strcpy(dir, ".");
+        base = logPath;
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int) (base - logPath), logPath);
+        base++;
+    }
+    size_t base_size = strlen(base);
+    DIR *d = opendir(dir[0] ? dir : "/");
+    if (d == NULL) {
+        return 0;
+    }
+    int found = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, base, base_size) || e->d_name[base_size] != '.') {
+            continue;
+        }
+        char *end;
+        long long n = strtoll(e->d_name + base_size + 1, &end, 10);
+        if (end == e->d_name + base_size + 1 || n < 1) {
+            continue;
+        }
+        if (!strcmp(end, ".tmp")) {
+            char name[ZADB_LOG_PATH_MAX + 32];
+            logSegmentName(name, sizeof(name), n, ".tmp");
+            unlink(name);
+            continue;
+        }
+        if (*end != '\0') {
+            continue;
+        }
+        if (!found || n < *first) {
+            *first = n;
+        }
+        if (!found || n > *last) {
+            *last = n;
+        }
+        found = 1;
+    }
+    closedir(d);
+    return found;
+}
+
+/*
+ * Apply complete records from start of buffer. Records are the same in
+ * log segments and in replication stream.
+ *
+ * broken: out 1 if record with wrong crc is found, apply stops on it
+ *
+ * return size of applied records
+ */
+size_t zadbLogApplyRecords(const char *data, size_t size, const zadbLogApply *apply, int *broken) {
+    size_t pos = 0;
+    *broken = 0;
+    while (pos + LOG_HEADER_SIZE + LOG_CRC_SIZE <= size) {
+        const char *p = data + pos;
+        ZADB_DATA_TYPE sizes[4];
+        ZADB_DATA_NUM num = 0;
+        unsigned int crc;
+        int op = p[0];
+        memcpy(sizes, p + 1, sizeof(sizes));
+        size_t need = LOG_HEADER_SIZE + sizes[0] + sizes[1] + sizes[2] + sizes[3];
+        if (op == LOG_SET_INT || op == LOG_CLEAR) {
+            need += sizeof(num);
+        }
+        if (pos + need + LOG_CRC_SIZE > size) {
+            break;
+        }
+        memcpy(&crc, p + need, LOG_CRC_SIZE);
+        if (crc != zadbCrc32(0, p, need)) {
+            *broken = 1;
+            break;
+        }
+        if (op == LOG_SET_INT || op == LOG_CLEAR) {
+            memcpy(&num, p + need - sizeof(num), sizeof(num));
+        }
+        const char *table = p + LOG_HEADER_SIZE;
+        const char *key = table + sizes[0];
+        const char *field = key + sizes[1];
+        const char *val = field + sizes[2];
+        switch (op) {
+        case LOG_SET_STR:
+            apply->setStr(table, sizes[0], key, sizes[1], field, sizes[2], val, sizes[3]);
+            break;
+        case LOG_SET_INT:
+            apply->setInt(table, sizes[0], key, sizes[1], field, sizes[2], num);
+            break;
+        case LOG_DEL:
+            apply->del(table, sizes[0], key, sizes[1], field, sizes[2]);
+            break;
+        case LOG_DEL_ALL:
+            apply->delAll(table, sizes[0], key, sizes[1]);
+            break;
+        case LOG_CLEAR:
+            apply->clear(num);
+            break;
+        }
+        logStat.replayed++;
+        pos += need + LOG_CRC_SIZE;
+    }
+    return pos;
+}
+
+/*
+ * Apply all records of segment. Not complete record at the end of last
+ * segment is left by crash, it is cut off.
+ *
+ * return size of segment
+ */
+static long long logReplaySegment(long long segment, const zadbLogApply *apply, int last) {
+    char name[ZADB_LOG_PATH_MAX + 32];
+    struct stat st;
+    logSegmentName(name, sizeof(name), segment, "");
+    int fd = open(name, O_RDWR);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < ZADB_LOG_MAGIC_SIZE) {
+        fprintf(stderr, "log segment %s is empty\n", name);
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("log segment mmap failed");
+        close(fd);
+        return 0;
+    }
+    if (memcmp(data, ZADB_LOG_MAGIC, ZADB_LOG_MAGIC_SIZE)) {
+        fprintf(stderr, "log segment %s has wrong format\n", name);
+        munmap(data, size);
+        close(fd);
+        return 0;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    int broken = 0;
+    size_t pos = ZADB_LOG_MAGIC_SIZE;
+    pos += zadbLogApplyRecords(data + pos, size - pos, apply, &broken);
+    munmap(data, size);
+    if (pos < size) {
+        fprintf(stderr, "log segment %s is broken at %zu of %zu\n", name, pos, size);
+        if (last && ftruncate(fd, pos) != 0) {
+            perror("log segment truncate failed");
+        }
+    }
+    close(fd);
+    return pos;
+}
+
+/*
+ * Replay existing log and open new segment for writing
+ *
+ * fsync_ms: ZADB_LOG_FSYNC_ALWAYS, ZADB_LOG_FSYNC_NEVER or interval in ms
+ *
+ * return 0 on success
+ */
+int zadbLogOpen(const char *path, int fsync_ms, const zadbLogApply *apply) {
+    long long first = 0, last = 0;
+    if (strlen(path) >= ZADB_LOG_PATH_MAX) {
+        fprintf(stderr, "log path is too long\n");
+        return 1;
+    }
+    strcpy(logPath, path);
+    logFsyncMs = fsync_ms;
+    logBytes = 0;
+    if (logFindSegments(&first, &last)) {
+        for (long long n = first; n <= last; n++) {
+            logBytes += logReplaySegment(n, apply, n == last);
+        }
+        logFirstSegment = first;
+        logSegment = last + 1;
+    }
+    logFd = logOpenSegment(logSegment);
+    if (logFd < 0) {
+        return 1;
+    }
+    logBaseBytes = logBytes;
+    if (logFsyncMs > 0) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, zadbLogSyncThread, NULL) != 0) {
+            perror("pthread_create failed");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+int zadbLogEnabled() {
+    return logFd >= 0;
+}
+
+/*
+ * Records are made if there is log file or feed
+ */
+static int logRecording() {
+    return logFd >= 0 || logFeed != NULL;
+}
+
+/*
+ * Set receiver of committed records, NULL to stop
+ */
+void zadbLogSetFeed(void (*feed)(const char *data, size_t size)) {
+    logFeed = feed;
+}
+
+void zadbLogSetStr(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, const char *val, size_t val_size) {
+    if (logRecording()) {
+        logAppend(LOG_SET_STR, table, table_size, key, key_size, field, field_size, val, val_size, 0);
+    }
+}
+
+void zadbLogSetInt(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, ZADB_DATA_NUM num) {
+    if (logRecording()) {
+        logAppend(LOG_SET_INT, table, table_size, key, key_size, field, field_size, NULL, 0, num);
+    }
+}
+
+void zadbLogDel(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size) {
+    if (logRecording()) {
+        logAppend(LOG_DEL, table, table_size, key, key_size, field, field_size, NULL, 0, 0);
+    }
+}
+
+void zadbLogDelAll(const char *table, size_t table_size, const char *key, size_t key_size) {
+    if (logRecording()) {
+        logAppend(LOG_DEL_ALL, table, table_size, key, key_size, NULL, 0, NULL, 0, 0);
+    }
+}
+
+/*
+ * Write records of finished request. All records buffered since last
+ * commit are written with one write and synced together.
+ */
+void zadbLogCommit() {
+    if (logBufSize == 0) {
+        return;
+    }
+    if (logFeed != NULL) {
+        logFeed(logBuf, logBufSize);
+    }
+    if (logFd < 0) {
+        logBufSize = 0;
+        return;
+    }
+    logWriteAll(logFd, logBuf, logBufSize);
+    logSegmentBytes += logBufSize;
+    logBytes += logBufSize;
+    logBufSize = 0;
+    logStat.commits++;
+    if (logFsyncMs == ZADB_LOG_FSYNC_ALWAYS) {
+        fdatasync(logFd);
+        logStat.fsyncs++;
+    } else if (logFsyncMs > 0) {
+        __atomic_store_n(&logDirty, 1, __ATOMIC_RELEASE);
+    }
+    if (logSegmentBytes >= ZADB_LOG_SEGMENT_SIZE) {
+        logRotate();
+    }
+}
+
+/*
+ * Write clear record and records of all entries by parts, used in forked
+ * process. Tree is written merged with base image or as it is, then
+ * tombstones are written as deletes.
+ *
+ * return 0 on success
+ */
+int zadbLogWriteTree(RbtHandle tree, ZADB_DATA_NUM seq, int merged, int (*write)(void *ctx, const char *data, size_t size), void *ctx) {
+    char *table, *key, *field, *val;
+    ZADB_DATA_TYPE table_size, key_size, field_size, val_size;
+    ZADB_DATA_NUM num;
+    int isStr;
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    zadbIter it;
+    int found;
+
+    logBufSize = 0;
+    logAppend(LOG_CLEAR, NULL, 0, NULL, 0, NULL, 0, NULL, 0, seq);
+    RbtIterator iterator = NULL;
+    if (merged) {
+        found = zadbIterBegin(tree, &it);
+    } else {
+        iterator = rbtBegin(tree);
+        found = iterator != NULL;
+    }
+    while (found) {
+        if (merged) {
+            zadbIterKeyValue(tree, &it, &zdbkey, &zdbval);
+        } else {
+            rbtKeyValue(tree, iterator, (void *) &zdbkey, (void *) &zdbval);
+        }
+        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+        zadbValGet(zdbval, &val, &val_size, &num, &isStr);
+        if (zadbValIsTombstone(zdbval)) {
+            logAppend(LOG_DEL, table, table_size, key, key_size, field, field_size, NULL, 0, 0);
+        } else if (isStr) {
+            logAppend(LOG_SET_STR, table, table_size, key, key_size, field, field_size, val, val != NULL ? val_size : 0, 0);
+        } else {
+            logAppend(LOG_SET_INT, table, table_size, key, key_size, field, field_size, NULL, 0, num);
+        }
+        if (logBufSize >= ZADB_LOG_REWRITE_BUFFER) {
+            if (write(ctx, logBuf, logBufSize)) {
+                return 1;
+            }
+            logBufSize = 0;
+        }
+        if (merged) {
+            found = zadbIterNext(tree, &it);
+        } else {
+            iterator = rbtNext(tree, iterator);
+            found = iterator != NULL;
+        }
+    }
+    int err = logBufSize > 0 && write(ctx, logBuf, logBufSize);
+    logBufSize = 0;
+    return err;
+}
+
+static int logWriteFd(void *ctx, const char *data, size_t size) {
+    return logWriteAll(*(int *) ctx, data, size);
+}
+
+/*
+ * Write whole tree to segment file in forked process
+ *
+ * return 0 on success
+ */
+static int logWriteSnapshot(RbtHandle tree, long long segment, ZADB_DATA_NUM seq) {
+    char name[ZADB_LOG_PATH_MAX + 32];
+    logSegmentName(name, sizeof(name), segment, ".tmp");
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("log rewrite open failed");
+        return 1;
+    }
+    if (logWriteAll(fd, ZADB_LOG_MAGIC, ZADB_LOG_MAGIC_SIZE) || zadbLogWriteTree(tree, seq, 0, logWriteFd, &fd) || fsync(fd) != 0) {
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Start rewrite of log. Current segment is closed, forked process writes
+ * whole tree to replacement of it, new records go to next segment.
+ *
+ * seq: number saved in snapshot, it is given back to clear on replay
+ *
+ * return 0 if rewrite is started
+ */
+int zadbLogRewrite(RbtHandle tree, ZADB_DATA_NUM seq) {
+    if (logFd < 0 || rewritePid > 0) {
+        return 1;
+    }
+    zadbLogCommit();
+    rewriteSegment = logSegment;
+    logRotate();
+    if (logSegment == rewriteSegment) {
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("log rewrite fork failed");
+        return 1;
+    }
+    if (pid == 0) {
+        _exit(logWriteSnapshot(tree, rewriteSegment, seq));
+    }
+    rewritePid = pid;
+    return 0;
+}
+
+static void logRewriteDone(int status) {
+    char name[ZADB_LOG_PATH_MAX + 32], tmp[ZADB_LOG_PATH_MAX + 32];
+    struct stat st;
+    rewritePid = -1;
+    logSegmentName(tmp, sizeof(tmp), rewriteSegment, ".tmp");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "log rewrite failed\n");
+        unlink(tmp);
+        return;
+    }
+    logSegmentName(name, sizeof(name), rewriteSegment, "");
+    if (rename(tmp, name) != 0) {
+        perror("log rewrite rename failed");
+        unlink(tmp);
+        return;
+    }
+    for (long long n = logFirstSegment; n < rewriteSegment; n++) {
+        logSegmentName(name, sizeof(name), n, "");
+        unlink(name);
+    }
+    logFirstSegment = rewriteSegment;
+    logBytes = 0;
+    for (long long n = logFirstSegment; n <= logSegment; n++) {
+        logSegmentName(name, sizeof(name), n, "");
+        if (stat(name, &st) == 0) {
+            logBytes += st.st_size;
+        }
+    }
+    logBaseBytes = logBytes;
+    logStat.rewrites++;
+}
+
+/*
+ * Periodic work of log: finish of rewrite and start of rewrite when log
+ * is twice bigger than after last rewrite.
+ */
+void zadbLogTick(RbtHandle tree, ZADB_DATA_NUM seq) {
+    if (logFd < 0) {
+        return;
+    }
+    if (rewritePid > 0) {
+        int status;
+        if (waitpid(rewritePid, &status, WNOHANG) == rewritePid) {
+            logRewriteDone(status);
+        }
+    } else if (logBytes > ZADB_LOG_REWRITE_MIN && logBytes > 2 * logBaseBytes) {
+        zadbLogRewrite(tree, seq);
+    }
+}
+
+/*
+ * All data is saved elsewhere (merged to image). Start new segment with
+ * clear record and remove older segments, running rewrite is dropped.
+ *
+ * return 0 on success
+ */
+int zadbLogReset(ZADB_DATA_NUM seq) {
+    char name[ZADB_LOG_PATH_MAX + 32];
+    if (logFd < 0) {
+        return 0;
+    }
+    if (rewritePid > 0) {
+        int status;
+        kill(rewritePid, SIGKILL);
+        waitpid(rewritePid, &status, 0);
+        rewritePid = -1;
+        logSegmentName(name, sizeof(name), rewriteSegment, ".tmp");
+        unlink(name);
+    }
+    zadbLogCommit();
+    long long last = logSegment;
+    logRotate();
+    if (logSegment == last) {
+        return 1;
+    }
+    // data is not changed, so clear is not given to feed
+    logAppend(LOG_CLEAR, NULL, 0, NULL, 0, NULL, 0, NULL, 0, seq);
+    int err = logWriteAll(logFd, logBuf, logBufSize);
+    logSegmentBytes += logBufSize;
+    logBytes += logBufSize;
+    logBufSize = 0;
+    pthread_mutex_lock(&logFdLock);
+    err = err || fdatasync(logFd);
+    pthread_mutex_unlock(&logFdLock);
+    if (err != 0) {
+        perror("log reset sync failed");
+        return 1;
+    }
+    for (long long n = logFirstSegment; n <= last; n++) {
+        logSegmentName(name, sizeof(name), n, "");
+        unlink(name);
+    }
+    logFirstSegment = logSegment;
+    logBytes = logSegmentBytes;
+    logBaseBytes = logBytes;
+    return 0;
+}
+
+void zadbLogGetStat(zadbLogStat *stat) {
+    *stat = logStat;
+    stat->fsyncs = __atomic_load_n(&logStat.fsyncs, __ATOMIC_RELAXED);
+    stat->first_segment = logFirstSegment;
+    stat->segment = logSegment;
+    stat->bytes = logBytes;
+    stat->base_bytes = logBaseBytes;
+    stat->rewrite_running = rewritePid > 0;
+}
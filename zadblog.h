@@ -0,0 +1,95 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+#include "rbtr.h"
+#include "zadbdata.h"
+
+#ifndef ZADBLOG_H_
+#define ZADBLOG_H_
+
+/*
+ * Append-only log of tree mutations.
+ *
+ * Log is set of segment files <path>.<number>, they are replayed in
+ * order of numbers at start. Records of one request are buffered and
+ * written together on commit. Fsync is done on every commit, every N ms
+ * by sync thread or never.
+ *
+ * Rewrite writes whole tree to new segment in forked process, first record
+ * of such segment clears data, so older segments are removed after it.
+ * Tree over base image is written with tombstones as deletes.
+ */
+
+#define ZADB_LOG_FSYNC_ALWAYS 0
+#define ZADB_LOG_FSYNC_NEVER -1
+#define ZADB_LOG_FSYNC_DEFAULT_MS 1000
+
+/*
+ * Functions to apply records on replay
+ */
+typedef struct zadbLogApply {
+    void (*setStr)(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, const char *val, size_t val_size);
+    void (*setInt)(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, ZADB_DATA_NUM num);
+    void (*del)(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size);
+    void (*delAll)(const char *table, size_t table_size, const char *key, size_t key_size);
+    void (*clear)(ZADB_DATA_NUM seq);
+} zadbLogApply;
+
+typedef struct zadbLogStat {
+    long long records;
+    long long commits;
+    long long fsyncs;
+    long long rewrites;
+    long long replayed;
+    long long first_segment;
+    long long segment;
+    long long bytes;
+    long long base_bytes;
+    int rewrite_running;
+} zadbLogStat;
+
+int zadbLogOpen(const char *path, int fsync_ms, const zadbLogApply *apply);
+int zadbLogEnabled();
+
+void zadbLogSetStr(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, const char *val, size_t val_size);
+void zadbLogSetInt(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size, ZADB_DATA_NUM num);
+void zadbLogDel(const char *table, size_t table_size, const char *key, size_t key_size, const char *field, size_t field_size);
+void zadbLogDelAll(const char *table, size_t table_size, const char *key, size_t key_size);
+
+void zadbLogCommit();
+void zadbLogTick(RbtHandle tree, ZADB_DATA_NUM seq);
+int zadbLogRewrite(RbtHandle tree, ZADB_DATA_NUM seq);
+int zadbLogReset(ZADB_DATA_NUM seq);
+int zadbLogWriteTree(RbtHandle tree, ZADB_DATA_NUM seq, int merged, int (*write)(void *ctx, const char *data, size_t size), void *ctx);
+size_t zadbLogApplyRecords(const char *data, size_t size, const zadbLogApply *apply, int *broken);
+void zadbLogSetFeed(void (*feed)(const char *data, size_t size));
+
+void zadbLogGetStat(zadbLogStat *stat);
+
+unsigned int zadbCrc32(unsigned int crc, const void *data, size_t size);
+
+#endif /* ZADBLOG_H_ */
@@ -0,0 +1,192 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zadbprof.h"
+
+#define PROF_HASH_SEED 14695981039346656037UL
+#define PROF_TABLE_MIN 256
+
+typedef struct profEntry {
+    struct profEntry *next;  // hash chain
+    unsigned long hash;
+    long long count;
+    long long ns;
+    size_t size;
+    char key[];
+} profEntry;
+
+typedef struct profTable {
+    profEntry **buckets;
+    size_t size;
+    size_t count;
+} profTable;
+
+static int profActive = 0;
+static profTable profStacks = { NULL, 0, 0 };
+static profTable profCalls = { NULL, 0, 0 };
+
+static unsigned long profHash(const char *data, size_t size) {
+    unsigned long hash = PROF_HASH_SEED;
+    while (size--) {
+        hash ^= (unsigned char) *data++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static int profGrow(profTable *table) {
+    size_t size = table->size ? table->size * 2 : PROF_TABLE_MIN;
+    profEntry **buckets = calloc(size, sizeof(profEntry *));
+    if (buckets == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < table->size; i++) {
+        profEntry *entry = table->buckets[i];
+        while (entry != NULL) {
+            profEntry *next = entry->next;
+            entry->next = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+    return 0;
+}
+
+/*
+ * Find entry of key, new entry is added
+ *
+ * return entry or NULL if there is no memory
+ */
+static profEntry *profGet(profTable *table, const char *key, size_t size) {
+    unsigned long hash = profHash(key, size);
+    if (table->size > 0) {
+        profEntry *entry = table->buckets[hash & (table->size - 1)];
+        while (entry != NULL) {
+            if (entry->hash == hash && entry->size == size && memcmp(entry->key, key, size) == 0) {
+                return entry;
+            }
+            entry = entry->next;
+        }
+    }
+    if (table->count >= table->size && profGrow(table)) {
+        return NULL;
+    }
+    profEntry *entry = malloc(sizeof(profEntry) + size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->count = 0;
+    entry->ns = 0;
+    entry->size = size;
+    memcpy(entry->key, key, size);
+    entry->next = table->buckets[hash & (table->size - 1)];
+    table->buckets[hash & (table->size - 1)] = entry;
+    table->count++;
+    return entry;
+}
+
+static void profClear(profTable *table) {
+    for (size_t i = 0; i < table->size; i++) {
+        profEntry *entry = table->buckets[i];
+        while (entry != NULL) {
+            profEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+static void profVisit(profTable *table, zadbProfVisit visit, void *ctx) {
+    for (size_t i = 0; i < table->size; i++) {
+        for (profEntry *entry = table->buckets[i]; entry != NULL; entry = entry->next) {
+            visit(entry->key, entry->size, entry->count, entry->ns, ctx);
+        }
+    }
+}
+
+/*
+ * Start counting, counters of previous run are kept until reset
+ */
+void zadbProfStart() {
+    profActive = 1;
+}
+
+void zadbProfStop() {
+    profActive = 0;
+}
+
+int zadbProfActive() {
+    return profActive;
+}
+
+void zadbProfReset() {
+    profClear(&profStacks);
+    profClear(&profCalls);
+}
+
+/*
+ * Count sampled stack
+ *
+ * weight: lua instructions since last sample
+ */
+void zadbProfSample(const char *stack, size_t size, long long weight) {
+    profEntry *entry = profGet(&profStacks, stack, size);
+    if (entry != NULL) {
+        entry->count += weight;
+    }
+}
+
+/*
+ * Count call of za_db function
+ *
+ * ns: time of call in nanoseconds
+ */
+void zadbProfCall(const char *name, size_t size, long long ns) {
+    profEntry *entry = profGet(&profCalls, name, size);
+    if (entry != NULL) {
+        entry->count++;
+        entry->ns += ns;
+    }
+}
+
+void zadbProfStacks(zadbProfVisit visit, void *ctx) {
+    profVisit(&profStacks, visit, ctx);
+}
+
+void zadbProfCalls(zadbProfVisit visit, void *ctx) {
+    profVisit(&profCalls, visit, ctx);
+}
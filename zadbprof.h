@@ -0,0 +1,51 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+
+#ifndef ZADBPROF_H_
+#define ZADBPROF_H_
+
+/*
+ * Counters of profiler. Stacks are sampled lua stacks in folded format,
+ * frames from root separated by ';'. Calls are za_db functions by name
+ * and table with their time. Nothing is counted while profiler is off.
+ */
+
+typedef void (*zadbProfVisit)(const char *key, size_t size, long long count, long long ns, void *ctx);
+
+void zadbProfStart();
+void zadbProfStop();
+int zadbProfActive();
+void zadbProfReset();
+
+void zadbProfSample(const char *stack, size_t size, long long weight);
+void zadbProfCall(const char *name, size_t size, long long ns);
+
+void zadbProfStacks(zadbProfVisit visit, void *ctx);
+void zadbProfCalls(zadbProfVisit visit, void *ctx);
+
+#endif /* ZADBPROF_H_ */
@@ -0,0 +1,543 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "zadbrepl.h"
+
+#define ZADB_REPL_BUFFER_MAX (256LL * 1024 * 1024)
+#define ZADB_REPL_RECONNECT_MS 1000
+#define ZADB_REPL_READ_SIZE 65536
+#define ZADB_REPL_HOST_MAX 256
+
+/*
+ * Frame of stream: header and records of log. Snapshot frames are sent
+ * by child during full sync, sync end frame has offset of stream where
+ * snapshot was taken. Ping is sent every tick when there is no data.
+ *
+ * offset: stream offset after the frame
+ * master: stream offset of master when the frame was sent, it is set in
+ * the first unsent frame by every flush, so replica sees how much data is
+ * still queued behind the frame
+ */
+enum {
+    REPL_SNAPSHOT = 1, REPL_SYNC_END, REPL_DATA, REPL_PING
+};
+
+typedef struct replFrame {
+    int type;
+    unsigned int size;
+    long long offset;
+    long long master;
+    long long time_ms;
+} replFrame;
+
+/*
+ * Replica connected to this master. Frames wait in out buffer while
+ * child sends snapshot or socket is full.
+ */
+typedef struct replReplica {
+    int fd;
+    pid_t pid;
+    char *out;
+    size_t size;
+    size_t cap;
+    size_t sent;
+    size_t frame;     // start of a frame at or after sent
+    long long ack;
+    long long lag_ms;
+    struct replReplica *next;
+} replReplica;
+
+static replReplica *replicas = NULL;
+static long long replOffset = 0;
+static long long replFullSyncs = 0;
+static long long replLastTick = 0;
+
+/*
+ * State of this process as replica
+ */
+static int replIsReplica = 0;
+static char replHost[ZADB_REPL_HOST_MAX];
+static int replPort = 0;
+static const zadbLogApply *replApply = NULL;
+static int replFd = -1;
+static int replSynced = 0;
+static char *replIn = NULL;
+static size_t replInSize = 0;
+static size_t replInCap = 0;
+static long long replApplied = 0;
+static long long replMasterOffset = 0;
+static long long replLagMs = 0;
+static long long replLastConnect = 0;
+
+/*
+ * Child of full sync
+ */
+static int replChildFd = -1;
+static long long replChildOffset = 0;
+
+static long long replNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int replSendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Put frame to out buffer of replica
+ *
+ * return 0 on success, 1 if buffer is over limit
+ */
+static int replFrameAppend(replReplica *r, int type, const char *data, size_t size, long long offset) {
+    replFrame frame = { type, size, offset, offset, replNowMs() };
+    size_t need = r->size + sizeof(frame) + size;
+    if (need > ZADB_REPL_BUFFER_MAX) {
+        return 1;
+    }
+    if (need > r->cap) {
+        size_t cap = r->cap ? r->cap : 65536;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *out = realloc(r->out, cap);
+        if (out == NULL) {
+            return 1;
+        }
+        r->out = out;
+        r->cap = cap;
+    }
+    memcpy(r->out + r->size, &frame, sizeof(frame));
+    if (size > 0) {
+        memcpy(r->out + r->size + sizeof(frame), data, size);
+    }
+    r->size = need;
+    return 0;
+}
+
+/*
+ * Move start of frame to first frame not sent yet
+ */
+static void replFrameSkip(replReplica *r) {
+    replFrame frame;
+    while (r->frame < r->sent) {
+        memcpy(&frame, r->out + r->frame, sizeof(frame));
+        r->frame += sizeof(frame) + frame.size;
+    }
+}
+
+/*
+ * Send what socket takes without blocking. First unsent frame gets
+ * current offset of master.
+ *
+ * return 0 on success, 1 on error of socket
+ */
+static int replFlush(replReplica *r) {
+    replFrame frame;
+    replFrameSkip(r);
+    if (r->frame < r->size) {
+        memcpy(&frame, r->out + r->frame, sizeof(frame));
+        frame.master = replOffset;
+        memcpy(r->out + r->frame, &frame, sizeof(frame));
+    }
+    while (r->sent < r->size) {
+        ssize_t n = send(r->fd, r->out + r->sent, r->size - r->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+        r->sent += n;
+    }
+    if (r->sent == r->size) {
+        r->sent = r->size = r->frame = 0;
+    } else if (r->sent > r->cap / 2) {
+        replFrameSkip(r);
+        memmove(r->out, r->out + r->sent, r->size - r->sent);
+        r->size -= r->sent;
+        r->frame -= r->sent;
+        r->sent = 0;
+    }
+    return 0;
+}
+
+/*
+ * Forget replica. Socket is shut down, so main loop closes it.
+ */
+static void replDrop(replReplica *r, int shut) {
+    replReplica **p = &replicas;
+    while (*p != r) {
+        p = &(*p)->next;
+    }
+    *p = r->next;
+    if (r->pid > 0) {
+        int status;
+        kill(r->pid, SIGKILL);
+        waitpid(r->pid, &status, 0);
+    }
+    if (shut) {
+        fprintf(stderr, "replica dropped\n");
+        shutdown(r->fd, SHUT_RDWR);
+    }
+    free(r->out);
+    free(r);
+    if (replicas == NULL) {
+        zadbLogSetFeed(NULL);
+    }
+}
+
+/*
+ * Committed records, they are sent to all replicas
+ */
+static void replFeed(const char *data, size_t size) {
+    replOffset += size;
+    replReplica *r = replicas;
+    while (r != NULL) {
+        replReplica *next = r->next;
+        if (replFrameAppend(r, REPL_DATA, data, size, replOffset) || (r->pid < 0 && replFlush(r))) {
+            replDrop(r, 1);
+        }
+        r = next;
+    }
+}
+
+static int replChildWrite(void *ctx, const char *data, size_t size) {
+    replFrame frame = { REPL_SNAPSHOT, size, replChildOffset, replChildOffset, replNowMs() };
+    return replSendAll(replChildFd, (const char *) &frame, sizeof(frame)) || replSendAll(replChildFd, data, size);
+}
+
+/*
+ * Start full sync of replica connected by socket fd
+ *
+ * seq: version sequence, replica takes it with data
+ *
+ * return 0 if sync is started
+ */
+int zadbReplSync(int fd, RbtHandle tree, ZADB_DATA_NUM seq) {
+    replReplica *r = calloc(1, sizeof(replReplica));
+    if (r == NULL) {
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("replication fork failed");
+        free(r);
+        return 1;
+    }
+    if (pid == 0) {
+        replChildFd = fd;
+        replChildOffset = replOffset;
+        if (zadbLogWriteTree(tree, seq, 1, replChildWrite, NULL)) {
+            _exit(1);
+        }
+        replFrame frame = { REPL_SYNC_END, 0, replChildOffset, replChildOffset, replNowMs() };
+        _exit(replSendAll(fd, (const char *) &frame, sizeof(frame)));
+    }
+    r->fd = fd;
+    r->pid = pid;
+    r->ack = replOffset;
+    r->next = replicas;
+    replicas = r;
+    replFullSyncs++;
+    zadbLogSetFeed(replFeed);
+    return 0;
+}
+
+void zadbReplAck(int fd, long long offset, long long lag_ms) {
+    for (replReplica *r = replicas; r != NULL; r = r->next) {
+        if (r->fd == fd) {
+            r->ack = offset;
+            r->lag_ms = lag_ms;
+        }
+    }
+}
+
+/*
+ * Client socket is closed, it could be replica
+ */
+void zadbReplClosed(int fd) {
+    for (replReplica *r = replicas; r != NULL; r = r->next) {
+        if (r->fd == fd) {
+            replDrop(r, 0);
+            return;
+        }
+    }
+}
+
+/*
+ * Lag of replica number n
+ *
+ * return 0 if there is no such replica
+ */
+int zadbReplReplicaStat(int n, long long *lag_bytes, long long *lag_ms, int *synced) {
+    replReplica *r = replicas;
+    while (r != NULL && n-- > 0) {
+        r = r->next;
+    }
+    if (r == NULL) {
+        return 0;
+    }
+    *lag_bytes = replOffset - r->ack;
+    *lag_ms = r->lag_ms;
+    *synced = r->pid < 0;
+    return 1;
+}
+
+static void replDisconnect() {
+    if (replFd >= 0) {
+        fprintf(stderr, "replication master disconnected\n");
+        close(replFd);
+    }
+    replFd = -1;
+    replSynced = 0;
+    replInSize = 0;
+}
+
+static int replConnect() {
+    struct addrinfo hints, *res;
+    char port[16];
+    replLastConnect = replNowMs();
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", replPort);
+    if (getaddrinfo(replHost, port, &hints, &res) != 0) {
+        fprintf(stderr, "replication master %s not found\n", replHost);
+        return 1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        perror("replication connect failed");
+        if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(res);
+        return 1;
+    }
+    freeaddrinfo(res);
+    static const char sync[] = "*1\r\n$8\r\nREPLSYNC\r\n";
+    if (replSendAll(fd, sync, sizeof(sync) - 1)) {
+        close(fd);
+        return 1;
+    }
+    replFd = fd;
+    replApplied = 0;
+    replMasterOffset = 0;
+    return 0;
+}
+
+/*
+ * Start replica of master, data comes after main loop is started
+ *
+ * apply: functions to apply records
+ *
+ * return 0 if master is connected, it is connected again later otherwise
+ */
+int zadbReplConnect(const char *host, int port, const zadbLogApply *apply) {
+    snprintf(replHost, sizeof(replHost), "%s", host);
+    replPort = port;
+    replApply = apply;
+    replIsReplica = 1;
+    return replConnect();
+}
+
+int zadbReplFd() {
+    return replFd;
+}
+
+static int replHandleFrame(replFrame *frame, const char *data) {
+    int broken = 0;
+    if (frame->master > replMasterOffset) {
+        replMasterOffset = frame->master;
+    }
+    switch (frame->type) {
+    case REPL_SNAPSHOT:
+    case REPL_DATA:
+        if (zadbLogApplyRecords(data, frame->size, replApply, &broken) != frame->size || broken) {
+            fprintf(stderr, "replication stream is broken\n");
+            return 1;
+        }
+        if (frame->type == REPL_DATA) {
+            replApplied = frame->offset;
+            replLagMs = replNowMs() - frame->time_ms;
+        }
+        break;
+    case REPL_SYNC_END:
+        replSynced = 1;
+        replApplied = frame->offset;
+        break;
+    case REPL_PING:
+        replApplied = frame->offset;
+        replLagMs = replNowMs() - frame->time_ms;
+        break;
+    default:
+        fprintf(stderr, "replication frame %d is unknown\n", frame->type);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Read and apply frames from master, called when socket is readable
+ */
+void zadbReplRead() {
+    replFrame frame;
+    while (replFd >= 0) {
+        if (replInCap - replInSize < ZADB_REPL_READ_SIZE) {
+            size_t cap = replInCap ? replInCap * 2 : ZADB_REPL_READ_SIZE * 4;
+            char *in = realloc(replIn, cap);
+            if (in == NULL) {
+                replDisconnect();
+                return;
+            }
+            replIn = in;
+            replInCap = cap;
+        }
+        ssize_t n = recv(replFd, replIn + replInSize, replInCap - replInSize, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            replDisconnect();
+            return;
+        }
+        if (n < 0) {
+            break;
+        }
+        replInSize += n;
+        size_t pos = 0;
+        while (replInSize - pos >= sizeof(frame)) {
+            memcpy(&frame, replIn + pos, sizeof(frame));
+            if (replInSize - pos - sizeof(frame) < frame.size) {
+                break;
+            }
+            if (replHandleFrame(&frame, replIn + pos + sizeof(frame))) {
+                replDisconnect();
+                return;
+            }
+            pos += sizeof(frame) + frame.size;
+        }
+        memmove(replIn, replIn + pos, replInSize - pos);
+        replInSize -= pos;
+    }
+}
+
+/*
+ * Periodic work: finish of full syncs, pings and flush on master,
+ * acks and reconnect on replica
+ */
+void zadbReplTick() {
+    char ack[128];
+    long long now = replNowMs();
+    int due = now - replLastTick >= ZADB_REPL_TICK_MS;
+    if (due) {
+        replLastTick = now;
+    }
+    replReplica *r = replicas;
+    while (r != NULL) {
+        replReplica *next = r->next;
+        int status;
+        if (r->pid > 0 && waitpid(r->pid, &status, WNOHANG) == r->pid) {
+            r->pid = -1;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "replication full sync failed\n");
+                replDrop(r, 1);
+                r = next;
+                continue;
+            }
+        }
+        if (r->pid < 0 && ((due && replFrameAppend(r, REPL_PING, NULL, 0, replOffset)) || replFlush(r))) {
+            replDrop(r, 1);
+        }
+        r = next;
+    }
+    if (!replIsReplica) {
+        return;
+    }
+    if (replFd < 0 && now - replLastConnect >= ZADB_REPL_RECONNECT_MS) {
+        replConnect();
+    }
+    if (replFd >= 0 && replSynced && due) {
+        char off[32], lag[32];
+        int off_size = sprintf(off, "%lld", replApplied);
+        int lag_size = sprintf(lag, "%lld", replLagMs);
+        int size = sprintf(ack, "*3\r\n$7\r\nREPLACK\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n", off_size, off, lag_size, lag);
+        send(replFd, ack, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+/*
+ * Main loop must tick at least every ZADB_REPL_TICK_MS
+ */
+int zadbReplActive() {
+    return replicas != NULL || replIsReplica;
+}
+
+int zadbReplIsReplica() {
+    return replIsReplica;
+}
+
+void zadbReplGetStat(zadbReplStat *stat) {
+    memset(stat, 0, sizeof(*stat));
+    stat->replica = replIsReplica;
+    stat->full_syncs = replFullSyncs;
+    for (replReplica *r = replicas; r != NULL; r = r->next) {
+        stat->replicas++;
+    }
+    if (!replIsReplica) {
+        stat->offset = replOffset;
+        stat->master_offset = replOffset;
+        return;
+    }
+    stat->connected = replFd >= 0;
+    stat->synced = replSynced;
+    stat->offset = replApplied;
+    stat->master_offset = replMasterOffset;
+    stat->lag_bytes = replMasterOffset > replApplied ? replMasterOffset - replApplied : 0;
+    stat->lag_ms = replLagMs;
+}
@@ -0,0 +1,76 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+#include "rbtr.h"
+#include "zadbdata.h"
+#include "zadblog.h"
+
+#ifndef ZADBREPL_H_
+#define ZADBREPL_H_
+
+/*
+ * Master-replica replication.
+ *
+ * Replica connects to master and sends REPLSYNC. Master forks child that
+ * sends whole data as records of log, records committed meanwhile wait in
+ * buffer of replica and are sent after it. Then every commit is sent to
+ * replicas as it is written to log. Stream is made of frames, every frame
+ * has offset of master stream after it and time when it was made, frames
+ * also carry offset of master when they are sent, so replica knows how
+ * far it is behind. Replica sends REPLACK with applied
+ * offset and lag back, it serves only read commands.
+ */
+
+#define ZADB_REPL_TICK_MS 100
+
+typedef struct zadbReplStat {
+    int replica;
+    int connected;
+    int synced;
+    int replicas;
+    long long offset;
+    long long master_offset;
+    long long lag_bytes;
+    long long lag_ms;
+    long long full_syncs;
+} zadbReplStat;
+
+int zadbReplSync(int fd, RbtHandle tree, ZADB_DATA_NUM seq);
+void zadbReplAck(int fd, long long offset, long long lag_ms);
+void zadbReplClosed(int fd);
+int zadbReplReplicaStat(int n, long long *lag_bytes, long long *lag_ms, int *synced);
+
+int zadbReplConnect(const char *host, int port, const zadbLogApply *apply);
+int zadbReplFd();
+void zadbReplRead();
+
+void zadbReplTick();
+int zadbReplActive();
+int zadbReplIsReplica();
+void zadbReplGetStat(zadbReplStat *stat);
+
+#endif /* ZADBREPL_H_ */
@@ -0,0 +1,717 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "zadbshard.h"
+
+#define SHARD_MAX_CLIENTS 100
+#define SHARD_READ_SIZE 65536
+#define SHARD_RESP_MAX_DEPTH 32
+#define SHARD_CONNECT_WAIT_US 100000
+
+enum {
+    SHARD_ROUTE_FANOUT = -1, SHARD_ROUTE_MGET = -2, SHARD_ROUTE_STATS = -3, SHARD_ROUTE_NO_KEY = -4,
+    SHARD_ROUTE_BAD_SHARD = -5
+};
+
+// admin commands sent to all shards, other commands need routing argument
+static const char *shardFanoutCommands[] = {
+    "DELOLDOBJECT", "DELOLDSTATUS", "ADDINDEX", "PRINTALL", "SNAPSHOT", "SNAPSHOTSTATUS", "IMAGEMERGE",
+    "LOGREWRITE", "LOGSTATS", "REPLSTATUS", "CACHESTATS", "LUASTATS", "SCHEDSTATS", "STATS", "SLOWLOG",
+    "PROFILE", "MEMORY", NULL
+};
+
+/*
+ * Growing byte buffer
+ */
+typedef struct shardBuf {
+    char *data;
+    size_t size;
+    size_t cap;
+} shardBuf;
+
+/*
+ * Request of client waiting for replies of shards
+ */
+typedef struct shardPending {
+    int route;
+} shardPending;
+
+/*
+ * Client of router. It has own connection to every shard it used, so
+ * replies of one shard come in order of requests.
+ */
+typedef struct shardClient {
+    int fd;
+    shardBuf in;
+    int *links;
+    shardBuf *replies;
+    shardPending *pending;
+    size_t pending_head;
+    size_t pending_count;
+    size_t pending_cap;
+} shardClient;
+
+typedef struct shardStat {
+    long long requests;
+    long long fanouts;
+    long long bytes_in;
+    long long bytes_out;
+    int links;
+} shardStat;
+
+static int shardCount = 0;
+static int shardPort = 0;
+static pid_t shardPids[ZADB_SHARD_MAX];
+static shardStat shardStats[ZADB_SHARD_MAX];
+static long long shardFanouts = 0;
+static shardClient shardClients[SHARD_MAX_CLIENTS];
+
+/*
+ * Fork shard processes, only router returns with shard -1
+ *
+ * shard: out number of shard in shard process, -1 in router
+ *
+ * return 0 on success
+ */
+int zadbShardStart(int shards, int *shard) {
+    if (shards < 1 || shards > ZADB_SHARD_MAX) {
+        fprintf(stderr, "number of shards must be 1..%d\n", ZADB_SHARD_MAX);
+        return 1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < shards; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("shard fork failed");
+            return 1;
+        }
+        if (pid == 0) {
+            cpu_set_t set;
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            CPU_ZERO(&set);
+            CPU_SET(i % (cpus > 0 ? cpus : 1), &set);
+            if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+                perror("shard sched_setaffinity failed");
+            }
+            *shard = i;
+            return 0;
+        }
+        shardPids[i] = pid;
+    }
+    shardCount = shards;
+    *shard = -1;
+    return 0;
+}
+
+static void bufReserve(shardBuf *b, size_t need) {
+    if (b->size + need <= b->cap) {
+        return;
+    }
+    size_t cap = b->cap ? b->cap : SHARD_READ_SIZE;
+    while (cap < b->size + need) {
+        cap *= 2;
+    }
+    char *data = realloc(b->data, cap);
+    if (data == NULL) {
+        perror("shard buffer realloc failed");
+        exit(1);
+    }
+    b->data = data;
+    b->cap = cap;
+}
+
+static void bufAppend(shardBuf *b, const char *data, size_t size) {
+    bufReserve(b, size);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void bufConsume(shardBuf *b, size_t size) {
+    b->size -= size;
+    if (b->size > 0) {
+        memmove(b->data, b->data + size, b->size);
+    }
+}
+
+/*
+ * return 0 if connection is closed
+ */
+static int bufRead(shardBuf *b, int fd) {
+    bufReserve(b, SHARD_READ_SIZE);
+    ssize_t n = read(fd, b->data + b->size, b->cap - b->size);
+    if (n <= 0) {
+        return 0;
+    }
+    b->size += n;
+    return 1;
+}
+
+/*
+ * Size of RESP element: request or reply
+ *
+ * return size, 0 if element is not complete, -1 on error
+ */
+static long long respSize(const char *buf, const char *end, int depth) {
+    if (buf >= end) {
+        return 0;
+    }
+    const char *nl = memchr(buf, '\n', end - buf);
+    if (nl == NULL) {
+        return 0;
+    }
+    const char *p = nl + 1;
+    char type = *buf;
+    if (type == '+' || type == '-' || type == ':') {
+        return p - buf;
+    }
+    if ((type != '$' && type != '*') || depth > SHARD_RESP_MAX_DEPTH) {
+        return -1;
+    }
+    long long n = strtoll(buf + 1, NULL, 10);
+    if (type == '$') {
+        if (n < 0) {
+            return p - buf;
+        }
+        if (end - p < n + 2) {
+            return 0;
+        }
+        return p + n + 2 - buf;
+    }
+    for (long long i = 0; i < n; i++) {
+        long long size = respSize(p, end, depth + 1);
+        if (size <= 0) {
+            return size;
+        }
+        p += size;
+    }
+    return p - buf;
+}
+
+/*
+ * Read bulk string at p
+ *
+ * return position after it, NULL if element is not bulk string
+ */
+static const char *respBulk(const char *p, const char *end, const char **str, size_t *size) {
+    if (p >= end || *p != '$') {
+        return NULL;
+    }
+    const char *nl = memchr(p, '\n', end - p);
+    long long n = strtoll(p + 1, NULL, 10);
+    if (nl == NULL || n < 0 || end - nl - 1 < n + 2) {
+        return NULL;
+    }
+    *str = nl + 1;
+    *size = n;
+    return nl + 1 + n + 2;
+}
+
+static int argIs(const char *str, size_t size, const char *name) {
+    return strlen(name) == size && !memcmp(str, name, size);
+}
+
+/*
+ * Find value of argument in pairs "name value" of request or record
+ *
+ * p: first pair
+ * count: number of elements
+ * records: out position of first record array, if any
+ *
+ * return 1 if found
+ */
+static int findArg(const char *p, const char *end, long long count, const char *name, const char **value, size_t *value_size, const char **record) {
+    const char *str;
+    size_t size;
+    int is_name = 1;
+    int match = 0;
+    for (long long i = 0; i < count && p != NULL; i++) {
+        if (*p == '*') {
+            if (record != NULL && *record == NULL) {
+                *record = p;
+            }
+            long long size = respSize(p, end, 1);
+            p = size > 0 ? p + size : NULL;
+            continue;
+        }
+        const char *next = respBulk(p, end, &str, &size);
+        if (next == NULL) {
+            long long size = respSize(p, end, 1);
+            p = size > 0 ? p + size : NULL;
+            is_name = !is_name;
+            match = 0;
+            continue;
+        }
+        if (is_name) {
+            match = argIs(str, size, name);
+        } else if (match) {
+            *value = str;
+            *value_size = size;
+            return 1;
+        }
+        is_name = !is_name;
+        p = next;
+    }
+    return 0;
+}
+
+static unsigned long long hashBytes(const char *str, size_t size) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Choose shard of request
+ *
+ * return shard or one of SHARD_ROUTE_*
+ */
+static int shardRoute(const char *buf, const char *end, const char *shard_key) {
+    const char *cmd, *value, *record = NULL;
+    size_t cmd_size, value_size;
+    const char *nl = memchr(buf, '\n', end - buf);
+    long long count = strtoll(buf + 1, NULL, 10);
+    const char *p = respBulk(nl + 1, end, &cmd, &cmd_size);
+    if (p == NULL) {
+        return 0;
+    }
+    if (argIs(cmd, cmd_size, "SHARDSTATS")) {
+        return SHARD_ROUTE_STATS;
+    }
+    if (argIs(cmd, cmd_size, "MGETOBJECT") || argIs(cmd, cmd_size, "MGETEVENT")) {
+        return SHARD_ROUTE_MGET;
+    }
+    if (findArg(p, end, count - 1, "shard", &value, &value_size, NULL)) {
+        char *value_end;
+        long shard = strtol(value, &value_end, 10);
+        if (value_size == 0 || value_end != value + value_size || shard < 0 || shard >= shardCount) {
+            return SHARD_ROUTE_BAD_SHARD;
+        }
+        return shard;
+    }
+    for (const char **name = shardFanoutCommands; *name != NULL; name++) {
+        if (argIs(cmd, cmd_size, *name)) {
+            return SHARD_ROUTE_FANOUT;
+        }
+    }
+    if (findArg(p, end, count - 1, shard_key, &value, &value_size, &record)) {
+        return hashBytes(value, value_size) % shardCount;
+    }
+    // batch command: records are expected to be of one routing key
+    if (record != NULL) {
+        const char *rnl = memchr(record, '\n', end - record);
+        if (findArg(rnl + 1, end, strtoll(record + 1, NULL, 10), shard_key, &value, &value_size, NULL)) {
+            return hashBytes(value, value_size) % shardCount;
+        }
+    }
+    return SHARD_ROUTE_NO_KEY;
+}
+
+static int linkConnect(int shard) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(shardPort + 1 + shard);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void clientFree(shardClient *c) {
+    for (int i = 0; i < shardCount; i++) {
+        if (c->links[i] >= 0) {
+            close(c->links[i]);
+            shardStats[i].links--;
+        }
+        free(c->replies[i].data);
+    }
+    close(c->fd);
+    free(c->in.data);
+    free(c->links);
+    free(c->replies);
+    free(c->pending);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static int clientSend(shardClient *c, const char *data, size_t size) {
+    return send(c->fd, data, size, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+/*
+ * Send request to shard, connect if client has no link to it
+ *
+ * return 0 on success
+ */
+static int linkSend(shardClient *c, int shard, const char *data, size_t size) {
+    if (c->links[shard] < 0) {
+        c->links[shard] = linkConnect(shard);
+        if (c->links[shard] < 0) {
+            return 1;
+        }
+        shardStats[shard].links++;
+    }
+    shardStats[shard].bytes_in += size;
+    return send(c->links[shard], data, size, MSG_NOSIGNAL) != (ssize_t) size;
+}
+
+/*
+ * Size of next complete reply of shard, 0 if it is not complete yet
+ */
+static long long linkReply(shardClient *c, int shard) {
+    shardBuf *b = &c->replies[shard];
+    long long size = respSize(b->data, b->data + b->size, 0);
+    return size > 0 ? size : 0;
+}
+
+static void replyStats(shardClient *c) {
+    char line[128];
+    shardBuf out = { NULL, 0, 0 };
+    int fields = 2 + shardCount * 6;
+    bufAppend(&out, line, sprintf(line, "*%d\r\n", fields * 2));
+    bufAppend(&out, line, sprintf(line, "$6\r\nshards\r\n:%d\r\n", shardCount));
+    bufAppend(&out, line, sprintf(line, "$7\r\nfanouts\r\n:%lld\r\n", shardFanouts));
+    for (int i = 0; i < shardCount; i++) {
+        char name[64];
+        struct {
+            const char *name;
+            long long value;
+        } f[] = {
+            { "pid", shardPids[i] },
+            { "alive", kill(shardPids[i], 0) == 0 },
+            { "requests", shardStats[i].requests },
+            { "bytes_in", shardStats[i].bytes_in },
+            { "bytes_out", shardStats[i].bytes_out },
+            { "links", shardStats[i].links },
+        };
+        for (size_t j = 0; j < sizeof(f) / sizeof(f[0]); j++) {
+            int n = snprintf(name, sizeof(name), "shard%d_%s", i, f[j].name);
+            bufAppend(&out, line, sprintf(line, "$%d\r\n%s\r\n:%lld\r\n", n, name, f[j].value));
+        }
+    }
+    clientSend(c, out.data, out.size);
+    free(out.data);
+}
+
+/*
+ * Merge replies of MGET: every key is found in one shard at most,
+ * empty hash is taken if no shard has the key
+ */
+static void replyMGet(shardClient *c) {
+    const char *pos[ZADB_SHARD_MAX];
+    const char *end[ZADB_SHARD_MAX];
+    shardBuf out = { NULL, 0, 0 };
+    long long count = 0;
+    for (int i = 0; i < shardCount; i++) {
+        shardBuf *b = &c->replies[i];
+        end[i] = b->data + linkReply(c, i);
+        const char *nl = memchr(b->data, '\n', end[i] - b->data);
+        pos[i] = nl + 1;
+        if (*b->data == '*') {
+            count = strtoll(b->data + 1, NULL, 10);
+        }
+    }
+    char line[32];
+    bufAppend(&out, line, sprintf(line, "*%lld\r\n", count));
+    for (long long k = 0; k < count; k++) {
+        const char *found = NULL;
+        long long found_size = 0;
+        for (int i = 0; i < shardCount; i++) {
+            long long size = pos[i] < end[i] ? respSize(pos[i], end[i], 1) : 0;
+            if (size <= 0) {
+                continue;
+            }
+            if (found == NULL || (found_size == 4 && !memcmp(found, "*0\r\n", 4))) {
+                found = pos[i];
+                found_size = size;
+            }
+            pos[i] += size;
+        }
+        if (found == NULL) {
+            bufAppend(&out, "*0\r\n", 4);
+        } else {
+            bufAppend(&out, found, found_size);
+        }
+    }
+    clientSend(c, out.data, out.size);
+    free(out.data);
+}
+
+/*
+ * Send replies of finished requests in order of requests
+ *
+ * return 0 if client must be closed
+ */
+static int clientFlush(shardClient *c) {
+    while (c->pending_count > 0) {
+        int route = c->pending[c->pending_head].route;
+        if (route == SHARD_ROUTE_STATS) {
+            replyStats(c);
+        } else if (route == SHARD_ROUTE_NO_KEY) {
+            if (!clientSend(c, "-ERR no routing argument\r\n", 26)) {
+                return 0;
+            }
+        } else if (route == SHARD_ROUTE_BAD_SHARD) {
+            if (!clientSend(c, "-ERR wrong shard\r\n", 18)) {
+                return 0;
+            }
+        } else if (route >= 0) {
+            long long size = linkReply(c, route);
+            if (size == 0) {
+                return 1;
+            }
+            shardStats[route].bytes_out += size;
+            if (!clientSend(c, c->replies[route].data, size)) {
+                return 0;
+            }
+            bufConsume(&c->replies[route], size);
+        } else {
+            for (int i = 0; i < shardCount; i++) {
+                if (linkReply(c, i) == 0) {
+                    return 1;
+                }
+            }
+            if (route == SHARD_ROUTE_MGET) {
+                replyMGet(c);
+            } else {
+                char line[32];
+                int n = sprintf(line, "*%d\r\n", shardCount);
+                if (!clientSend(c, line, n)) {
+                    return 0;
+                }
+                for (int i = 0; i < shardCount; i++) {
+                    if (!clientSend(c, c->replies[i].data, linkReply(c, i))) {
+                        return 0;
+                    }
+                }
+            }
+            for (int i = 0; i < shardCount; i++) {
+                long long size = linkReply(c, i);
+                shardStats[i].bytes_out += size;
+                bufConsume(&c->replies[i], size);
+            }
+        }
+        c->pending_head = (c->pending_head + 1) % c->pending_cap;
+        c->pending_count--;
+    }
+    return 1;
+}
+
+static void pendingPush(shardClient *c, int route) {
+    if (c->pending_count == c->pending_cap) {
+        size_t cap = c->pending_cap ? c->pending_cap * 2 : 16;
+        shardPending *pending = malloc(cap * sizeof(shardPending));
+        if (pending == NULL) {
+            perror("shard pending alloc failed");
+            exit(1);
+        }
+        for (size_t i = 0; i < c->pending_count; i++) {
+            pending[i] = c->pending[(c->pending_head + i) % c->pending_cap];
+        }
+        free(c->pending);
+        c->pending = pending;
+        c->pending_cap = cap;
+        c->pending_head = 0;
+    }
+    c->pending[(c->pending_head + c->pending_count) % c->pending_cap].route = route;
+    c->pending_count++;
+}
+
+/*
+ * Route complete requests of client
+ *
+ * return 0 if client must be closed
+ */
+static int clientRoute(shardClient *c, const char *shard_key) {
+    size_t offset = 0;
+    while (offset < c->in.size) {
+        const char *req = c->in.data + offset;
+        const char *end = c->in.data + c->in.size;
+        long long size = respSize(req, end, 0);
+        if (size == 0) {
+            break;
+        }
+        if (size < 0 || *req != '*') {
+            return 0;
+        }
+        offset += size;
+        int route = shardRoute(req, req + size, shard_key);
+        if (route == SHARD_ROUTE_STATS || route == SHARD_ROUTE_NO_KEY || route == SHARD_ROUTE_BAD_SHARD) {
+            // sent in order after replies of shards
+        } else if (route >= 0) {
+            shardStats[route].requests++;
+            if (linkSend(c, route, req, size)) {
+                return 0;
+            }
+        } else {
+            shardFanouts++;
+            for (int i = 0; i < shardCount; i++) {
+                if (linkSend(c, i, req, size)) {
+                    return 0;
+                }
+            }
+        }
+        pendingPush(c, route);
+    }
+    bufConsume(&c->in, offset);
+    return clientFlush(c);
+}
+
+static int clientAccept(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        perror("accept failed");
+        return 1;
+    }
+    for (int i = 0; i < SHARD_MAX_CLIENTS; i++) {
+        shardClient *c = &shardClients[i];
+        if (c->fd < 0) {
+            c->fd = fd;
+            c->links = malloc(shardCount * sizeof(int));
+            c->replies = calloc(shardCount, sizeof(shardBuf));
+            if (c->links == NULL || c->replies == NULL) {
+                perror("shard client alloc failed");
+                exit(1);
+            }
+            for (int j = 0; j < shardCount; j++) {
+                c->links[j] = -1;
+            }
+            return 0;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Wait until every shard listens, shards load data before it
+ */
+static void waitShards() {
+    for (int i = 0; i < shardCount; i++) {
+        int fd;
+        while ((fd = linkConnect(i)) < 0) {
+            if (kill(shardPids[i], 0) != 0) {
+                fprintf(stderr, "shard %d is dead\n", i);
+                exit(1);
+            }
+            usleep(SHARD_CONNECT_WAIT_US);
+        }
+        close(fd);
+    }
+}
+
+/*
+ * Router loop, never returns on success
+ *
+ * listen_fd: socket for clients
+ * port: port of router, shard n listens on port + 1 + n
+ * shard_key: name of routing argument
+ */
+int zadbShardRouter(int listen_fd, int port, const char *shard_key) {
+    const int max_fds = 1 + SHARD_MAX_CLIENTS * (1 + shardCount);
+    struct pollfd *pfds = malloc(max_fds * sizeof(struct pollfd));
+    // owner of pollfd: client, and shard or -1 for client socket
+    int *owner = malloc(max_fds * sizeof(int));
+    int *owner_shard = malloc(max_fds * sizeof(int));
+    if (pfds == NULL || owner == NULL || owner_shard == NULL) {
+        perror("router alloc failed");
+        return 1;
+    }
+    shardPort = port;
+    for (int i = 0; i < SHARD_MAX_CLIENTS; i++) {
+        shardClients[i].fd = -1;
+    }
+    waitShards();
+    fprintf(stderr, "router is ready, %d shards\n", shardCount);
+    while (1) {
+        int nfds = 0;
+        pfds[nfds].fd = listen_fd;
+        pfds[nfds++].events = POLLIN;
+        for (int i = 0; i < SHARD_MAX_CLIENTS; i++) {
+            shardClient *c = &shardClients[i];
+            if (c->fd < 0) {
+                continue;
+            }
+            owner[nfds] = i;
+            owner_shard[nfds] = -1;
+            pfds[nfds].fd = c->fd;
+            pfds[nfds++].events = POLLIN;
+            for (int j = 0; j < shardCount; j++) {
+                if (c->links[j] >= 0) {
+                    owner[nfds] = i;
+                    owner_shard[nfds] = j;
+                    pfds[nfds].fd = c->links[j];
+                    pfds[nfds++].events = POLLIN;
+                }
+            }
+        }
+        if (poll(pfds, nfds, -1) < 0 && errno != EINTR) {
+            perror("router poll failed");
+            return 1;
+        }
+        if (pfds[0].revents & POLLIN) {
+            clientAccept(listen_fd);
+        }
+        for (int i = 1; i < nfds; i++) {
+            shardClient *c = &shardClients[owner[i]];
+            if (!pfds[i].revents || c->fd < 0) {
+                continue;
+            }
+            int ok;
+            if (owner_shard[i] < 0) {
+                ok = bufRead(&c->in, c->fd) && clientRoute(c, shard_key);
+            } else {
+                ok = bufRead(&c->replies[owner_shard[i]], pfds[i].fd) && clientFlush(c);
+            }
+            if (!ok) {
+                clientFree(c);
+            }
+        }
+    }
+}
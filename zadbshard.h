@@ -0,0 +1,52 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef ZADBSHARD_H_
+#define ZADBSHARD_H_
+
+/*
+ * Shared-nothing shards.
+ *
+ * Every shard is own zadb process with own tree, Lua state, cache, log
+ * and so on, pinned to one core and listening on port after router port.
+ * Router process takes client connections and sends every request to
+ * shard chosen by hash of routing argument, e.g. tenant id, so relations
+ * stay in one shard. Router keeps order of replies for every client.
+ *
+ * Admin commands (DELOLDOBJECT, ADDINDEX, SNAPSHOT, STATS and so on) are
+ * sent to all shards and reply is array of replies of shards. MGETOBJECT
+ * and MGETEVENT are sent to all shards, reply has found hash of every key.
+ * Argument pair "shard <n>" sends request to shard n. Other requests
+ * without routing argument get error.
+ */
+
+#define ZADB_SHARD_MAX 256
+#define ZADB_SHARD_DEFAULT_KEY "key"
+
+int zadbShardStart(int shards, int *shard);
+int zadbShardRouter(int listen_fd, int port, const char *shard_key);
+
+#endif /* ZADBSHARD_H_ */
@@ -0,0 +1,455 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "zadbsnap.h"
+#include "zadbimage.h"
+
+#define ZADB_SNAP_MAGIC "ZADBSNP1"
+#define ZADB_SNAP_MAGIC_SIZE 8
+#define ZADB_SNAP_BUFFER (1024 * 1024)
+#define ZADB_SNAP_PROGRESS_ENTRIES 65536
+#define ZADB_SNAP_PATH_MAX 4096
+
+/*
+ * Entry: flags byte, table (size and data) if it is not the same as in
+ * previous entry, key (shared prefix size, suffix size, suffix) if it
+ * is not the same, field (shared prefix size, suffix size, suffix) and
+ * value (zigzag number or size and data). Sizes are varints.
+ */
+#define SNAP_SAME_TABLE 1
+#define SNAP_SAME_KEY 2
+#define SNAP_INT 4
+#define SNAP_END 0xFF
+
+/*
+ * Progress sent by child, written to pipe at once
+ */
+typedef struct snapProgress {
+    long long entries;
+    long long bytes;
+    long long cow_bytes;
+} snapProgress;
+
+typedef struct snapWriter {
+    int fd;
+    int err;
+    char *buf;
+    size_t size;
+    unsigned int crc;
+    long long bytes;
+} snapWriter;
+
+static pid_t snapPid = -1;
+static int snapPipe = -1;
+static struct timespec snapStartTime;
+static zadbSnapStat snapStat;
+
+static long long snapElapsedMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - snapStartTime.tv_sec) * 1000 + (now.tv_nsec - snapStartTime.tv_nsec) / 1000000;
+}
+
+static void snapFlush(snapWriter *w) {
+    char *p = w->buf;
+    size_t size = w->size;
+    w->crc = zadbCrc32(w->crc, w->buf, w->size);
+    w->bytes += w->size;
+    w->size = 0;
+    while (size > 0 && !w->err) {
+        ssize_t n = write(w->fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("snapshot write failed");
+            w->err = 1;
+            return;
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+static void snapPut(snapWriter *w, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        if (w->size == ZADB_SNAP_BUFFER) {
+            snapFlush(w);
+        }
+        size_t n = ZADB_SNAP_BUFFER - w->size;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(w->buf + w->size, p, n);
+        w->size += n;
+        p += n;
+        size -= n;
+    }
+}
+
+static void snapPutVarint(snapWriter *w, unsigned long long v) {
+    unsigned char b[10];
+    int n = 0;
+    while (v >= 0x80) {
+        b[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    b[n++] = v;
+    snapPut(w, b, n);
+}
+
+static size_t sharedPrefix(const char *a, size_t a_size, const char *b, size_t b_size) {
+    size_t n = 0;
+    while (n < a_size && n < b_size && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+static void snapPutPart(snapWriter *w, const char *str, size_t size, const char *prev, size_t prev_size) {
+    size_t shared = sharedPrefix(str, size, prev, prev_size);
+    snapPutVarint(w, shared);
+    snapPutVarint(w, size - shared);
+    snapPut(w, str + shared, size - shared);
+}
+
+/*
+ * Bytes of pages written by this process since fork, for child it is
+ * number of pages copied because of changes in parent or child
+ */
+static long long snapPrivateDirty() {
+    char line[256];
+    long long total = 0, kb;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) {
+        f = fopen("/proc/self/smaps", "r");
+    }
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "Private_Dirty: %lld kB", &kb) == 1) {
+            total += kb;
+        }
+    }
+    fclose(f);
+    return total * 1024;
+}
+
+static void snapSendProgress(int pipefd, long long entries, long long bytes) {
+    snapProgress progress = { entries, bytes, snapPrivateDirty() };
+    if (write(pipefd, &progress, sizeof(progress)) < 0) {
+        // parent reads progress only when it is not busy, skip it
+    }
+}
+
+/*
+ * Write snapshot in child process
+ *
+ * return exit status of child
+ */
+static int snapWrite(RbtHandle tree, const char *path, ZADB_DATA_NUM seq, int pipefd) {
+    char tmp[ZADB_SNAP_PATH_MAX + 8];
+    char *table, *key, *field, *val;
+    ZADB_DATA_TYPE table_size, key_size, field_size, val_size;
+    char *p_table = NULL, *p_key = NULL, *p_field = NULL;
+    ZADB_DATA_TYPE p_table_size = 0, p_key_size = 0, p_field_size = 0;
+    ZADB_DATA_NUM num;
+    int isStr;
+    zadbDataKey zdbkey;
+    zadbDataVal zdbval;
+    long long entries = 0;
+    snapWriter w = { -1, 0, NULL, 0, 0, 0 };
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    w.buf = malloc(ZADB_SNAP_BUFFER);
+    if (w.fd < 0 || w.buf == NULL) {
+        perror("snapshot open failed");
+        return 1;
+    }
+    snapPut(&w, ZADB_SNAP_MAGIC, ZADB_SNAP_MAGIC_SIZE);
+    snapPut(&w, &seq, sizeof(seq));
+    zadbIter iterator;
+    int found = zadbIterBegin(tree, &iterator);
+    while (found && !w.err) {
+        zadbIterKeyValue(tree, &iterator, &zdbkey, &zdbval);
+        zadbKeyGet(zdbkey, &table, &table_size, &key, &key_size, &field, &field_size);
+        zadbValGet(zdbval, &val, &val_size, &num, &isStr);
+        unsigned char flags = isStr ? 0 : SNAP_INT;
+        if (p_table != NULL && table_size == p_table_size && !memcmp(table, p_table, table_size)) {
+            flags |= SNAP_SAME_TABLE;
+            if (key_size == p_key_size && !memcmp(key, p_key, key_size)) {
+                flags |= SNAP_SAME_KEY;
+            }
+        }
+        snapPut(&w, &flags, 1);
+        if (!(flags & SNAP_SAME_TABLE)) {
+            snapPutVarint(&w, table_size);
+            snapPut(&w, table, table_size);
+        }
+        if (!(flags & SNAP_SAME_KEY)) {
+            snapPutPart(&w, key, key_size, p_key, p_key_size);
+        }
+        snapPutPart(&w, field, field_size, p_field, p_field_size);
+        if (isStr) {
+            val_size = val != NULL ? val_size : 0;
+            snapPutVarint(&w, val_size);
+            snapPut(&w, val, val_size);
+        } else {
+            snapPutVarint(&w, ((unsigned long long) num << 1) ^ (unsigned long long) (num >> 63));
+        }
+        p_table = table;
+        p_table_size = table_size;
+        p_key = key;
+        p_key_size = key_size;
+        p_field = field;
+        p_field_size = field_size;
+        entries++;
+        if (entries % ZADB_SNAP_PROGRESS_ENTRIES == 0) {
+            snapSendProgress(pipefd, entries, w.bytes + w.size);
+        }
+        found = zadbIterNext(tree, &iterator);
+    }
+    unsigned char end = SNAP_END;
+    snapPut(&w, &end, 1);
+    snapPut(&w, &entries, sizeof(entries));
+    snapFlush(&w);
+    unsigned int crc = w.crc;
+    w.crc = 0;
+    snapPut(&w, &crc, sizeof(crc));
+    snapFlush(&w);
+    if (w.err || fsync(w.fd) != 0 || close(w.fd) != 0 || rename(tmp, path) != 0) {
+        perror("snapshot write failed");
+        unlink(tmp);
+        return 1;
+    }
+    snapSendProgress(pipefd, entries, w.bytes);
+    return 0;
+}
+
+/*
+ * Start snapshot in forked process
+ *
+ * seq: number saved in snapshot header and returned by load
+ *
+ * return 0 if snapshot is started
+ */
+int zadbSnapStart(RbtHandle tree, const char *path, ZADB_DATA_NUM seq) {
+    int fds[2];
+    if (snapPid > 0 || strlen(path) >= ZADB_SNAP_PATH_MAX) {
+        return 1;
+    }
+    if (pipe(fds) != 0) {
+        perror("snapshot pipe failed");
+        return 1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("snapshot fork failed");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(snapWrite(tree, path, seq, fds[1]));
+    }
+    close(fds[1]);
+    snapPid = pid;
+    snapPipe = fds[0];
+    clock_gettime(CLOCK_MONOTONIC, &snapStartTime);
+    snapStat.running = 1;
+    snapStat.entries = 0;
+    snapStat.bytes = 0;
+    snapStat.cow_bytes = 0;
+    snapStat.duration_ms = 0;
+    snapStat.seq = seq;
+    return 0;
+}
+
+/*
+ * Read progress of child and finish snapshot when child exits
+ */
+void zadbSnapTick() {
+    snapProgress progress;
+    int status;
+    if (snapPid < 0) {
+        return;
+    }
+    while (read(snapPipe, &progress, sizeof(progress)) == sizeof(progress)) {
+        snapStat.entries = progress.entries;
+        snapStat.bytes = progress.bytes;
+        snapStat.cow_bytes = progress.cow_bytes;
+    }
+    if (waitpid(snapPid, &status, WNOHANG) != snapPid) {
+        return;
+    }
+    while (read(snapPipe, &progress, sizeof(progress)) == sizeof(progress)) {
+        snapStat.entries = progress.entries;
+        snapStat.bytes = progress.bytes;
+        snapStat.cow_bytes = progress.cow_bytes;
+    }
+    close(snapPipe);
+    snapPipe = -1;
+    snapPid = -1;
+    snapStat.running = 0;
+    snapStat.last_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    snapStat.duration_ms = snapElapsedMs();
+    snapStat.snapshots++;
+    if (!snapStat.last_ok) {
+        fprintf(stderr, "snapshot failed\n");
+    }
+}
+
+void zadbSnapGetStat(zadbSnapStat *stat) {
+    *stat = snapStat;
+    if (snapStat.running) {
+        stat->duration_ms = snapElapsedMs();
+    }
+}
+
+static const unsigned char *snapGetVarint(const unsigned char *p, const unsigned char *end, unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        *v |= (unsigned long long) (*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const unsigned char *snapGetPart(const unsigned char *p, const unsigned char *end, char *buf, size_t *size) {
+    unsigned long long shared, suffix;
+    if ((p = snapGetVarint(p, end, &shared)) == NULL || (p = snapGetVarint(p, end, &suffix)) == NULL) {
+        return NULL;
+    }
+    if (shared > *size || shared + suffix > ZADB_DATA_MAXSIZE || (size_t) (end - p) < suffix) {
+        return NULL;
+    }
+    memcpy(buf + shared, p, suffix);
+    *size = shared + suffix;
+    return p + suffix;
+}
+
+/*
+ * Load snapshot to tree with apply functions of log
+ *
+ * seq: out number saved in snapshot
+ *
+ * return 0 on success
+ */
+int zadbSnapLoad(const char *path, const zadbLogApply *apply, ZADB_DATA_NUM *seq) {
+    static char key[ZADB_DATA_MAXSIZE], field[ZADB_DATA_MAXSIZE];
+    size_t key_size = 0, field_size = 0;
+    unsigned long long table_size = 0, val_size, v;
+    const unsigned char *table = NULL;
+    long long entries = 0, saved_entries;
+    struct stat st;
+    unsigned int crc;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("snapshot open failed");
+        return 1;
+    }
+    size_t size = st.st_size;
+    size_t min_size = ZADB_SNAP_MAGIC_SIZE + sizeof(*seq) + 1 + sizeof(entries) + sizeof(crc);
+    if (size < min_size) {
+        fprintf(stderr, "snapshot %s is too small\n", path);
+        close(fd);
+        return 1;
+    }
+    const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("snapshot mmap failed");
+        return 1;
+    }
+    memcpy(&crc, data + size - sizeof(crc), sizeof(crc));
+    if (memcmp(data, ZADB_SNAP_MAGIC, ZADB_SNAP_MAGIC_SIZE) || crc != zadbCrc32(0, data, size - sizeof(crc))) {
+        fprintf(stderr, "snapshot %s is broken\n", path);
+        munmap((void *) data, size);
+        return 1;
+    }
+    madvise((void *) data, size, MADV_SEQUENTIAL);
+    memcpy(seq, data + ZADB_SNAP_MAGIC_SIZE, sizeof(*seq));
+    const unsigned char *p = data + ZADB_SNAP_MAGIC_SIZE + sizeof(*seq);
+    const unsigned char *end = data + size - sizeof(entries) - sizeof(crc);
+    while (p != NULL && p < end && *p != SNAP_END) {
+        unsigned char flags = *p++;
+        if (!(flags & SNAP_SAME_TABLE)) {
+            if ((p = snapGetVarint(p, end, &table_size)) == NULL || table_size > ZADB_DATA_MAXSIZE || (size_t) (end - p) < table_size) {
+                p = NULL;
+                break;
+            }
+            table = p;
+            p += table_size;
+        }
+        if (!(flags & SNAP_SAME_KEY) && (p = snapGetPart(p, end, key, &key_size)) == NULL) {
+            break;
+        }
+        if ((p = snapGetPart(p, end, field, &field_size)) == NULL) {
+            break;
+        }
+        if (flags & SNAP_INT) {
+            if ((p = snapGetVarint(p, end, &v)) == NULL) {
+                break;
+            }
+            apply->setInt((const char *) table, table_size, key, key_size, field, field_size, (ZADB_DATA_NUM) ((v >> 1) ^ -(v & 1)));
+        } else {
+            if ((p = snapGetVarint(p, end, &val_size)) == NULL || (size_t) (end - p) < val_size) {
+                p = NULL;
+                break;
+            }
+            apply->setStr((const char *) table, table_size, key, key_size, field, field_size, (const char *) p, val_size);
+            p += val_size;
+        }
+        entries++;
+    }
+    memcpy(&saved_entries, end, sizeof(saved_entries));
+    int rc = p == NULL || p >= end || *p != SNAP_END || entries != saved_entries;
+    if (rc) {
+        fprintf(stderr, "snapshot %s has wrong data after %lld entries\n", path, entries);
+    }
+    munmap((void *) data, size);
+    return rc;
+}
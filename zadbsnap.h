@@ -0,0 +1,63 @@
+
+/*
+
+MIT License
+
+Copyright (c) 2022 Alexander Zazhigin mykeich@yandex.ru
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stddef.h>
+#include "rbtr.h"
+#include "zadbdata.h"
+#include "zadblog.h"
+
+#ifndef ZADBSNAP_H_
+#define ZADBSNAP_H_
+
+/*
+ * Point in time binary snapshot of tree.
+ *
+ * Snapshot is written by forked process, parent continues to serve and
+ * gets progress from child by pipe. Entries are written in tree order,
+ * table and key are written only if they differ from previous entry and
+ * then as shared prefix length and suffix, so does field. File ends with
+ * number of entries and crc32 of whole file. Tree over base image is
+ * written merged with image.
+ */
+
+typedef struct zadbSnapStat {
+    int running;
+    int last_ok;
+    long long snapshots;
+    long long entries;
+    long long bytes;
+    long long cow_bytes;
+    long long duration_ms;
+    ZADB_DATA_NUM seq;
+} zadbSnapStat;
+
+int zadbSnapStart(RbtHandle tree, const char *path, ZADB_DATA_NUM seq);
+void zadbSnapTick();
+void zadbSnapGetStat(zadbSnapStat *stat);
+
+int zadbSnapLoad(const char *path, const zadbLogApply *apply, ZADB_DATA_NUM *seq);
+
+#endif /* ZADBSNAP_H_ */